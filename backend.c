@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "mock.h"
+
+
+static int KernelOpen(const char *device, int flags)
+{
+	return open(device, flags);
+}
+
+
+static int KernelIoctl(int fd, unsigned long request, void *arg)
+{
+	return ioctl(fd, request, arg);
+}
+
+
+static void *KernelMmap(size_t length, int fd, off_t offset)
+{
+	return mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+}
+
+
+static const struct v4l2_backend kernel_backend = {
+	.name = "kernel",
+	.open = KernelOpen,
+	.close = close,
+	.ioctl = KernelIoctl,
+	.mmap = KernelMmap,
+	.munmap = munmap,
+	.poll = poll,
+};
+
+#define BACKEND_MAX_FDS	32	///< decoders open at once
+
+/// the backend of each open decoder, mock and kernel ones can be mixed
+static struct {
+	int fd;
+	const struct v4l2_backend *backend;
+} backends[BACKEND_MAX_FDS];
+
+
+///
+/// Backend of a decoder fd, the kernel for the fds it didn't open.
+///
+static const struct v4l2_backend *BackendFind(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < BACKEND_MAX_FDS; i++) {
+		if (backends[i].backend && backends[i].fd == fd)
+			return backends[i].backend;
+	}
+	return &kernel_backend;
+}
+
+
+///
+/// Open the decoder. "mock" or "mock:<options>" selects the software
+/// decoder in this process, everything else is a V4L2 device node.
+///
+int V4l2Open(const char *device, int flags)
+{
+	const struct v4l2_backend *backend = &kernel_backend;
+	unsigned int slot;
+	int fd;
+
+	if (!strncmp(device, "mock", 4) && (!device[4] || device[4] == ':'))
+		backend = &mock_backend;
+
+	for (slot = 0; slot < BACKEND_MAX_FDS && backends[slot].backend; slot++)
+		;
+	if (slot == BACKEND_MAX_FDS) {
+		errno = EMFILE;
+		return -1;
+	}
+	if ((fd = backend->open(device, flags)) < 0)
+		return fd;
+	backends[slot].fd = fd;
+	backends[slot].backend = backend;
+
+	return fd;
+}
+
+
+int V4l2Close(int fd)
+{
+	const struct v4l2_backend *backend = BackendFind(fd);
+	unsigned int i;
+
+	for (i = 0; i < BACKEND_MAX_FDS; i++) {
+		if (backends[i].backend && backends[i].fd == fd)
+			backends[i].backend = NULL;
+	}
+	return backend->close(fd);
+}
+
+
+int V4l2Ioctl(int fd, unsigned long request, void *arg)
+{
+	return BackendFind(fd)->ioctl(fd, request, arg);
+}
+
+
+void *V4l2Mmap(size_t length, int fd, off_t offset)
+{
+	return BackendFind(fd)->mmap(length, fd, offset);
+}
+
+
+int V4l2Munmap(void *addr, size_t length, int fd)
+{
+	return BackendFind(fd)->munmap(addr, length);
+}
+
+
+///
+/// poll() that understands the decoder fds of the backends. A mock
+/// fd in the set hands all of them to the mock, it polls the others.
+///
+int V4l2Poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	const struct v4l2_backend *backend = &kernel_backend;
+	nfds_t i;
+
+	for (i = 0; i < nfds && backend == &kernel_backend; i++)
+		backend = BackendFind(fds[i].fd);
+	return backend->poll(fds, nfds, timeout);
+}
@@ -0,0 +1,25 @@
+
+///
+/// Decoder access: the kernel driver or the in-process mock.
+///
+struct v4l2_backend {
+	const char *name;
+	int (*open)(const char *device, int flags);
+	int (*close)(int fd);
+	int (*ioctl)(int fd, unsigned long request, void *arg);
+	void *(*mmap)(size_t length, int fd, off_t offset);
+	int (*munmap)(void *addr, size_t length);
+	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+};
+
+int V4l2Open(const char *device, int flags);
+
+int V4l2Close(int fd);
+
+int V4l2Ioctl(int fd, unsigned long request, void *arg);
+
+void *V4l2Mmap(size_t length, int fd, off_t offset);
+
+int V4l2Munmap(void *addr, size_t length, int fd);
+
+int V4l2Poll(struct pollfd *fds, nfds_t nfds, int timeout);
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "main.h"
+#include "backend.h"
+#include "bench.h"
+#include "stream.h"
+#include "v4l2.h"
+
+#define BENCH_RING	1024	///< OUTPUT buffers in flight, power of 2
+#define BENCH_STALL_MS	5000	///< give up if the decoder stops
+#define BENCH_MAX_STREAMS	16	///< decoder instances at once
+
+struct bench_run {
+	const char *file;
+	const char *codec;
+	int width, height;
+	int ok;
+	int streams;			///< decoders running at once
+	unsigned long frames;
+	double seconds;
+	double cpu_seconds;		///< process time, shared evenly by the streams
+	double aggregate_fps;		///< all streams of the run together
+	double *latency;		///< QBUF -> DQBUF per frame in ms
+	unsigned long count_latency;
+	unsigned long size_latency;
+};
+
+///
+/// One decoder instance of a run, with an input of its own.
+///
+struct bench_dec {
+	struct bench_run *run;
+	struct decoder dec;
+	struct stream *stream;		///< NULL if the open failed
+	AVPacket pkt;
+	int have_pkt;
+	int eof;
+	int drain;
+	int capture;
+	int done;
+	double start, last;
+	double qbuf_time[BENCH_RING];	///< QBUF time of the last OUTPUT buffers
+	int64_t qbuf_tag[BENCH_RING];	///< ... and their timestamps
+};
+
+
+static double Now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+///
+/// QBUF time of the frame a capture buffer was decoded from.
+/// @returns 0 or -1 if it is too long ago.
+///
+static int QbufTime(struct bench_dec *b, int64_t tag, int queued, double *time)
+{
+	int i;
+
+	// the first buffer of a split frame
+	for (i = queued > BENCH_RING ? queued - BENCH_RING : 0; i < queued; i++) {
+		if (b->qbuf_tag[i & (BENCH_RING - 1)] == tag) {
+			*time = b->qbuf_time[i & (BENCH_RING - 1)];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+static void AddLatency(struct bench_run *run, double ms)
+{
+	double *latency;
+
+	if (run->count_latency == run->size_latency) {
+		run->size_latency = run->size_latency ? run->size_latency * 2 : 1024;
+		if (!(latency = realloc(run->latency, run->size_latency * sizeof(double))))
+			return;
+		run->latency = latency;
+	}
+	run->latency[run->count_latency++] = ms;
+}
+
+
+static int CompareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static double Percentile(struct bench_run *run, int p)
+{
+	if (!run->count_latency)
+		return 0;
+
+	return run->latency[(run->count_latency - 1) * p / 100];
+}
+
+
+static void BenchSelect(struct bench_dec *b)
+{
+	StreamSelect(b->stream);
+	V4l2Select(&b->dec);
+}
+
+
+///
+/// Open a decoder instance and the input of its run.
+///
+static int BenchOpen(struct bench_dec *b, const char *device, unsigned int out_buffers)
+{
+	AVCodecParameters *par;
+
+	if ((b->dec.fd = V4l2Open(device, O_RDWR | O_NONBLOCK)) < 0) {
+		fprintf(stderr, "BenchOpen: open %s failed: (%d): %m\n", device, errno);
+		return -1;
+	}
+	if (!(b->stream = StreamNew()))
+		goto close;
+	BenchSelect(b);
+	if (StreamOpen((char *)b->run->file))
+		goto stream;
+
+	par = StreamCodecParameters();
+	b->run->codec = avcodec_get_name(par->codec_id);
+	if (V4l2SetupOutput(out_buffers))
+		goto input;
+
+	av_init_packet(&b->pkt);
+	return 0;
+
+input:
+	StreamClose();
+stream:
+	StreamDelete(b->stream);
+	b->stream = NULL;
+close:
+	V4l2Close(b->dec.fd);
+	return -1;
+}
+
+
+///
+/// Fill the free OUTPUT buffers and take the decoded frames, no waiting.
+///
+static void BenchStep(struct bench_dec *b)
+{
+	struct bench_run *run = b->run;
+	int queued;
+	int index = 0;
+	double qbuf;
+	int ret;
+
+	BenchSelect(b);
+
+	// fill all free OUTPUT buffers
+	while (!b->eof) {
+		if (!b->have_pkt) {
+			if (ReadPacket(&b->pkt)) {
+				b->eof = 1;
+				break;
+			}
+			b->have_pkt = 1;
+		}
+		queued = dec->start;
+		if ((ret = QueuePacketOut(&b->pkt, 0)) > 0)
+			break;
+		b->have_pkt = 0;
+		if (ret < 0) {
+			fprintf(stderr, "BenchStep: the decoder takes no more data\n");
+			b->done = 1;
+			return;
+		}
+		for (; queued < dec->start; queued++) {
+			b->qbuf_time[queued & (BENCH_RING - 1)] = Now(CLOCK_MONOTONIC);
+			b->qbuf_tag[queued & (BENCH_RING - 1)] = V4l2OutputTag();
+		}
+	}
+	if (b->eof && !b->drain)
+		b->drain = !V4l2Drain();
+
+	if (b->capture && V4l2CaptureChanged()) {
+		V4l2ReleaseCapture();
+		b->capture = 0;
+	}
+	if (!b->capture && dec->start && !V4l2SetupCapture(0)) {
+		b->capture = 1;
+		run->width = dec->cap_fmt.fmt.pix_mp.width;
+		run->height = dec->cap_fmt.fmt.pix_mp.height;
+	}
+
+	// drain the capture queue
+	while (b->capture && (index = DequeueIndexCapture()) >= 0) {
+		b->last = Now(CLOCK_MONOTONIC);
+		if (!QbufTime(b, V4l2CaptureTag(), dec->start, &qbuf))
+			AddLatency(run, (b->last - qbuf) * 1000);
+		QueueBufferCapture(index);
+		run->frames++;
+	}
+	if (b->capture && index == -EPIPE) {
+		run->ok = 1;
+		b->done = 1;
+	} else if (b->capture && index != -EAGAIN) {
+		b->done = 1;
+	}
+}
+
+
+static void BenchClose(struct bench_dec *b)
+{
+	struct bench_run *run = b->run;
+
+	if (!b->stream)
+		return;
+	run->seconds = b->last - b->start;
+	qsort(run->latency, run->count_latency, sizeof(double), CompareDouble);
+
+	BenchSelect(b);
+	if (b->have_pkt)
+		av_packet_unref(&b->pkt);
+	StreamOff();
+	if (b->capture)
+		V4l2ReleaseCapture();
+	MunmapBuffer();
+	StreamClose();
+	StreamDelete(b->stream);
+	V4l2Close(b->dec.fd);
+}
+
+
+///
+/// Decode the inputs of the runs at once, one decoder instance each, as
+/// fast as the decoders go, no display.
+/// @param runs		results, one per instance
+/// @param streams	number of instances
+///
+static void BenchDecode(struct bench_run runs[], int streams, const char *device,
+	unsigned int out_buffers, volatile sig_atomic_t *quit)
+{
+	struct bench_dec *b[BENCH_MAX_STREAMS];
+	struct pollfd pfd[BENCH_MAX_STREAMS];
+	int index[BENCH_MAX_STREAMS];
+	double start, cpu_start, now, last = 0;
+	unsigned long frames = 0;
+	int i, n, ret, timeout;
+
+	for (i = 0; i < streams; i++) {
+		if ((b[i] = calloc(1, sizeof(**b)))) {
+			b[i]->run = &runs[i];
+			b[i]->done = BenchOpen(b[i], device, out_buffers) != 0;
+		}
+	}
+
+	start = Now(CLOCK_MONOTONIC);
+	cpu_start = Now(CLOCK_PROCESS_CPUTIME_ID);
+	for (i = 0; i < streams; i++) {
+		if (b[i])
+			b[i]->start = b[i]->last = start;
+	}
+
+	while (!*quit) {
+		// poll the header more often
+		timeout = 1000;
+		for (i = n = 0; i < streams; i++) {
+			if (!b[i] || b[i]->done)
+				continue;
+			BenchStep(b[i]);
+			if (b[i]->done)
+				continue;
+
+			pfd[n].fd = b[i]->dec.fd;
+			pfd[n].events = POLLPRI;
+			if (!b[i]->eof)
+				pfd[n].events |= POLLOUT;
+			if (b[i]->capture)
+				pfd[n].events |= POLLIN;
+			else
+				timeout = 10;
+			pfd[n].revents = 0;
+			index[n++] = i;
+		}
+		if (!n)
+			break;
+
+		if ((ret = V4l2Poll(pfd, n, timeout)) < 0 && errno != EINTR) {
+			fprintf(stderr, "BenchDecode: poll failed: (%d): %m\n", errno);
+			break;
+		}
+		now = Now(CLOCK_MONOTONIC);
+		for (i = 0; i < n; i++) {
+			if (pfd[i].revents & POLLPRI) {
+				BenchSelect(b[index[i]]);
+				V4l2HandleEvent();
+			}
+			if (!ret && now - b[index[i]]->last > BENCH_STALL_MS / 1000.0) {
+				fprintf(stderr, "BenchDecode: %s: decoder stalled\n",
+					b[index[i]]->run->file);
+				b[index[i]]->done = 1;
+			}
+		}
+	}
+
+	now = Now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	for (i = 0; i < streams; i++) {
+		runs[i].streams = streams;
+		runs[i].cpu_seconds = now / streams;
+		if (!b[i])
+			continue;
+		BenchClose(b[i]);
+		if (b[i]->last > last)
+			last = b[i]->last;
+		free(b[i]);
+	}
+	StreamSelect(NULL);
+	V4l2Select(NULL);
+
+	// the streams end apart, the last one ends the run
+	for (i = 0; i < streams; i++)
+		frames += runs[i].frames;
+	for (i = 0; i < streams; i++)
+		runs[i].aggregate_fps = last > start ? frames / (last - start) : 0.0;
+}
+
+
+static void JsonString(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+
+static void JsonRun(FILE *f, struct bench_run *run)
+{
+	fprintf(f, "    { \"file\": ");
+	JsonString(f, run->file);
+	fprintf(f, ", \"codec\": ");
+	JsonString(f, run->codec);
+	fprintf(f, ", \"status\": \"%s\", \"width\": %i, \"height\": %i,\n",
+		run->ok ? "ok" : "error", run->width, run->height);
+	fprintf(f, "      \"frames\": %lu, \"seconds\": %.3f, \"fps\": %.2f,\n",
+		run->frames, run->seconds, run->seconds > 0 ? run->frames / run->seconds : 0.0);
+	fprintf(f, "      \"streams\": %i, \"aggregate_fps\": %.2f,\n",
+		run->streams, run->aggregate_fps);
+	fprintf(f, "      \"latency_ms\": { \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+		Percentile(run, 50), Percentile(run, 95), Percentile(run, 99), Percentile(run, 100));
+	fprintf(f, "      \"cpu_ms_per_frame\": %.3f }",
+		run->frames ? run->cpu_seconds * 1000 / run->frames : 0.0);
+}
+
+
+///
+/// Decode the files without display and write the results as JSON.
+/// @param device	V4L2 decoder
+/// @param files	inputs
+/// @param count	number of inputs
+/// @param runs		decode each input this often
+/// @param streams	also decode 2 .. streams copies of each input at once
+/// @param out_buffers	number of OUTPUT buffers
+/// @param json		output file, NULL for stdout
+/// @returns 0 if all runs decoded to the end.
+///
+int BenchRun(const char *device, char *files[], int count, int runs, int streams,
+	unsigned int out_buffers, const char *json, volatile sig_atomic_t *quit)
+{
+	struct bench_run run[BENCH_MAX_STREAMS];
+	struct v4l2_capability caps;
+	struct utsname uts;
+	FILE *f = stdout;
+	int i, r, k, s, fd;
+	int first = 1;
+	int failed = 0;
+
+	streams = streams < 1 ? 1 : streams > BENCH_MAX_STREAMS ? BENCH_MAX_STREAMS : streams;
+
+	memset(&caps, 0, sizeof(caps));
+	if ((fd = V4l2Open(device, O_RDWR | O_NONBLOCK)) >= 0) {
+		V4l2Ioctl(fd, VIDIOC_QUERYCAP, &caps);
+		V4l2Close(fd);
+	}
+	uname(&uts);
+
+	if (json && !(f = fopen(json, "w"))) {
+		fprintf(stderr, "BenchRun: cannot write %s: (%d): %m\n", json, errno);
+		return -1;
+	}
+
+	fprintf(f, "{\n  \"device\": ");
+	JsonString(f, device);
+	fprintf(f, ", \"driver\": ");
+	JsonString(f, (char *)caps.driver);
+	fprintf(f, ", \"card\": ");
+	JsonString(f, (char *)caps.card);
+	fprintf(f, ",\n  \"kernel\": ");
+	JsonString(f, uts.release);
+	fprintf(f, ", \"out_buffers\": %u, \"streams\": %i,\n  \"runs\": [\n",
+		out_buffers, streams);
+
+	// how the throughput scales with the instances on one device
+	for (i = 0; i < count && !*quit; i++) {
+		for (r = 0; r < runs && !*quit; r++) {
+			for (k = 1; k <= streams && !*quit; k++) {
+				memset(run, 0, sizeof(run));
+				for (s = 0; s < k; s++)
+					run[s].file = files[i];
+				BenchDecode(run, k, device, out_buffers, quit);
+
+				fprintf(stderr, "BenchRun: %s %i streams %.2f fps\n", files[i],
+					k, run[0].aggregate_fps);
+				for (s = 0; s < k; s++) {
+					failed |= !run[s].ok;
+					fprintf(stderr, "BenchRun: %s %lu frames %.2f fps\n",
+						run[s].file, run[s].frames, run[s].seconds > 0
+						? run[s].frames / run[s].seconds : 0.0);
+					if (!first)
+						fprintf(f, ",\n");
+					first = 0;
+					JsonRun(f, &run[s]);
+					free(run[s].latency);
+				}
+			}
+		}
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	if (f != stdout)
+		fclose(f);
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,3 @@
+
+int BenchRun(const char *device, char *files[], int count, int runs, int streams,
+	unsigned int out_buffers, const char *json, volatile sig_atomic_t *quit);
@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "detile.h"
+
+#define BENCH_ALIGN(val, align)	(((val) + ((align) - 1)) & ~((align) - 1))
+
+static const char *const bench_impls[] = { "scalar", "sse2", "avx2", "neon" };
+
+static const struct {
+	const char *name;
+	unsigned int width, height;
+} bench_sizes[] = {
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 },
+	{ "2160p", 3840, 2160 },
+};
+
+///
+/// NV12 frame as the decoder and the dumb buffer lay it out.
+///
+struct bench_frame {
+	unsigned int width, height;
+	unsigned int src_pitch, src_lines;	///< V4L2: 64 byte lines, 16 line macroblocks
+	unsigned int dst_pitch, dst_lines;	///< DrmSetupFb: 128 bytes, 64 lines
+	uint8_t *src, *dst;
+};
+
+
+static double BenchNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+///
+/// What the copy path did before: each plane in one memcpy, padding and
+/// all, as if both sides had the same pitch.
+///
+static void BenchMemcpy(struct bench_frame *f)
+{
+	size_t luma = (size_t)f->src_pitch * f->src_lines;
+
+	memcpy(f->dst, f->src, luma);
+	memcpy(f->dst + (size_t)f->dst_pitch * f->dst_lines, f->src + luma, luma / 2);
+}
+
+
+static void BenchCopy(struct bench_frame *f)
+{
+	size_t luma = (size_t)f->src_pitch * f->src_lines;
+
+	CopyPlane(f->dst, f->dst_pitch, f->src, f->src_pitch, f->width, f->height);
+	CopyPlane(f->dst + (size_t)f->dst_pitch * f->dst_lines, f->dst_pitch, f->src + luma,
+		f->src_pitch, f->width, f->height / 2);
+}
+
+
+///
+/// The visible lines arrived and nothing else was written.
+///
+static int BenchCheck(struct bench_frame *f)
+{
+	size_t luma_src = (size_t)f->src_pitch * f->src_lines;
+	size_t luma_dst = (size_t)f->dst_pitch * f->dst_lines;
+	unsigned int y;
+
+	for (y = 0; y < f->height * 3 / 2; y++) {
+		const uint8_t *s = y < f->height ? f->src + (size_t)y * f->src_pitch
+			: f->src + luma_src + (size_t)(y - f->height) * f->src_pitch;
+		const uint8_t *d = y < f->height ? f->dst + (size_t)y * f->dst_pitch
+			: f->dst + luma_dst + (size_t)(y - f->height) * f->dst_pitch;
+
+		if (memcmp(d, s, f->width) || d[f->width] != 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+static double BenchRun(struct bench_frame *f, void (*copy)(struct bench_frame *),
+	unsigned int frames)
+{
+	unsigned int i;
+	double t;
+
+	copy(f);
+	t = BenchNow();
+	for (i = 0; i < frames; i++)
+		copy(f);
+	return BenchNow() - t;
+}
+
+
+///
+/// Microbenchmark of the stride-aware plane copy against one flat memcpy
+/// per plane, at the common frame sizes.
+/// Usage: copy_bench [<frames>]
+///
+int main(int c, char *v[])
+{
+	unsigned int frames = c > 1 ? strtoul(v[1], NULL, 0) : 200;
+	struct bench_frame f;
+	unsigned int s, threads, i;
+	size_t size_src, size_dst, visible;
+	double t;
+
+	if (!frames) {
+		fprintf(stderr, "Usage: %s [<frames>]\n", v[0]);
+		return 1;
+	}
+
+	for (s = 0; s < sizeof(bench_sizes) / sizeof(*bench_sizes); s++) {
+		f.width = bench_sizes[s].width;
+		f.height = bench_sizes[s].height;
+		f.src_pitch = BENCH_ALIGN(f.width, 64);
+		f.src_lines = BENCH_ALIGN(f.height, 16);
+		f.dst_pitch = BENCH_ALIGN(f.width, 128) + 128;	// pitches differ
+		f.dst_lines = BENCH_ALIGN(f.height, 64);
+		size_src = (size_t)f.src_pitch * f.src_lines * 3 / 2;
+		size_dst = (size_t)f.dst_pitch * f.dst_lines * 3 / 2;
+		visible = (size_t)f.width * f.height * 3 / 2;
+
+		f.src = aligned_alloc(4096, BENCH_ALIGN(size_src, 4096));
+		f.dst = aligned_alloc(4096, BENCH_ALIGN(size_dst, 4096));
+		if (!f.src || !f.dst) {
+			fprintf(stderr, "copy_bench: out of memory\n");
+			return 1;
+		}
+		for (i = 0; i < size_src; i++)
+			f.src[i] = i * 7 + 1;
+
+		printf("%s NV12 %ux%u, pitch %u -> %u, %u frames\n", bench_sizes[s].name,
+			f.width, f.height, f.src_pitch, f.dst_pitch, frames);
+		t = BenchRun(&f, BenchMemcpy, frames);
+		printf("  memcpy            %7.2f GB/s %8.1f fps (%zu bytes per frame)\n",
+			(double)visible * frames / t / 1e9, frames / t, size_src);
+
+		for (threads = 1; threads <= DETILE_MAX_THREADS; threads *= 2) {
+			DetileInit(threads);
+			for (i = 0; i < sizeof(bench_impls) / sizeof(*bench_impls); i++) {
+				if (DetileSelect(bench_impls[i]))
+					continue;
+
+				memset(f.dst, 0, size_dst);
+				BenchCopy(&f);
+				if (BenchCheck(&f)) {
+					printf("  %-6s %u threads: wrong copy\n", DetileName(), threads);
+					continue;
+				}
+				t = BenchRun(&f, BenchCopy, frames);
+				printf("  %-6s %u threads: %7.2f GB/s %8.1f fps\n", DetileName(),
+					threads, (double)visible * frames / t / 1e9, frames / t);
+			}
+			DetileDeInit();
+		}
+
+		free(f.src);
+		free(f.dst);
+	}
+
+	return 0;
+}
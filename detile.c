@@ -0,0 +1,557 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "detile.h"
+
+#define DETILE_ALIGN(val, align)	(((val) + ((align) - 1)) & ~((align) - 1))
+#define DETILE_SIZE	(DETILE_W * DETILE_H)
+#define DETILE_MIN_ROWS	4	///< bands per thread, below the caller works alone
+
+///
+/// Copies one tile to the linear picture, full DETILE_W rows.
+///
+typedef void (*detile_fn)(uint8_t *dst, unsigned int pitch, const uint8_t *src,
+	unsigned int rows);
+
+///
+/// Copies one line, past the cache if the CPU can.
+///
+typedef void (*copy_fn)(uint8_t *dst, const uint8_t *src, unsigned int len);
+
+struct detile_impl {
+	const char *name;
+	detile_fn tile;
+	copy_fn copy;
+	int (*supported)(void);
+};
+
+///
+/// A plane split in bands of DETILE_H lines, a tile row when detiling.
+///
+struct detile_job {
+	uint8_t *dst;
+	unsigned int dst_pitch;
+	const uint8_t *src;
+	unsigned int src_pitch;
+	unsigned int x_tiles, y_tiles;	///< of the allocated plane
+	unsigned int width, height;
+	unsigned int bands;
+	void (*band)(struct detile_job *job, unsigned int band);
+	detile_fn tile;
+	copy_fn copy;
+	_Atomic unsigned int next_band;	///< next band to convert
+};
+
+static struct {
+	pthread_t threads[DETILE_MAX_THREADS];
+	unsigned int count;		///< workers, the caller works too
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned long gen;		///< bumped for every job
+	unsigned int busy;		///< workers still on the job
+	int quit;
+	struct detile_job job;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+
+///
+/// Index of a tile in the Z-flipped-Z order of NV12MT: pairs of tile
+/// rows are stored as Z shapes of 2x2 tiles, every other one mirrored.
+/// A single last row is linear.
+///
+static unsigned int DetilePos(unsigned int x, unsigned int y, unsigned int x_tiles,
+	unsigned int y_tiles)
+{
+	unsigned int pos = (y & ~1) * x_tiles + x;
+
+	if (y & 1)
+		pos += (x & ~3) + 2;
+	else if (!(y_tiles & 1) || y != y_tiles - 1)
+		pos += (x + 2) & ~3;
+
+	return pos;
+}
+
+
+static void DetileTileScalar(uint8_t *dst, unsigned int pitch, const uint8_t *src,
+	unsigned int rows)
+{
+	unsigned int r, i;
+
+	for (r = 0; r < rows; r++) {
+		for (i = 0; i < DETILE_W; i++)
+			dst[i] = src[i];
+		dst += pitch;
+		src += DETILE_W;
+	}
+}
+
+
+static void CopyRowScalar(uint8_t *dst, const uint8_t *src, unsigned int len)
+{
+	memcpy(dst, src, len);
+}
+
+
+static int DetileAlways(void)
+{
+	return 1;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__ ((target("sse2")))
+static void DetileTileSse2(uint8_t *dst, unsigned int pitch, const uint8_t *src,
+	unsigned int rows)
+{
+	const __m128i *s = (const __m128i *)src;
+	__m128i a, b, c, d;
+	unsigned int r;
+
+	for (r = 0; r < rows; r++) {
+		a = _mm_loadu_si128(s);
+		b = _mm_loadu_si128(s + 1);
+		c = _mm_loadu_si128(s + 2);
+		d = _mm_loadu_si128(s + 3);
+		_mm_storeu_si128((__m128i *)dst, a);
+		_mm_storeu_si128((__m128i *)(dst + 16), b);
+		_mm_storeu_si128((__m128i *)(dst + 32), c);
+		_mm_storeu_si128((__m128i *)(dst + 48), d);
+		dst += pitch;
+		s += 4;
+	}
+}
+
+
+__attribute__ ((target("avx2")))
+static void DetileTileAvx2(uint8_t *dst, unsigned int pitch, const uint8_t *src,
+	unsigned int rows)
+{
+	const __m256i *s = (const __m256i *)src;
+	__m256i a, b;
+	unsigned int r;
+
+	for (r = 0; r < rows; r++) {
+		a = _mm256_loadu_si256(s);
+		b = _mm256_loadu_si256(s + 1);
+		_mm256_storeu_si256((__m256i *)dst, a);
+		_mm256_storeu_si256((__m256i *)(dst + 32), b);
+		dst += pitch;
+		s += 2;
+	}
+}
+
+
+///
+/// Streaming stores from the first 16 byte aligned byte, the frame is
+/// read by the display, not by this CPU.
+///
+__attribute__ ((target("sse2")))
+static void CopyRowSse2(uint8_t *dst, const uint8_t *src, unsigned int len)
+{
+	unsigned int head = -(uintptr_t)dst & 15;
+	__m128i a, b, c, d;
+
+	if (head > len)
+		head = len;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+
+	for (; len >= 64; len -= 64) {
+		a = _mm_loadu_si128((const __m128i *)src);
+		b = _mm_loadu_si128((const __m128i *)(src + 16));
+		c = _mm_loadu_si128((const __m128i *)(src + 32));
+		d = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+		dst += 64;
+		src += 64;
+	}
+	memcpy(dst, src, len);
+}
+
+
+__attribute__ ((target("avx2")))
+static void CopyRowAvx2(uint8_t *dst, const uint8_t *src, unsigned int len)
+{
+	unsigned int head = -(uintptr_t)dst & 31;
+	__m256i a, b;
+
+	if (head > len)
+		head = len;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+
+	for (; len >= 64; len -= 64) {
+		a = _mm256_loadu_si256((const __m256i *)src);
+		b = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_stream_si256((__m256i *)dst, a);
+		_mm256_stream_si256((__m256i *)(dst + 32), b);
+		dst += 64;
+		src += 64;
+	}
+	memcpy(dst, src, len);
+}
+
+
+///
+/// Streaming stores are weakly ordered, make them visible before the
+/// job is reported done.
+///
+__attribute__ ((target("sse")))
+static void DetileFence(void)
+{
+	_mm_sfence();
+}
+
+
+static int DetileHasSse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+
+static int DetileHasAvx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+
+#if defined(__ARM_NEON)
+static void DetileTileNeon(uint8_t *dst, unsigned int pitch, const uint8_t *src,
+	unsigned int rows)
+{
+	uint8x16_t a, b, c, d;
+	unsigned int r;
+
+	for (r = 0; r < rows; r++) {
+		a = vld1q_u8(src);
+		b = vld1q_u8(src + 16);
+		c = vld1q_u8(src + 32);
+		d = vld1q_u8(src + 48);
+		vst1q_u8(dst, a);
+		vst1q_u8(dst + 16, b);
+		vst1q_u8(dst + 32, c);
+		vst1q_u8(dst + 48, d);
+		dst += pitch;
+		src += DETILE_W;
+	}
+}
+
+
+///
+/// NEON has no streaming store intrinsic, wide stores at least.
+///
+static void CopyRowNeon(uint8_t *dst, const uint8_t *src, unsigned int len)
+{
+	uint8x16_t a, b, c, d;
+
+	for (; len >= 64; len -= 64) {
+		a = vld1q_u8(src);
+		b = vld1q_u8(src + 16);
+		c = vld1q_u8(src + 32);
+		d = vld1q_u8(src + 48);
+		vst1q_u8(dst, a);
+		vst1q_u8(dst + 16, b);
+		vst1q_u8(dst + 32, c);
+		vst1q_u8(dst + 48, d);
+		dst += 64;
+		src += 64;
+	}
+	memcpy(dst, src, len);
+}
+#endif
+
+#if !defined(__x86_64__) && !defined(__i386__)
+static void DetileFence(void)
+{
+}
+#endif
+
+
+/// fastest first
+static const struct detile_impl detile_impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2", DetileTileAvx2, CopyRowAvx2, DetileHasAvx2 },
+	{ "sse2", DetileTileSse2, CopyRowSse2, DetileHasSse2 },
+#endif
+#if defined(__ARM_NEON)
+	{ "neon", DetileTileNeon, CopyRowNeon, DetileAlways },
+#endif
+	{ "scalar", DetileTileScalar, CopyRowScalar, DetileAlways },
+};
+
+static const struct detile_impl *detile_impl = NULL;
+
+
+///
+/// Convert one tile row.
+///
+static void DetileBand(struct detile_job *job, unsigned int ty)
+{
+	unsigned int tx, rows, cols, r;
+	const uint8_t *tile;
+	uint8_t *dst;
+
+	rows = job->height - ty * DETILE_H;
+	if (rows > DETILE_H)
+		rows = DETILE_H;
+
+	for (tx = 0; tx * DETILE_W < job->width; tx++) {
+		tile = job->src + (size_t)DetilePos(tx, ty, job->x_tiles, job->y_tiles)
+			* DETILE_SIZE;
+		dst = job->dst + (size_t)ty * DETILE_H * job->dst_pitch + tx * DETILE_W;
+		cols = job->width - tx * DETILE_W;
+		if (cols >= DETILE_W) {
+			job->tile(dst, job->dst_pitch, tile, rows);
+			continue;
+		}
+		// right edge
+		for (r = 0; r < rows; r++)
+			memcpy(dst + r * job->dst_pitch, tile + r * DETILE_W, cols);
+	}
+}
+
+
+///
+/// Copy DETILE_H lines, the visible width only.
+///
+static void CopyBand(struct detile_job *job, unsigned int band)
+{
+	unsigned int y = band * DETILE_H;
+	unsigned int end = y + DETILE_H < job->height ? y + DETILE_H : job->height;
+
+	for (; y < end; y++)
+		job->copy(job->dst + (size_t)y * job->dst_pitch,
+			job->src + (size_t)y * job->src_pitch, job->width);
+}
+
+
+///
+/// Run the bands the job hands out, until none are left.
+///
+static void DetileWork(struct detile_job *job)
+{
+	unsigned int band;
+
+	while ((band = atomic_fetch_add(&job->next_band, 1)) < job->bands)
+		job->band(job, band);
+	DetileFence();
+}
+
+
+///
+/// @param arg	the job generation at the start, later ones are run
+///
+static void *DetileThread(void *arg)
+{
+	unsigned long gen = (uintptr_t)arg;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.quit && pool.gen == gen)
+			pthread_cond_wait(&pool.start, &pool.lock);
+		if (pool.quit)
+			break;
+		gen = pool.gen;
+		pthread_mutex_unlock(&pool.lock);
+
+		DetileWork(&pool.job);
+
+		pthread_mutex_lock(&pool.lock);
+		if (!--pool.busy)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+
+///
+/// Select the fastest converter and start the workers.
+/// @param threads	threads converting a plane, the caller included
+///
+int DetileInit(unsigned int threads)
+{
+	if (!detile_impl)
+		DetileSelect(NULL);
+
+	if (threads > DETILE_MAX_THREADS)
+		threads = DETILE_MAX_THREADS;
+	pool.quit = 0;
+	for (pool.count = 0; pool.count + 1 < threads; pool.count++) {
+		if (pthread_create(&pool.threads[pool.count], NULL, DetileThread,
+				(void *)(uintptr_t)pool.gen)) {
+			fprintf(stderr, "DetileInit: can't start thread %u\n", pool.count);
+			break;
+		}
+	}
+	fprintf(stderr, "DetileInit: %s, %u threads\n", detile_impl->name, pool.count + 1);
+
+	return 0;
+}
+
+
+void DetileDeInit(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.count; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.count = 0;
+}
+
+
+///
+/// @param name	"avx2", "sse2", "neon", "scalar" or NULL for the fastest
+/// @returns 0 or -1 if this CPU has no such converter.
+///
+int DetileSelect(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(detile_impls) / sizeof(*detile_impls); i++) {
+		if (name && strcmp(name, detile_impls[i].name))
+			continue;
+		if (!detile_impls[i].supported())
+			continue;
+		detile_impl = &detile_impls[i];
+		return 0;
+	}
+	return -1;
+}
+
+
+const char *DetileName(void)
+{
+	if (!detile_impl)
+		DetileSelect(NULL);
+	return detile_impl->name;
+}
+
+
+static void DetileSetup(struct detile_job *job, uint8_t *dst, unsigned int dst_pitch,
+	const uint8_t *src, unsigned int src_pitch, unsigned int width, unsigned int height)
+{
+	job->dst = dst;
+	job->dst_pitch = dst_pitch;
+	job->src = src;
+	job->src_pitch = src_pitch;
+	job->width = width < src_pitch ? width : src_pitch;
+	job->height = height;
+	atomic_init(&job->next_band, 0);
+}
+
+
+///
+/// Share the bands of the pool job among the workers and the caller.
+///
+static void DetileRun(struct detile_job *job)
+{
+	if (!pool.count || job->bands < 2 * DETILE_MIN_ROWS) {
+		DetileWork(job);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.gen++;
+	pool.busy = pool.count;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	DetileWork(job);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+
+static void DetileTiles(struct detile_job *job, detile_fn tile)
+{
+	// MFC aligns the plane to pairs of tiles
+	job->x_tiles = DETILE_ALIGN(job->src_pitch, 2 * DETILE_W) / DETILE_W;
+	job->y_tiles = DETILE_ALIGN(job->height, DETILE_H) / DETILE_H;
+	job->bands = job->y_tiles;
+	job->band = DetileBand;
+	job->tile = tile;
+}
+
+
+///
+/// Convert one NV12MT plane, luma or interleaved chroma, to linear.
+/// The tile rows are shared among the workers. Not reentrant.
+/// @param src_pitch	bytesperline of the tiled plane
+/// @param width	bytes per line to convert
+/// @param height	lines of the plane, half the luma lines for chroma
+///
+void DetilePlane(uint8_t *dst, unsigned int dst_pitch, const uint8_t *src,
+	unsigned int src_pitch, unsigned int width, unsigned int height)
+{
+	if (!detile_impl)
+		DetileSelect(NULL);
+	DetileSetup(&pool.job, dst, dst_pitch, src, src_pitch, width, height);
+	DetileTiles(&pool.job, detile_impl->tile);
+	DetileRun(&pool.job);
+}
+
+
+///
+/// The reference: one thread, byte by byte.
+///
+void DetilePlaneScalar(uint8_t *dst, unsigned int dst_pitch, const uint8_t *src,
+	unsigned int src_pitch, unsigned int width, unsigned int height)
+{
+	struct detile_job job;
+
+	DetileSetup(&job, dst, dst_pitch, src, src_pitch, width, height);
+	DetileTiles(&job, DetileTileScalar);
+	DetileWork(&job);
+}
+
+
+///
+/// Copy the visible width of a linear plane line by line, each side with
+/// its own pitch. The padding is skipped and the stores bypass the cache
+/// where the CPU can. Bands of lines are shared among the workers.
+/// Not reentrant.
+///
+void CopyPlane(uint8_t *dst, unsigned int dst_pitch, const uint8_t *src,
+	unsigned int src_pitch, unsigned int width, unsigned int height)
+{
+	if (!detile_impl)
+		DetileSelect(NULL);
+	DetileSetup(&pool.job, dst, dst_pitch, src, src_pitch, width, height);
+	pool.job.bands = (height + DETILE_H - 1) / DETILE_H;
+	pool.job.band = CopyBand;
+	pool.job.copy = detile_impl->copy;
+	DetileRun(&pool.job);
+}
@@ -0,0 +1,22 @@
+#include <stdint.h>
+
+#define DETILE_W	64	///< bytes per tile row
+#define DETILE_H	32	///< rows per tile
+#define DETILE_MAX_THREADS	8
+
+int DetileInit(unsigned int threads);
+
+void DetileDeInit(void);
+
+int DetileSelect(const char *name);
+
+const char *DetileName(void);
+
+void DetilePlane(uint8_t *dst, unsigned int dst_pitch, const uint8_t *src,
+	unsigned int src_pitch, unsigned int width, unsigned int height);
+
+void DetilePlaneScalar(uint8_t *dst, unsigned int dst_pitch, const uint8_t *src,
+	unsigned int src_pitch, unsigned int width, unsigned int height);
+
+void CopyPlane(uint8_t *dst, unsigned int dst_pitch, const uint8_t *src,
+	unsigned int src_pitch, unsigned int width, unsigned int height);
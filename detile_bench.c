@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "detile.h"
+
+#define BENCH_ALIGN(val, align)	(((val) + ((align) - 1)) & ~((align) - 1))
+
+static const char *const bench_impls[] = { "scalar", "sse2", "avx2", "neon" };
+
+
+static double BenchNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+///
+/// Convert an NV12MT frame, luma and chroma, like the copy path does.
+///
+static void BenchFrame(uint8_t *dst, const uint8_t *src, unsigned int pitch,
+	unsigned int width, unsigned int height, size_t luma_src, size_t luma_dst)
+{
+	DetilePlane(dst, pitch, src, pitch, width, height);
+	DetilePlane(dst + luma_dst, pitch, src + luma_src, pitch, width, height / 2);
+}
+
+
+///
+/// Microbenchmark of the NV12MT converters, checked against the scalar
+/// reference.
+/// Usage: detile_bench [<width> <height> [<frames>]]
+///
+int main(int c, char *v[])
+{
+	unsigned int width = c > 2 ? strtoul(v[1], NULL, 0) : 1920;
+	unsigned int height = c > 2 ? strtoul(v[2], NULL, 0) : 1080;
+	unsigned int frames = c > 3 ? strtoul(v[3], NULL, 0) : 200;
+	unsigned int pitch = BENCH_ALIGN(width, 2 * DETILE_W);
+	size_t luma_src = (size_t)pitch * BENCH_ALIGN(height, DETILE_H);
+	size_t chroma_src = (size_t)pitch * BENCH_ALIGN(height / 2, DETILE_H);
+	size_t luma_dst = (size_t)pitch * height;
+	size_t size_dst = luma_dst + luma_dst / 2;
+	unsigned int threads, i, f;
+	uint8_t *src, *dst, *ref;
+	double t;
+
+	if (!width || !height || !frames) {
+		fprintf(stderr, "Usage: %s [<width> <height> [<frames>]]\n", v[0]);
+		return 1;
+	}
+	src = aligned_alloc(4096, BENCH_ALIGN(luma_src + chroma_src, 4096));
+	dst = aligned_alloc(4096, BENCH_ALIGN(size_dst, 4096));
+	ref = aligned_alloc(4096, BENCH_ALIGN(size_dst, 4096));
+	if (!src || !dst || !ref) {
+		fprintf(stderr, "detile_bench: out of memory\n");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < luma_src + chroma_src; i++)
+		src[i] = rand();
+
+	DetilePlaneScalar(ref, pitch, src, pitch, width, height);
+	DetilePlaneScalar(ref + luma_dst, pitch, src + luma_src, pitch, width, height / 2);
+
+	printf("NV12MT %ux%u, %u frames\n", width, height, frames);
+	for (threads = 1; threads <= DETILE_MAX_THREADS; threads *= 2) {
+		DetileInit(threads);
+		for (i = 0; i < sizeof(bench_impls) / sizeof(*bench_impls); i++) {
+			if (DetileSelect(bench_impls[i]))
+				continue;
+
+			memset(dst, 0, size_dst);
+			BenchFrame(dst, src, pitch, width, height, luma_src, luma_dst);
+			if (memcmp(dst, ref, size_dst)) {
+				printf("%-6s %u threads: differs from the reference\n",
+					DetileName(), threads);
+				continue;
+			}
+
+			t = BenchNow();
+			for (f = 0; f < frames; f++)
+				BenchFrame(dst, src, pitch, width, height, luma_src, luma_dst);
+			t = BenchNow() - t;
+
+			printf("%-6s %u threads: %7.2f GB/s %8.1f fps\n", DetileName(), threads,
+				(double)size_dst * frames / t / 1e9, frames / t);
+		}
+		DetileDeInit();
+	}
+
+	free(src);
+	free(dst);
+	free(ref);
+
+	return 0;
+}
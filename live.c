@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "live.h"
+#include "trace.h"
+
+#define LIVE_MAX_LATENCY	10000000LL	///< us, more: the PTS are no wall clock
+
+///
+/// Glass-to-glass latency of a live input whose sender stamps the frames
+/// with its wall clock, e.g. ffmpeg -use_wallclock_as_timestamps 1 -copyts
+/// on the same host.
+///
+static struct {
+	int enabled;
+	int64_t pts_wrap;		///< us, 0 the PTS don't wrap
+	unsigned long count;
+	unsigned long unstamped;	///< frames without a wall-clock PTS
+	int64_t sum, min, max;
+} live;
+
+
+///
+/// Measure the frames shown from then on.
+/// @param pts_wrap	us the PTS of the input wrap around after, 0 never
+///
+void LiveInit(int64_t pts_wrap)
+{
+	live.enabled = 1;
+	live.pts_wrap = pts_wrap;
+	live.count = live.unstamped = 0;
+	live.sum = live.max = 0;
+	live.min = INT64_MAX;
+}
+
+
+///
+/// A frame reached the screen.
+/// @param pts	us, the sender's CLOCK_REALTIME
+/// @param ns	CLOCK_MONOTONIC of its vblank, 0 now
+///
+void LiveShown(int64_t pts, uint64_t ns)
+{
+	struct timespec real, mono;
+	uint64_t now;
+	int64_t latency;
+
+	if (!live.enabled)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	now = (uint64_t)mono.tv_sec * 1000000000 + mono.tv_nsec;
+	if (!ns)
+		ns = now;
+	// wall clock of the vblank
+	latency = (int64_t)real.tv_sec * 1000000 + real.tv_nsec / 1000 - pts
+		- (int64_t)(now - ns) / 1000;
+
+	// MPEG-TS keeps 33 bits of a 90 kHz clock
+	if (live.pts_wrap) {
+		latency %= live.pts_wrap;
+		if (latency < 0)
+			latency += live.pts_wrap;
+		if (latency > live.pts_wrap / 2)
+			latency -= live.pts_wrap;
+	}
+	if (latency < 0 || latency > LIVE_MAX_LATENCY) {
+		if (!live.unstamped++)
+			fprintf(stderr, "LiveShown: the PTS are no wall clock, no glass-to-glass "
+				"latency\n");
+		return;
+	}
+
+	TraceEventAt(TRACE_LATENCY, ns, latency);
+	live.count++;
+	live.sum += latency;
+	if (latency < live.min)
+		live.min = latency;
+	if (latency > live.max)
+		live.max = latency;
+}
+
+
+void LivePrintStats(void)
+{
+	if (!live.enabled)
+		return;
+	if (!live.count) {
+		fprintf(stderr, "live: no frame with a wall-clock PTS\n");
+		return;
+	}
+	fprintf(stderr, "live: %lu frames glass-to-glass %.1f ms average %.1f ms min "
+		"%.1f ms max\n", live.count, live.sum / 1e3 / live.count, live.min / 1e3,
+		live.max / 1e3);
+}
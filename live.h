@@ -0,0 +1,5 @@
+void LiveInit(int64_t pts_wrap);
+
+void LiveShown(int64_t pts, uint64_t ns);
+
+void LivePrintStats(void);
@@ -1,5 +1,9 @@
 #define _GNU_SOURCE
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <linux/videodev2.h>
@@ -7,73 +11,628 @@
 #include <libavcodec/avcodec.h>
 
 #include "main.h"
+#include "backend.h"
+#include "bench.h"
+#include "live.h"
+#include "mosaic.h"
+#include "pipeline.h"
+#include "sched.h"
 #include "stream.h"
+#include "trace.h"
+#include "ts.h"
 #include "v4l2.h"
 #include "video.h"
 
-void PacketToOut(void)
+#define TRACE_SIZE	(1 << 18)	///< trace records kept, the last ones
+#define FF_SPEED	8		///< fast-forward without a given speed
+
+static volatile sig_atomic_t quit;
+
+// seek to first frame latency
+static struct {
+	int pending;			///< waiting for the first frame
+	struct timespec start;
+	unsigned long count;
+	double sum_ms, max_ms;
+} seek;
+
+// inputs played back to back
+static struct {
+	char **urls;
+	int count;
+	int current;
+	int pending;			///< next input, waiting for its first frame
+	struct timespec end;		///< last frame of the input before
+	double max_gap_ms;
+} playlist;
+
+static void SignalHandler(__attribute__ ((unused)) int sig)
+{
+	quit = 1;
+}
+
+
+static double MsSince(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+
+///
+/// Move the input to pts, the decoder and the display are flushed by
+/// the caller.
+/// @param speed	1 plays normally, more is fast-forward on keyframes
+///
+static void SeekStart(int64_t pts, unsigned int speed)
+{
+	fprintf(stderr, "main: seek to %.3f s%s\n", (pts - StreamStartTime()) / 1e6,
+		speed > 1 ? ", fast-forward" : "");
+	TraceEvent(TRACE_SEEK, pts);
+	clock_gettime(CLOCK_MONOTONIC, &seek.start);
+	seek.pending = 1;
+	StreamSeek(pts, speed > 1);
+}
+
+
+///
+/// The first frame after a seek reached the display.
+///
+static void SeekDone(void)
 {
+	double ms = MsSince(&seek.start);
+
+	seek.pending = 0;
+	seek.count++;
+	seek.sum_ms += ms;
+	if (ms > seek.max_ms)
+		seek.max_ms = ms;
+	fprintf(stderr, "main: first frame %.1f ms after the seek\n", ms);
+}
+
+
+///
+/// The last input drained, continue with the next one of the playlist.
+/// Decoder, buffers, mode and framebuffers stay if the codec is the
+/// same, the capture queue follows a new resolution on its own.
+/// @returns 0 or -1 at the end of the playlist.
+///
+static int PlayNext(int *capture, int *direct, unsigned int out_buffers)
+{
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &playlist.end);
+
+	// skip inputs that don't open
+	do {
+		if (playlist.current + 1 >= playlist.count)
+			return -1;
+		playlist.current++;
+		ret = StreamNext();
+		if (playlist.current + 1 < playlist.count)
+			StreamPrefetch(playlist.urls[playlist.current + 1]);
+	} while (ret);
+
+	fprintf(stderr, "main: next input %s\n", playlist.urls[playlist.current]);
+	if (*direct) {
+		TsClose();
+		if (TsOpen(playlist.urls[playlist.current], StreamTsPid())) {
+			fprintf(stderr, "main: no MPEG-TS file, read with libavformat\n");
+			*direct = 0;
+		}
+	}
+	if (*capture)
+		VideoFlush(1);
+	playlist.pending = 1;
+
+	if (!V4l2Resume())
+		return 0;
+
+	// another codec: the decoder starts over
+	fprintf(stderr, "main: new codec, set up the decoder again\n");
+	if (*capture) {
+		VideoReleaseCapture();
+		V4l2ReleaseCapture();
+		*capture = 0;
+	}
+	StreamOff();
+	MunmapBuffer();
+	dec->start = 0;
+	dec->out_index = 0;
+	return V4l2SetupOutput(out_buffers);
+}
+
+
+///
+/// Read a command from stdin:
+/// "<s>" seek to s seconds, "+<s>" / "-<s>" seek relative, "f [<speed>]"
+/// fast-forward on keyframes, "p" play normally, "q" quit.
+/// @returns 1 if the player must seek to pts at speed, 0 if not, -1 to
+/// stop reading commands.
+///
+static int PlayCommand(int64_t *pts, unsigned int *speed)
+{
+	char line[64];
+	int64_t now;
+	ssize_t len;
+	char *end;
+	double sec;
+
+	if ((len = read(STDIN_FILENO, line, sizeof(line) - 1)) <= 0)
+		return -1;
+	line[len] = '\0';
+
+	// the frame last decoded is where the player is
+	now = dec->start && V4l2CaptureTag() ? V4l2TagPts(V4l2CaptureTag())
+		: StreamStartTime();
+
+	switch (line[0]) {
+	case 'q':
+		quit = 1;
+		return 0;
+	case 'f':
+		*speed = strtoul(line + 1, NULL, 0);
+		if (*speed < 2)
+			*speed = FF_SPEED;
+		*pts = now;
+		return 1;
+	case 'p':
+		*speed = 1;
+		*pts = now;
+		return 1;
+	}
+
+	sec = strtod(line, &end);
+	if (end == line) {
+		fprintf(stderr, "main: commands: <s>, +<s>, -<s>, f [<speed>], p, q\n");
+		return 0;
+	}
+	*pts = line[0] == '+' || line[0] == '-' ? now + (int64_t)(sec * 1e6)
+		: StreamStartTime() + (int64_t)(sec * 1e6);
+	return 1;
+}
+
+
+///
+/// Feed the decoder and present frames until the end of the stream.
+/// Waits in poll() for a free OUTPUT buffer, a decoded frame or a
+/// completed page flip.
+///
+static void PlayLoop(int zero_copy, int direct, int interactive, unsigned int out_buffers)
+{
+	struct pollfd fds[3];
 	AVPacket pkt;
+	int have_pkt = 0;
+	int eof = 0;
+	int drain = 0;
+	int capture = 0;
+	int failed = 0;
+	unsigned int speed = 1;
+	int64_t pts;
+	double ms;
+	int ret;
+
 	av_init_packet(&pkt);
-	ReadPacket(&pkt);
-	QueuePacketOut(&pkt, 0);
+
+	while (!quit) {
+		// fill all free OUTPUT buffers
+		while (!eof && direct) {
+			if ((ret = QueuePesOut()) < -1)
+				failed = 1;
+			else if (ret < 0)
+				eof = 1;
+			if (ret)
+				break;
+		}
+		while (!eof && !direct) {
+			if (!have_pkt) {
+				if (ReadPacket(&pkt)) {
+					eof = 1;
+					break;
+				}
+				have_pkt = 1;
+			}
+			if ((ret = QueuePacketOut(&pkt, 0)) > 0)
+				break;
+			have_pkt = 0;
+			if (ret < 0) {
+				failed = 1;
+				break;
+			}
+		}
+		if (failed) {
+			fprintf(stderr, "main: the decoder takes no more data\n");
+			break;
+		}
+
+		if (eof && !drain)
+			drain = !V4l2Drain();
+
+		// new resolution: only the capture side is set up again
+		if (capture && V4l2CaptureChanged()) {
+			VideoReleaseCapture();
+			V4l2ReleaseCapture();
+			capture = 0;
+		}
+
+		// the capture format is known after the decoder parsed the header
+		if (!capture && dec->start) {
+			if (!V4l2SetupCapture(zero_copy)) {
+				capture = 1;
+				if (zero_copy && VideoImportCapture(dec->cap_count))
+					fprintf(stderr, "main: zero-copy import failed, copy frames\n");
+			}
+		}
+
+		if (capture) {
+			ret = VideoPresent();
+			if (ret == -EPIPE && !PlayNext(&capture, &direct, out_buffers)) {
+				speed = 1;
+				eof = drain = 0;
+				continue;
+			}
+			if (ret < 0)
+				break;
+			if (ret > 0) {
+				if (seek.pending)
+					SeekDone();
+				if (playlist.pending) {
+					playlist.pending = 0;
+					ms = MsSince(&playlist.end);
+					if (ms > playlist.max_gap_ms)
+						playlist.max_gap_ms = ms;
+					fprintf(stderr, "main: first frame %.1f ms after the last one\n", ms);
+				}
+				continue;
+			}
+		}
+
+		// frames wait in the decoder until the flip is complete
+		fds[0].fd = dec->fd;
+		fds[0].events = POLLPRI;
+		if (!eof)
+			fds[0].events |= POLLOUT;
+		if (capture && !VideoFlipPending())
+			fds[0].events |= POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = VideoFd();
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		fds[2].fd = interactive ? STDIN_FILENO : -1;
+		fds[2].events = POLLIN;
+		fds[2].revents = 0;
+
+		// poll the header more often
+		if (V4l2Poll(fds, 3, capture ? 1000 : 10) < 0 && errno != EINTR) {
+			fprintf(stderr, "main: poll failed: (%d): %m\n", errno);
+			break;
+		}
+		if (fds[0].revents & POLLPRI)
+			V4l2HandleEvent();
+		if (fds[1].revents & POLLIN)
+			VideoHandleEvent();
+
+		if (!(fds[2].revents & (POLLIN | POLLHUP)))
+			continue;
+		if ((ret = PlayCommand(&pts, &speed)) < 0)
+			interactive = 0;
+		if (ret <= 0)
+			continue;
+
+		// the decoder restarts at the keyframe before pts
+		if (have_pkt)
+			av_packet_unref(&pkt);
+		have_pkt = 0;
+		SeekStart(pts, speed);
+		V4l2Flush();
+		if (capture)
+			VideoFlush(speed);
+		eof = drain = 0;
+	}
+
+	if (seek.count)
+		fprintf(stderr, "main: %lu seeks, first frame after %.1f ms average "
+			"%.1f ms max\n", seek.count, seek.sum_ms / seek.count, seek.max_ms);
+	if (playlist.count > 1)
+		fprintf(stderr, "main: %i of %i inputs, longest gap %.1f ms\n",
+			playlist.current + 1, playlist.count, playlist.max_gap_ms);
+
+	if (have_pkt)
+		av_packet_unref(&pkt);
+}
+
+static void Usage(void)
+{
+	printf ("Usage: ./v4l2_test [options] <url>...\n"
+			"       ./v4l2_test --bench [options] <url>...\n"
+			"       ./v4l2_test --mosaic [options] <url>...\n"
+			"./v4l2_test /mnt/share/video-samples/00005.ts\n"
+			"  -d, --device <path>   V4L2 decoder (default /dev/video6)\n"
+			"                        mock[:latency_us=N,min_buffers=N,max_buffers=N]\n"
+			"                        decodes with libavcodec in this process\n"
+			"  -s, --sink <sink>     kms (default), null[:<hz>] or file:<path>\n"
+			"                        null holds each frame for a simulated vblank\n"
+			"                        (default 60 Hz, 0 unpaced), file writes raw\n"
+			"                        frames or y4m if the name ends in .y4m\n"
+			"  -c, --card <path>     DRM device (default /dev/dri/card0)\n"
+			"  -z, --zero-copy       scan out the decoder buffers (DMABUF)\n"
+			"  -t, --threads         demux, feed and present in own threads\n"
+			"  -D, --direct          read MPEG-TS files straight into the decoder buffers\n"
+			"  -r, --read-ahead <KiB> prefetch video packets up to this size\n"
+			"      --read-ahead-ms <ms> ... and up to this duration\n"
+			"      --no-prop-cache   look up KMS property ids on every commit\n"
+			"  -F, --fb-count <n>    framebuffers in the display pool (default 3, 2..8)\n"
+			"  -o, --out-buffers <n> decoder OUTPUT buffers (default 3)\n"
+			"  -m, --cap-margin <n>  capture buffers above the decoder minimum (default 3)\n"
+			"  -S, --seek <s>        start s seconds into the stream\n"
+			"  -f, --ff <speed>      fast-forward: keyframes only, speed times faster\n"
+			"  -i, --interactive     seek with commands on stdin: <s>, +<s>, -<s>,\n"
+			"                        f [<speed>] fast-forward, p play, q quit\n"
+			"  -M, --mosaic          play up to 4 urls at once, each on its own decoder\n"
+			"                        instance and plane, in a grid\n"
+			"      --pip             ... the first full screen, the others in windows\n"
+			"  -L, --live <ms>       low-latency live input (udp://, rtp://, srt://) with\n"
+			"                        a jitter buffer of ms, up to 500; with -T the trace\n"
+			"                        has the latency from a wall-clock PTS to the screen\n"
+			"  -T, --trace <prefix>  record per frame timestamps, write <prefix>.json\n"
+			"                        (Chrome trace) and <prefix>.csv at exit\n"
+			"  -b, --bench           decode without display, report JSON\n"
+			"  -n, --bench-runs <n>  decode each file n times\n"
+			"      --bench-streams <n> ... also with 2 .. n instances at once\n"
+			"  -j, --bench-json <file> write the report to file instead of stdout\n");
 }
 
 int main(int c, char *v[])
 {
-	int i;
+	static const struct option long_options[] = {
+		{ "device",	required_argument,	NULL, 'd' },
+		{ "sink",	required_argument,	NULL, 's' },
+		{ "card",	required_argument,	NULL, 'c' },
+		{ "zero-copy",	no_argument,		NULL, 'z' },
+		{ "threads",	no_argument,		NULL, 't' },
+		{ "direct",	no_argument,		NULL, 'D' },
+		{ "read-ahead",	required_argument,	NULL, 'r' },
+		{ "read-ahead-ms", required_argument,	NULL, 'R' },
+		{ "no-prop-cache", no_argument,		NULL, 'P' },
+		{ "fb-count",	required_argument,	NULL, 'F' },
+		{ "out-buffers", required_argument,	NULL, 'o' },
+		{ "cap-margin",	required_argument,	NULL, 'm' },
+		{ "seek",	required_argument,	NULL, 'S' },
+		{ "ff",		required_argument,	NULL, 'f' },
+		{ "interactive", no_argument,		NULL, 'i' },
+		{ "mosaic",	no_argument,		NULL, 'M' },
+		{ "pip",	no_argument,		NULL, 'p' },
+		{ "live",	required_argument,	NULL, 'L' },
+		{ "trace",	required_argument,	NULL, 'T' },
+		{ "bench",	no_argument,		NULL, 'b' },
+		{ "bench-runs",	required_argument,	NULL, 'n' },
+		{ "bench-streams", required_argument,	NULL, 'N' },
+		{ "bench-json",	required_argument,	NULL, 'j' },
+		{ NULL,		0,			NULL, 0 }
+	};
+//	const char *device = "/dev/video0"; // Cubie und Odroid-C2
+	const char *device = "/dev/video6"; // Odroid
+//	const char *device = "/dev/video7"; // Matrix
+	const char *sink = "kms";
+	const char *card = "/dev/dri/card0";
+	int zero_copy = 0;
+	int threads = 0;
+	int direct = 0;
+	size_t read_ahead = 0;
+	int read_ahead_ms = 0;
+	unsigned int out_buffers = 3;
+	int bench = 0;
+	int bench_runs = 1;
+	int bench_streams = 1;
+	const char *bench_json = NULL;
+	const char *trace = NULL;
+	double start = 0;
+	unsigned int speed = 1;
+	int interactive = 0;
+	int mosaic = 0;
+	int pip = 0;
+	int live = -1;
+	int ret;
+	int opt;
 
-	if (c < 2) {
-		printf ("Usage: ./v4l2_test <url>\n"
-				"./v4l2_test /mnt/share/video-samples/00005.ts\n");
+	while ((opt = getopt_long(c, v, "d:s:c:ztDr:F:o:m:S:f:iML:T:bn:j:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			sink = optarg;
+			break;
+		case 'c':
+			card = optarg;
+			break;
+		case 'z':
+			zero_copy = 1;
+			break;
+		case 't':
+			threads = 1;
+			break;
+		case 'D':
+			direct = 1;
+			break;
+		case 'r':
+			read_ahead = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'R':
+			read_ahead_ms = atoi(optarg);
+			break;
+		case 'P':
+			VideoSetPropCache(0);
+			break;
+		case 'F':
+			VideoSetBuffers(strtoul(optarg, NULL, 0));
+			break;
+		case 'o':
+			out_buffers = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			V4l2SetCaptureMargin(strtoul(optarg, NULL, 0));
+			break;
+		case 'S':
+			start = strtod(optarg, NULL);
+			break;
+		case 'f':
+			speed = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interactive = 1;
+			break;
+		case 'p':
+			pip = 1;
+			// fall through
+		case 'M':
+			mosaic = 1;
+			break;
+		case 'L':
+			live = atoi(optarg);
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'b':
+			bench = 1;
+			break;
+		case 'n':
+			bench_runs = atoi(optarg);
+			break;
+		case 'N':
+			bench_streams = atoi(optarg);
+			break;
+		case 'j':
+			bench_json = optarg;
+			break;
+		default:
+			Usage();
+			return 1;
+		}
+	}
+
+	if (optind >= c) {
+		Usage();
 		return 1;
 	}
 
-	if (!fd_v4l2_dec)
-//		fd_v4l2_dec = open("/dev/video0", O_RDWR); // Cubie und Odroid-C2
-		fd_v4l2_dec = open("/dev/video6", O_RDWR); // Odroid
-//		fd_v4l2_dec = open("/dev/video7", O_RDWR); // Matrix
-	if (fd_v4l2_dec < 0)
-		fprintf(stderr, "V4l2Open: Open fd_v4l2_dec failed: (%d): %m\n", errno);
+	if (trace && TraceInit(TRACE_SIZE))
+		return 1;
 
-	PrintCaps(fd_v4l2_dec);
+	// inputs, decoders and clocks for the least latency
+	if (live >= 0) {
+		StreamSetLive(live);
+		V4l2SetLowDelay(1);
+		SchedSetDelay(live);
+	}
 
-	StreamOpen(v[1]);
-	VideoInit();
+	// headless: no DRM, all files in turn
+	if (bench) {
+		signal(SIGINT, SignalHandler);
+		signal(SIGTERM, SignalHandler);
+		ret = BenchRun(device, v + optind, c - optind, bench_runs,
+			bench_streams, out_buffers, bench_json, &quit);
+		if (trace)
+			TraceDump(trace);
+		TraceFree();
+		return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
 
-	V4l2SetupOutput();
-	decoder_start = 0;
-	dec_buf_out_index = 0;
-	while(!decoder_start)
-		PacketToOut();
+	// several streams, each with its own decoder, stream and plane
+	if (mosaic) {
+		if (threads || direct || start > 0 || speed > 1 || interactive)
+			fprintf(stderr, "main: --mosaic plays without --threads, --direct "
+				"and seeking\n");
+		signal(SIGINT, SignalHandler);
+		signal(SIGTERM, SignalHandler);
+		ret = MosaicRun(device, sink, card, v + optind, c - optind, pip,
+			zero_copy, out_buffers, &quit);
+		if (trace)
+			TraceDump(trace);
+		TraceFree();
+		return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!dec->fd)
+		dec->fd = V4l2Open(device, O_RDWR | O_NONBLOCK);
+	if (dec->fd < 0)
+		fprintf(stderr, "V4l2Open: Open the decoder failed: (%d): %m\n", errno);
 
-	V4l2SetupCapture();
+	PrintCaps(dec->fd);
 
-	for (i = 0; i < BUF_CAP; i++) {
-		PacketToOut();
+	if (StreamOpen(v[optind])) {
+		fprintf(stderr, "main: can't play %s\n", v[optind]);
+		V4l2Close(dec->fd);
+		return EXIT_FAILURE;
+	}
+	if (live >= 0)
+		LiveInit(StreamPtsWrap());
+	// the next input opens while this one plays
+	playlist.urls = v + optind;
+	playlist.count = threads ? 1 : c - optind;
+	if (threads && c - optind > 1)
+		fprintf(stderr, "main: --threads plays only the first input\n");
+	if (playlist.count > 1)
+		StreamPrefetch(playlist.urls[1]);
+	// libavformat only probes, the TS reader feeds the decoder
+	if (direct && TsOpen(v[optind], StreamTsPid())) {
+		fprintf(stderr, "main: no MPEG-TS file, read with libavformat\n");
+		direct = 0;
+	}
+	if (!direct && (read_ahead || read_ahead_ms))
+		StreamReadAhead(read_ahead ? read_ahead : 8 << 20,
+			read_ahead_ms ? read_ahead_ms : 2000);
+	if (VideoInit(sink, card)) {
+		fprintf(stderr, "main: can't open the %s sink\n", sink);
+		TsClose();
+		StreamClose();
+		V4l2Close(dec->fd);
+		return EXIT_FAILURE;
 	}
 
-//	DequeueBufferCapture();
-//	Drm_page_flip_event(0,0,0,0,0);
-	StartPlay();
-	PacketToOut();
-	Drm_page_flip_event(0,0,0,0,0);
-	PacketToOut();
-	Drm_page_flip_event(0,0,0,0,0);
-	PacketToOut();
-	Drm_page_flip_event(0,0,0,0,0);
-	PacketToOut();
-	Drm_page_flip_event(0,0,0,0,0);
+	dec->start = 0;
+	dec->out_index = 0;
+	if (V4l2SetupOutput(out_buffers))
+		quit = 1;
 
-	sleep(10);
+	signal(SIGINT, SignalHandler);
+	signal(SIGTERM, SignalHandler);
 
+	// seeking reads with libavformat in the main loop
+	if ((start > 0 || speed > 1 || interactive) && (direct || threads)) {
+		fprintf(stderr, "main: no seeking with --direct or --threads\n");
+		start = 0;
+		speed = 1;
+		interactive = 0;
+	}
+	if (!quit && (start > 0 || speed > 1)) {
+		SeekStart(StreamStartTime() + (int64_t)(start * 1e6), speed);
+		VideoFlush(speed);
+	}
+
+	if (quit)
+		fprintf(stderr, "main: the decoder can't decode this stream\n");
+	else if (threads)
+		PipelineRun(zero_copy, direct, &quit);
+	else
+		PlayLoop(zero_copy, direct, interactive, out_buffers);
+	LivePrintStats();
+
+	TsClose();
 	StreamClose();
 	StreamOff();
 	MunmapBuffer();
 
 	VideoDeInit();
 
-	close(fd_v4l2_dec);
+	V4l2Close(dec->fd);
+
+	if (trace)
+		TraceDump(trace);
+	TraceFree();
 
 	return EXIT_SUCCESS;
 }
@@ -1,21 +1,58 @@
-
-#define BUF_CAP	13	///< maximal of frames dec capture
-#define BUF_OUT	3	///< maximal of frames dec out
+#define BUF_CAP	32	///< maximal of frames dec capture
+#define BUF_OUT	16	///< maximal of frames dec out
 
 struct buffers {
 	void *start;
 	size_t length;
 	size_t offset;
+	size_t data_offset;	///< start of the data in the plane
+	size_t bytesused;	///< of the last DQBUF
 //	AVPacket *pkt;
 };
 
-	int fd_v4l2_dec;
-	int decoder_start;
-	int dec_buf_out_index;
+///
+/// One decoder instance, an open of the M2M device with its queues.
+/// The V4l2 functions work on dec, V4l2Select() switches instances.
+///
+struct decoder {
+	int fd;
+	int start;			///< OUTPUT buffers queued so far
+	int out_index;			///< OUTPUT buffer being filled
 //	int use_v4l2;
 //	int buf_in;
 //	struct v4l2_format dec_fmt_in;
 //	struct v4l2_buffer buffer_in;
 //	struct v4l2_buffer buffer_out;
-	struct buffers buffers_cap[BUF_CAP];
+	struct buffers buffers_cap[BUF_CAP][VIDEO_MAX_PLANES];
 	struct buffers buffers_out[BUF_OUT];
+	unsigned int out_count;		///< output buffers granted by REQBUFS
+	unsigned int cap_count;		///< capture buffers granted by REQBUFS
+	struct v4l2_format cap_fmt;	///< negotiated capture format
+	struct v4l2_rect cap_rect;	///< visible part of the capture buffers
+
+	// OUTPUT queue
+	int out_free[BUF_OUT];		///< dequeued OUTPUT buffers, a stack
+	unsigned int out_nfree;
+	int out_streaming;
+	int out_continuous;		///< decoder accepts frames split over buffers
+	uint32_t out_pixelformat;	///< coded format of the stream
+	size_t out_resize;		///< grow the OUTPUT buffers to this size
+	size_t out_max_packet;		///< largest packet seen
+	size_t out_size_limit;		///< larger OUTPUT buffers aren't granted, 0 unknown
+	int64_t out_tag;		///< timestamp of the last queued OUTPUT buffer
+	int64_t out_duration;		///< us of a frame, for packets without PTS
+	int out_pes_split;		///< the last PES continues in the next buffer
+	uint8_t *out_pes;		///< start of a PES kept over a resize
+	size_t out_pes_len;
+	int64_t out_pes_pts;
+
+	// capture queue
+	int cap_events;			///< V4L2_EVENT_SOURCE_CHANGE subscribed
+	int cap_source_change;		///< source change event, wait for the last buffer
+	int cap_changed;		///< capture queue must be reallocated
+	int cap_last;			///< the last buffer is dequeued, POLLIN stays set
+	int64_t cap_tag;		///< timestamp of the last capture buffer
+	char cap_queued[VIDEO_MAX_FRAME];	///< owned by the decoder
+};
+
+extern struct decoder *dec;
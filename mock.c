@@ -0,0 +1,1111 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "backend.h"
+#include "mock.h"
+
+#define MOCK_MAX_BUFFERS	32	///< per queue
+#define MOCK_MAX_INSTANCES	16	///< decoders open at once
+#define MOCK_CAP_OFFSET		0x40000000	///< mmap offsets of capture buffers
+#define MOCK_OFFSET_STEP	0x100000	///< mmap offset between buffers
+
+#ifndef V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM
+#define V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM	0x0004
+#endif
+#ifndef V4L2_PIX_FMT_HEVC
+#define V4L2_PIX_FMT_HEVC	v4l2_fourcc('H', 'E', 'V', 'C')
+#endif
+
+enum mock_state {
+	MOCK_DEQUEUED,		///< owned by the client
+	MOCK_QUEUED,		///< waiting for the worker
+	MOCK_ACTIVE,		///< used by the worker
+	MOCK_DONE,		///< ready for DQBUF
+};
+
+struct mock_buffer {
+	uint8_t *data;
+	size_t length;
+	uint32_t bytesused;
+	uint32_t flags;
+	struct timeval timestamp;
+	enum mock_state state;
+	unsigned long seq;	///< QBUF or completion order
+};
+
+struct mock_queue {
+	struct v4l2_format fmt;
+	struct mock_buffer bufs[MOCK_MAX_BUFFERS];
+	unsigned int count;
+	int streaming;
+	unsigned long seq;
+	uint32_t sequence;	///< frame counter for DQBUF
+};
+
+///
+/// Stateful M2M decoder emulated with libavcodec in a worker thread.
+///
+struct mock {
+	int fd;			///< eventfd, wakes up poll()
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quit;
+
+	// options
+	unsigned int latency_us;	///< extra delay per decoded frame
+	unsigned int min_buffers;	///< V4L2_CID_MIN_BUFFERS_FOR_CAPTURE
+	unsigned int max_buffers;
+	int display_delay;		///< V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY
+	int display_delay_enable;
+
+	struct mock_queue out;
+	struct mock_queue cap;
+	struct v4l2_rect visible;	///< frame size, the buffers are macroblocks
+
+	AVCodecContext *avctx;
+	AVCodecParserContext *parser;
+	AVPacket *pkt;
+	int have_pkt;
+	AVFrame *frame;
+	int have_frame;
+	int cur_out;		///< OUTPUT buffer being parsed or -1
+	uint32_t cur_pos;
+
+	int flush;		///< STREAMOFF OUTPUT or DEC_CMD_START
+	int stop;		///< DEC_CMD_STOP after the queued OUTPUT buffers
+	int draining;		///< decoder got the NULL packet
+	int last_sent;
+	int last_dequeued;
+	int change;		///< 1 event sent, 2 LAST sent, wait for capture setup
+	int event;		///< source change event pending
+	int subscribed;
+	int copying;		///< worker writes a capture buffer unlocked
+};
+
+static struct mock *mocks[MOCK_MAX_INSTANCES];
+
+
+static struct mock *MockFind(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < MOCK_MAX_INSTANCES; i++) {
+		if (mocks[i] && mocks[i]->fd == fd)
+			return mocks[i];
+	}
+	return NULL;
+}
+
+
+static void MockNotify(struct mock *m)
+{
+	uint64_t one = 1;
+
+	pthread_cond_broadcast(&m->cond);
+	if (write(m->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "MockNotify: write failed: (%d): %m\n", errno);
+}
+
+
+static enum AVCodecID MockCodec(uint32_t pixelformat)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_H264:
+		return AV_CODEC_ID_H264;
+	case V4L2_PIX_FMT_HEVC:
+		return AV_CODEC_ID_HEVC;
+	case V4L2_PIX_FMT_VP8:
+		return AV_CODEC_ID_VP8;
+	case V4L2_PIX_FMT_VP9:
+		return AV_CODEC_ID_VP9;
+	case V4L2_PIX_FMT_MPEG2:
+		return AV_CODEC_ID_MPEG2VIDEO;
+	case V4L2_PIX_FMT_MPEG1:
+		return AV_CODEC_ID_MPEG1VIDEO;
+	case V4L2_PIX_FMT_MPEG4:
+		return AV_CODEC_ID_MPEG4;
+	default:
+		return AV_CODEC_ID_NONE;
+	}
+}
+
+
+static const uint32_t mock_out_formats[] = {
+	V4L2_PIX_FMT_H264, V4L2_PIX_FMT_HEVC, V4L2_PIX_FMT_VP8, V4L2_PIX_FMT_VP9,
+	V4L2_PIX_FMT_MPEG2, V4L2_PIX_FMT_MPEG1, V4L2_PIX_FMT_MPEG4,
+};
+
+
+///
+/// @returns the oldest buffer in state or -1.
+///
+static int MockOldest(struct mock_queue *q, enum mock_state state)
+{
+	unsigned int i;
+	int best = -1;
+
+	for (i = 0; i < q->count; i++) {
+		if (q->bufs[i].state == state &&
+			(best < 0 || q->bufs[i].seq < q->bufs[best].seq))
+			best = i;
+	}
+	return best;
+}
+
+
+static void MockDone(struct mock_queue *q, int index)
+{
+	q->bufs[index].state = MOCK_DONE;
+	q->bufs[index].seq = q->seq++;
+}
+
+
+static void MockSetCapture(struct mock *m, int width, int height)
+{
+	struct v4l2_pix_format_mplane *pix = &m->cap.fmt.fmt.pix_mp;
+	uint32_t bpl = (width + 15) & ~15;
+
+	// coded size like a hardware decoder, the compose rectangle crops it
+	m->visible.left = m->visible.top = 0;
+	m->visible.width = width;
+	m->visible.height = height;
+	pix->width = bpl;
+	pix->height = (height + 15) & ~15;
+	pix->pixelformat = V4L2_PIX_FMT_NV12;
+	pix->field = V4L2_FIELD_NONE;
+	pix->num_planes = 1;
+	pix->plane_fmt[0].bytesperline = bpl;
+	pix->plane_fmt[0].sizeimage = bpl * (pix->height + pix->height / 2);
+}
+
+
+///
+/// Write a decoded frame as NV12 with one memory plane.
+///
+static void MockCopyFrame(struct mock *m, AVFrame *f, uint8_t *dst)
+{
+	struct v4l2_pix_format_mplane *pix = &m->cap.fmt.fmt.pix_mp;
+	uint32_t bpl = pix->plane_fmt[0].bytesperline;
+	int w = f->width, h = f->height;
+	int cw = (w + 1) / 2, ch = (h + 1) / 2;
+	uint8_t *uv = dst + bpl * pix->height;
+	int x, y;
+
+	for (y = 0; y < h; y++)
+		memcpy(dst + y * bpl, f->data[0] + y * f->linesize[0], w);
+
+	switch (f->format) {
+	case AV_PIX_FMT_NV12:
+		for (y = 0; y < ch; y++)
+			memcpy(uv + y * bpl, f->data[1] + y * f->linesize[1], cw * 2);
+		break;
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+		for (y = 0; y < ch; y++) {
+			const uint8_t *u = f->data[1] + y * f->linesize[1];
+			const uint8_t *v = f->data[2] + y * f->linesize[2];
+			uint8_t *d = uv + y * bpl;
+			for (x = 0; x < cw; x++) {
+				d[2 * x] = u[x];
+				d[2 * x + 1] = v[x];
+			}
+		}
+		break;
+	default:
+		// only the luma of other formats
+		memset(uv, 0x80, bpl * ch);
+		break;
+	}
+}
+
+
+static void MockSleep(unsigned int us)
+{
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+
+///
+/// Hand the held frame to a free capture buffer. Called locked.
+/// @returns 1 if it was delivered or a format change started.
+///
+static int MockDeliver(struct mock *m)
+{
+	struct v4l2_pix_format_mplane *pix = &m->cap.fmt.fmt.pix_mp;
+	struct mock_buffer *b;
+	int64_t pts;
+	int index;
+
+	// new resolution: event, then the last buffer of the old format
+	if (!m->change && ((int)m->visible.width != m->frame->width ||
+			(int)m->visible.height != m->frame->height)) {
+		MockSetCapture(m, m->frame->width, m->frame->height);
+		m->change = 1;
+		m->event = m->subscribed;
+		MockNotify(m);
+		return 1;
+	}
+	if (m->change == 1) {
+		if (!m->cap.streaming) {
+			m->change = 2;
+			return 1;
+		}
+		if ((index = MockOldest(&m->cap, MOCK_QUEUED)) < 0)
+			return 0;
+		b = &m->cap.bufs[index];
+		b->bytesused = 0;
+		b->flags = V4L2_BUF_FLAG_LAST;
+		MockDone(&m->cap, index);
+		m->change = 2;
+		MockNotify(m);
+		return 1;
+	}
+	if (m->change || !m->cap.streaming)
+		return 0;
+	if ((index = MockOldest(&m->cap, MOCK_QUEUED)) < 0)
+		return 0;
+
+	b = &m->cap.bufs[index];
+	b->state = MOCK_ACTIVE;
+	m->copying = 1;
+	pthread_mutex_unlock(&m->mutex);
+
+	if (m->latency_us)
+		MockSleep(m->latency_us);
+	MockCopyFrame(m, m->frame, b->data);
+	pts = m->frame->pts == AV_NOPTS_VALUE ? 0 : m->frame->pts;
+	av_frame_unref(m->frame);
+
+	pthread_mutex_lock(&m->mutex);
+	m->have_frame = 0;
+	m->copying = 0;
+	pthread_cond_broadcast(&m->cond);
+	// STREAMOFF took the buffer back meanwhile
+	if (b->state != MOCK_ACTIVE)
+		return 1;
+	b->bytesused = pix->plane_fmt[0].sizeimage;
+	b->flags = 0;
+	b->timestamp.tv_sec = pts / 1000000;
+	b->timestamp.tv_usec = pts % 1000000;
+	MockDone(&m->cap, index);
+	MockNotify(m);
+	return 1;
+}
+
+
+static void MockFlush(struct mock *m)
+{
+	if (m->have_frame)
+		av_frame_unref(m->frame);
+	if (m->have_pkt)
+		av_packet_unref(m->pkt);
+	m->have_frame = m->have_pkt = 0;
+
+	if (m->avctx)
+		avcodec_flush_buffers(m->avctx);
+	if (m->parser) {
+		av_parser_close(m->parser);
+		m->parser = av_parser_init(m->avctx->codec_id);
+	}
+	if (m->cur_out >= 0 && m->out.bufs[m->cur_out].state == MOCK_ACTIVE)
+		MockDone(&m->out, m->cur_out);
+	m->cur_out = -1;
+	m->draining = m->last_sent = m->stop = 0;
+	m->flush = 0;
+	MockNotify(m);
+}
+
+
+///
+/// Parse the OUTPUT buffers into packets, decode them and fill the
+/// capture buffers in order, like the firmware of a stateful decoder.
+///
+static void *MockWorker(void *arg)
+{
+	struct mock *m = arg;
+	struct mock_buffer *b;
+	uint8_t *data;
+	int size, len, ret, index;
+	int64_t tag;
+
+	pthread_mutex_lock(&m->mutex);
+	while (!m->quit) {
+		if (m->flush) {
+			MockFlush(m);
+			continue;
+		}
+		if (!m->avctx) {
+			pthread_cond_wait(&m->cond, &m->mutex);
+			continue;
+		}
+
+		// 1. the decoded frame waits for a capture buffer
+		if (m->have_frame) {
+			if (!MockDeliver(m))
+				pthread_cond_wait(&m->cond, &m->mutex);
+			continue;
+		}
+
+		// 2. next frame of the decoder
+		pthread_mutex_unlock(&m->mutex);
+		ret = avcodec_receive_frame(m->avctx, m->frame);
+		pthread_mutex_lock(&m->mutex);
+		if (!ret) {
+			m->have_frame = 1;
+			continue;
+		}
+		if (ret == AVERROR_EOF) {
+			// drained: an empty buffer flagged as last
+			if (!m->last_sent && m->cap.streaming && !m->change &&
+					(index = MockOldest(&m->cap, MOCK_QUEUED)) >= 0) {
+				b = &m->cap.bufs[index];
+				b->bytesused = 0;
+				b->flags = V4L2_BUF_FLAG_LAST;
+				MockDone(&m->cap, index);
+				m->last_sent = 1;
+				MockNotify(m);
+				continue;
+			}
+			pthread_cond_wait(&m->cond, &m->mutex);
+			continue;
+		}
+
+		// 3. the decoder wants input
+		if (m->have_pkt) {
+			pthread_mutex_unlock(&m->mutex);
+			ret = avcodec_send_packet(m->avctx, m->pkt);
+			pthread_mutex_lock(&m->mutex);
+			if (ret != AVERROR(EAGAIN)) {
+				if (ret < 0)
+					fprintf(stderr, "MockWorker: decode error %i\n", ret);
+				av_packet_unref(m->pkt);
+				m->have_pkt = 0;
+			}
+			continue;
+		}
+		if (m->cur_out >= 0) {
+			b = &m->out.bufs[m->cur_out];
+			if (m->cur_pos >= b->bytesused) {
+				// consumed, the client may refill it
+				MockDone(&m->out, m->cur_out);
+				m->cur_out = -1;
+				MockNotify(m);
+				continue;
+			}
+			tag = (int64_t)b->timestamp.tv_sec * 1000000 + b->timestamp.tv_usec;
+			pthread_mutex_unlock(&m->mutex);
+			len = av_parser_parse2(m->parser, m->avctx, &data, &size,
+				b->data + m->cur_pos, b->bytesused - m->cur_pos,
+				tag, AV_NOPTS_VALUE, 0);
+			pthread_mutex_lock(&m->mutex);
+			m->cur_pos += len > 0 ? (uint32_t)len : b->bytesused - m->cur_pos;
+			if (size > 0 && !av_new_packet(m->pkt, size)) {
+				memcpy(m->pkt->data, data, size);
+				m->pkt->pts = m->parser->pts;
+				m->have_pkt = 1;
+			}
+			continue;
+		}
+		if (m->out.streaming && (index = MockOldest(&m->out, MOCK_QUEUED)) >= 0) {
+			m->out.bufs[index].state = MOCK_ACTIVE;
+			m->cur_out = index;
+			m->cur_pos = 0;
+			continue;
+		}
+
+		// 4. no more input: flush parser and decoder after DEC_CMD_STOP
+		if (m->stop && !m->draining) {
+			pthread_mutex_unlock(&m->mutex);
+			av_parser_parse2(m->parser, m->avctx, &data, &size, NULL, 0,
+				AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+			pthread_mutex_lock(&m->mutex);
+			if (size > 0 && !av_new_packet(m->pkt, size)) {
+				memcpy(m->pkt->data, data, size);
+				m->pkt->pts = m->parser->pts;
+				m->have_pkt = 1;
+				continue;
+			}
+			pthread_mutex_unlock(&m->mutex);
+			avcodec_send_packet(m->avctx, NULL);
+			pthread_mutex_lock(&m->mutex);
+			m->draining = 1;
+			continue;
+		}
+		pthread_cond_wait(&m->cond, &m->mutex);
+	}
+	pthread_mutex_unlock(&m->mutex);
+
+	return NULL;
+}
+
+
+static int MockOpenCodec(struct mock *m)
+{
+	enum AVCodecID id = MockCodec(m->out.fmt.fmt.pix_mp.pixelformat);
+	const AVCodec *codec;
+
+	if (m->avctx)
+		return 0;
+	if (!(codec = avcodec_find_decoder(id)))
+		return -1;
+	if (!(m->avctx = avcodec_alloc_context3(codec)))
+		return -1;
+	// one thread: the same frames in the same order every run
+	m->avctx->thread_count = 1;
+	// no display delay: frames out in decode order
+	if (m->display_delay_enable && !m->display_delay)
+		m->avctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	if (avcodec_open2(m->avctx, codec, NULL) < 0 ||
+		!(m->parser = av_parser_init(id))) {
+		fprintf(stderr, "MockOpenCodec: cannot open %s\n", codec->name);
+		avcodec_free_context(&m->avctx);
+		return -1;
+	}
+	return 0;
+}
+
+
+static struct mock_queue *MockQueue(struct mock *m, uint32_t type)
+{
+	if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return &m->out;
+	if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+		return &m->cap;
+	return NULL;
+}
+
+
+static void MockFreeBuffers(struct mock_queue *q)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->count; i++)
+		free(q->bufs[i].data);
+	memset(q->bufs, 0, sizeof(q->bufs));
+	q->count = 0;
+}
+
+
+static int MockReqbufs(struct mock *m, struct v4l2_requestbuffers *req)
+{
+	struct mock_queue *q = MockQueue(m, req->type);
+	unsigned int i, count = req->count;
+
+	if (!q || req->memory != V4L2_MEMORY_MMAP)
+		return -EINVAL;
+	if (q->streaming)
+		return -EBUSY;
+	MockFreeBuffers(q);
+	if (!count)
+		return 0;
+
+	if (q == &m->cap) {
+		if (!q->fmt.fmt.pix_mp.width)
+			return -EINVAL;
+		if (count < m->min_buffers)
+			count = m->min_buffers;
+	}
+	if (count > m->max_buffers)
+		count = m->max_buffers;
+
+	for (i = 0; i < count; i++) {
+		q->bufs[i].length = q->fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+		if (!(q->bufs[i].data = calloc(1, q->bufs[i].length))) {
+			MockFreeBuffers(q);
+			return -ENOMEM;
+		}
+		q->count++;
+	}
+	req->count = count;
+	return 0;
+}
+
+
+static void MockFillBuffer(struct mock_queue *q, struct v4l2_buffer *buf, unsigned int index)
+{
+	struct mock_buffer *b = &q->bufs[index];
+
+	buf->index = index;
+	buf->flags = b->flags;
+	if (b->state == MOCK_QUEUED || b->state == MOCK_ACTIVE)
+		buf->flags |= V4L2_BUF_FLAG_QUEUED;
+	if (b->state == MOCK_DONE)
+		buf->flags |= V4L2_BUF_FLAG_DONE;
+	buf->timestamp = b->timestamp;
+	buf->field = V4L2_FIELD_NONE;
+	buf->length = 1;
+	buf->m.planes[0].length = b->length;
+	buf->m.planes[0].bytesused = b->bytesused;
+	buf->m.planes[0].data_offset = 0;
+	buf->m.planes[0].m.mem_offset = (q->fmt.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ?
+		MOCK_CAP_OFFSET : 0) + index * MOCK_OFFSET_STEP;
+}
+
+
+static int MockQbuf(struct mock *m, struct v4l2_buffer *buf)
+{
+	struct mock_queue *q = MockQueue(m, buf->type);
+	struct mock_buffer *b;
+
+	if (!q || buf->index >= q->count || !buf->m.planes || buf->length < 1)
+		return -EINVAL;
+	b = &q->bufs[buf->index];
+	if (b->state != MOCK_DEQUEUED)
+		return -EINVAL;
+
+	b->flags = 0;
+	if (q == &m->out) {
+		b->bytesused = buf->m.planes[0].bytesused;
+		b->timestamp = buf->timestamp;
+		// old drivers' drain: an empty buffer flagged as last
+		if (!b->bytesused && (buf->flags & V4L2_BUF_FLAG_LAST)) {
+			m->stop = 1;
+			MockDone(q, buf->index);
+			MockNotify(m);
+			return 0;
+		}
+	}
+	b->state = MOCK_QUEUED;
+	b->seq = q->seq++;
+	MockNotify(m);
+	return 0;
+}
+
+
+static int MockDqbuf(struct mock *m, struct v4l2_buffer *buf)
+{
+	struct mock_queue *q = MockQueue(m, buf->type);
+	int index;
+
+	if (!q || !buf->m.planes)
+		return -EINVAL;
+	if ((index = MockOldest(q, MOCK_DONE)) < 0)
+		return q == &m->cap && m->last_dequeued ? -EPIPE : -EAGAIN;
+
+	MockFillBuffer(q, buf, index);
+	buf->sequence = q->sequence++;
+	q->bufs[index].state = MOCK_DEQUEUED;
+	if (q == &m->cap && (q->bufs[index].flags & V4L2_BUF_FLAG_LAST))
+		m->last_dequeued = 1;
+	return 0;
+}
+
+
+static int MockStream(struct mock *m, uint32_t type, int on)
+{
+	struct mock_queue *q = MockQueue(m, type);
+	unsigned int i;
+
+	if (!q)
+		return -EINVAL;
+
+	if (on) {
+		if (q == &m->out && MockOpenCodec(m))
+			return -EINVAL;
+		q->streaming = 1;
+		if (q == &m->cap) {
+			// capture set up again after a source change
+			m->change = 0;
+			m->last_dequeued = 0;
+		}
+		MockNotify(m);
+		return 0;
+	}
+
+	q->streaming = 0;
+	if (q == &m->out) {
+		// like a seek: forget everything queued
+		m->flush = 1;
+		MockNotify(m);
+		while (m->flush)
+			pthread_cond_wait(&m->cond, &m->mutex);
+	} else {
+		// the buffers may be freed right after
+		while (m->copying)
+			pthread_cond_wait(&m->cond, &m->mutex);
+		m->last_dequeued = 0;
+	}
+	for (i = 0; i < q->count; i++)
+		q->bufs[i].state = MOCK_DEQUEUED;
+	return 0;
+}
+
+
+static int MockEnumFmt(struct v4l2_fmtdesc *f)
+{
+	const uint32_t nv12 = V4L2_PIX_FMT_NV12;
+	unsigned int i, n = 0;
+
+	if (f->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+		if (f->index)
+			return -EINVAL;
+		f->pixelformat = nv12;
+		f->flags = 0;
+		snprintf((char *)f->description, sizeof(f->description), "Y/CbCr 4:2:0");
+		return 0;
+	}
+	if (f->type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return -EINVAL;
+
+	// the formats libavcodec can decode
+	for (i = 0; i < sizeof(mock_out_formats) / sizeof(*mock_out_formats); i++) {
+		if (!avcodec_find_decoder(MockCodec(mock_out_formats[i])))
+			continue;
+		if (n++ == f->index) {
+			f->pixelformat = mock_out_formats[i];
+			f->flags = V4L2_FMT_FLAG_COMPRESSED | V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM;
+			snprintf((char *)f->description, sizeof(f->description), "%s (mock)",
+				avcodec_get_name(MockCodec(f->pixelformat)));
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+
+static int MockSetFmt(struct mock *m, struct v4l2_format *f)
+{
+	struct v4l2_pix_format_mplane *pix = &f->fmt.pix_mp;
+
+	if (f->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+		// the decoder decides, NV12 only
+		*f = m->cap.fmt;
+		return 0;
+	}
+	if (f->type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return -EINVAL;
+	if (m->out.streaming || m->out.count)
+		return -EBUSY;
+
+	if (MockCodec(pix->pixelformat) == AV_CODEC_ID_NONE)
+		pix->pixelformat = V4L2_PIX_FMT_H264;
+	pix->num_planes = 1;
+	if (pix->plane_fmt[0].sizeimage < 4096)
+		pix->plane_fmt[0].sizeimage = 4096;
+	pix->plane_fmt[0].bytesperline = 0;
+	m->out.fmt = *f;
+	return 0;
+}
+
+
+static int MockDecoderCmd(struct mock *m, struct v4l2_decoder_cmd *cmd, int try)
+{
+	switch (cmd->cmd) {
+	case V4L2_DEC_CMD_STOP:
+		if (!try) {
+			m->stop = 1;
+			MockNotify(m);
+		}
+		return 0;
+	case V4L2_DEC_CMD_START:
+		if (!try) {
+			m->flush = 1;
+			m->last_dequeued = 0;
+			MockNotify(m);
+			while (m->flush)
+				pthread_cond_wait(&m->cond, &m->mutex);
+		}
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+
+static int MockDispatch(struct mock *m, unsigned long request, void *arg)
+{
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *caps = arg;
+
+		memset(caps, 0, sizeof(*caps));
+		snprintf((char *)caps->driver, sizeof(caps->driver), "mock");
+		snprintf((char *)caps->card, sizeof(caps->card), "libavcodec stateful decoder");
+		snprintf((char *)caps->bus_info, sizeof(caps->bus_info), "platform:mock");
+		caps->device_caps = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+		caps->capabilities = caps->device_caps | V4L2_CAP_DEVICE_CAPS;
+		return 0;
+	}
+	case VIDIOC_ENUM_FMT:
+		return MockEnumFmt(arg);
+	case VIDIOC_G_FMT: {
+		struct v4l2_format *f = arg;
+		struct mock_queue *q = MockQueue(m, f->type);
+
+		if (!q)
+			return -EINVAL;
+		// no header parsed yet
+		if (q == &m->cap && !q->fmt.fmt.pix_mp.width)
+			return -EACCES;
+		*f = q->fmt;
+		return 0;
+	}
+	case VIDIOC_S_FMT:
+		return MockSetFmt(m, arg);
+	case VIDIOC_REQBUFS:
+		return MockReqbufs(m, arg);
+	case VIDIOC_QUERYBUF: {
+		struct v4l2_buffer *buf = arg;
+		struct mock_queue *q = MockQueue(m, buf->type);
+
+		if (!q || buf->index >= q->count || !buf->m.planes)
+			return -EINVAL;
+		MockFillBuffer(q, buf, buf->index);
+		return 0;
+	}
+	case VIDIOC_QBUF:
+		return MockQbuf(m, arg);
+	case VIDIOC_DQBUF:
+		return MockDqbuf(m, arg);
+	case VIDIOC_STREAMON:
+		return MockStream(m, *(uint32_t *)arg, 1);
+	case VIDIOC_STREAMOFF:
+		return MockStream(m, *(uint32_t *)arg, 0);
+	case VIDIOC_SUBSCRIBE_EVENT:
+		if (((struct v4l2_event_subscription *)arg)->type != V4L2_EVENT_SOURCE_CHANGE)
+			return -EINVAL;
+		m->subscribed = 1;
+		return 0;
+	case VIDIOC_DQEVENT: {
+		struct v4l2_event *ev = arg;
+
+		if (!m->event)
+			return -ENOENT;
+		memset(ev, 0, sizeof(*ev));
+		ev->type = V4L2_EVENT_SOURCE_CHANGE;
+		ev->u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION;
+		m->event = 0;
+		return 0;
+	}
+	case VIDIOC_G_SELECTION: {
+		struct v4l2_selection *sel = arg;
+
+		if (sel->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || !m->cap.fmt.fmt.pix_mp.width)
+			return -EINVAL;
+		switch (sel->target) {
+		case V4L2_SEL_TGT_COMPOSE:
+		case V4L2_SEL_TGT_COMPOSE_DEFAULT:
+		case V4L2_SEL_TGT_CROP:
+			sel->r = m->visible;
+			return 0;
+		}
+		return -EINVAL;
+	}
+	case VIDIOC_G_CTRL: {
+		struct v4l2_control *ctrl = arg;
+
+		switch (ctrl->id) {
+		case V4L2_CID_MIN_BUFFERS_FOR_CAPTURE:
+			ctrl->value = m->min_buffers;
+			return 0;
+#ifdef V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY
+		case V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY:
+			ctrl->value = m->display_delay;
+			return 0;
+		case V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE:
+			ctrl->value = m->display_delay_enable;
+			return 0;
+#endif
+		}
+		return -EINVAL;
+	}
+#ifdef V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY
+	case VIDIOC_S_CTRL: {
+		struct v4l2_control *ctrl = arg;
+
+		// the codec is opened at STREAMON
+		if (m->avctx)
+			return -EBUSY;
+		switch (ctrl->id) {
+		case V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY:
+			m->display_delay = ctrl->value < 0 ? 0 : ctrl->value;
+			return 0;
+		case V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE:
+			m->display_delay_enable = !!ctrl->value;
+			return 0;
+		}
+		return -EINVAL;
+	}
+#endif
+	case VIDIOC_DECODER_CMD:
+		return MockDecoderCmd(m, arg, 0);
+	case VIDIOC_TRY_DECODER_CMD:
+		return MockDecoderCmd(m, arg, 1);
+	default:
+		// no VIDIOC_EXPBUF: zero-copy falls back to copying
+		return -ENOTTY;
+	}
+}
+
+
+static int MockIoctl(int fd, unsigned long request, void *arg)
+{
+	struct mock *m = MockFind(fd);
+	int ret;
+
+	if (!m) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&m->mutex);
+	ret = MockDispatch(m, request, arg);
+	pthread_mutex_unlock(&m->mutex);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void *MockMmap(size_t length, int fd, off_t offset)
+{
+	struct mock *m = MockFind(fd);
+	struct mock_queue *q;
+	unsigned int index;
+
+	if (!m) {
+		errno = EBADF;
+		return MAP_FAILED;
+	}
+	q = offset >= MOCK_CAP_OFFSET ? &m->cap : &m->out;
+	index = (offset % MOCK_CAP_OFFSET) / MOCK_OFFSET_STEP;
+	if (index >= q->count || length > q->bufs[index].length) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	return q->bufs[index].data;
+}
+
+
+///
+/// The memory belongs to the buffers, freed with REQBUFS 0.
+///
+static int MockMunmap(__attribute__ ((unused)) void *addr,
+	__attribute__ ((unused)) size_t length)
+{
+	return 0;
+}
+
+
+static short MockRevents(struct mock *m, short events)
+{
+	short revents = 0;
+
+	pthread_mutex_lock(&m->mutex);
+	if (MockOldest(&m->out, MOCK_DONE) >= 0)
+		revents |= POLLOUT | POLLWRNORM;
+	if (MockOldest(&m->cap, MOCK_DONE) >= 0 || m->last_dequeued)
+		revents |= POLLIN | POLLRDNORM;
+	if (m->event)
+		revents |= POLLPRI;
+	pthread_mutex_unlock(&m->mutex);
+
+	return revents & (events | POLLERR | POLLHUP);
+}
+
+
+///
+/// poll() the other fds, a mock fd is ready by the state of its
+/// queues. The eventfds only wake up the wait.
+///
+static int MockPoll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct mock *m;
+	struct pollfd pfds[nfds];
+	struct timespec start, now;
+	uint64_t count;
+	nfds_t i;
+	int ready, woken, ret, wait;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		ready = 0;
+		for (i = 0; i < nfds; i++) {
+			pfds[i] = fds[i];
+			pfds[i].revents = 0;
+			if (!(m = MockFind(fds[i].fd)))
+				continue;
+
+			// reset the wakeup before looking at the queues
+			if (read(m->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				return -1;
+			if ((fds[i].revents = MockRevents(m, fds[i].events)))
+				ready++;
+			pfds[i].events = POLLIN;
+		}
+
+		wait = timeout;
+		if (ready) {
+			wait = 0;
+		} else if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait = timeout - ((now.tv_sec - start.tv_sec) * 1000 +
+				(now.tv_nsec - start.tv_nsec) / 1000000);
+			if (wait < 0)
+				wait = 0;
+		}
+
+		if ((ret = poll(pfds, nfds, wait)) < 0)
+			return ret;
+
+		ret = ready;
+		woken = 0;
+		for (i = 0; i < nfds; i++) {
+			if (MockFind(fds[i].fd)) {
+				woken |= pfds[i].revents & POLLIN;
+				continue;
+			}
+			if ((fds[i].revents = pfds[i].revents))
+				ret++;
+		}
+		// the worker changed the queues: look again
+		if (ret || !woken)
+			return ret;
+	}
+}
+
+
+///
+/// Parse "mock:latency_us=N,min_buffers=N,max_buffers=N".
+///
+static void MockOptions(struct mock *m, const char *device)
+{
+	char *opts, *opt, *save;
+
+	if (!device[4] || !(opts = strdup(device + 5)))
+		return;
+	for (opt = strtok_r(opts, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		if (!strncmp(opt, "latency_us=", 11))
+			m->latency_us = strtoul(opt + 11, NULL, 0);
+		else if (!strncmp(opt, "min_buffers=", 12))
+			m->min_buffers = strtoul(opt + 12, NULL, 0);
+		else if (!strncmp(opt, "max_buffers=", 12))
+			m->max_buffers = strtoul(opt + 12, NULL, 0);
+		else
+			fprintf(stderr, "MockOpen: unknown option %s\n", opt);
+	}
+	free(opts);
+
+	if (m->max_buffers < 1 || m->max_buffers > MOCK_MAX_BUFFERS)
+		m->max_buffers = MOCK_MAX_BUFFERS;
+	if (m->min_buffers > m->max_buffers)
+		m->min_buffers = m->max_buffers;
+}
+
+
+static int MockOpen(const char *device, __attribute__ ((unused)) int flags)
+{
+	struct mock *m;
+	unsigned int slot;
+
+	// one instance per open, like an M2M device
+	for (slot = 0; slot < MOCK_MAX_INSTANCES && mocks[slot]; slot++)
+		;
+	if (slot == MOCK_MAX_INSTANCES) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (!(m = calloc(1, sizeof(*m))))
+		return -1;
+
+	m->min_buffers = 4;
+	m->max_buffers = MOCK_MAX_BUFFERS;
+	MockOptions(m, device);
+	m->out.fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	m->out.fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+	m->out.fmt.fmt.pix_mp.num_planes = 1;
+	m->out.fmt.fmt.pix_mp.plane_fmt[0].sizeimage = 1024 * 1024;
+	m->cap.fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	m->cur_out = -1;
+
+	pthread_mutex_init(&m->mutex, NULL);
+	pthread_cond_init(&m->cond, NULL);
+	m->pkt = av_packet_alloc();
+	m->frame = av_frame_alloc();
+	if ((m->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || !m->pkt || !m->frame)
+		goto fail;
+	if (pthread_create(&m->thread, NULL, MockWorker, m)) {
+		close(m->fd);
+		goto fail;
+	}
+
+	fprintf(stderr, "MockOpen: latency %u us capture buffers %u..%u\n",
+		m->latency_us, m->min_buffers, m->max_buffers);
+	mocks[slot] = m;
+	return m->fd;
+
+fail:
+	av_packet_free(&m->pkt);
+	av_frame_free(&m->frame);
+	free(m);
+	errno = ENOMEM;
+	return -1;
+}
+
+
+static int MockClose(int fd)
+{
+	struct mock *m = MockFind(fd);
+	unsigned int i;
+
+	if (!m) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&m->mutex);
+	m->quit = 1;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+	pthread_join(m->thread, NULL);
+
+	MockFreeBuffers(&m->out);
+	MockFreeBuffers(&m->cap);
+	if (m->parser)
+		av_parser_close(m->parser);
+	avcodec_free_context(&m->avctx);
+	av_packet_free(&m->pkt);
+	av_frame_free(&m->frame);
+	pthread_cond_destroy(&m->cond);
+	pthread_mutex_destroy(&m->mutex);
+	close(m->fd);
+	for (i = 0; i < MOCK_MAX_INSTANCES; i++) {
+		if (mocks[i] == m)
+			mocks[i] = NULL;
+	}
+	free(m);
+
+	return 0;
+}
+
+
+const struct v4l2_backend mock_backend = {
+	.name = "mock",
+	.open = MockOpen,
+	.close = MockClose,
+	.ioctl = MockIoctl,
+	.mmap = MockMmap,
+	.munmap = MockMunmap,
+	.poll = MockPoll,
+};
@@ -0,0 +1,2 @@
+
+extern const struct v4l2_backend mock_backend;
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux/videodev2.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "main.h"
+#include "backend.h"
+#include "mosaic.h"
+#include "stream.h"
+#include "v4l2.h"
+#include "video.h"
+
+///
+/// One stream of the mosaic: its input, its decoder instance on the
+/// shared M2M device and its layer of the sink.
+///
+struct mosaic_stream {
+	const char *url;
+	struct stream *stream;
+	struct decoder dec;
+	unsigned int layer;
+	AVPacket pkt;
+	int have_pkt;
+	int eof;
+	int drain;
+	int capture;
+	int active;			///< on screen, not failed
+};
+
+static struct mosaic_stream *mosaic[MOSAIC_MAX];
+static int mosaic_count;
+
+
+static void MosaicSelect(struct mosaic_stream *m)
+{
+	StreamSelect(m->stream);
+	V4l2Select(&m->dec);
+	if (m->active)
+		VideoSelect(m->layer);
+}
+
+
+///
+/// Open the input and the decoder of one stream.
+///
+static struct mosaic_stream *MosaicOpen(const char *device, const char *url)
+{
+	struct mosaic_stream *m;
+
+	if (!(m = calloc(1, sizeof(*m))))
+		return NULL;
+	m->url = url;
+	if (!(m->stream = StreamNew()))
+		goto free;
+	if ((m->dec.fd = V4l2Open(device, O_RDWR | O_NONBLOCK)) < 0) {
+		fprintf(stderr, "MosaicOpen: open %s failed: (%d): %m\n", device, errno);
+		goto stream;
+	}
+	StreamSelect(m->stream);
+	if (StreamOpen((char *)url))
+		goto close;
+	av_init_packet(&m->pkt);
+	return m;
+
+close:
+	V4l2Close(m->dec.fd);
+stream:
+	StreamDelete(m->stream);
+free:
+	free(m);
+	return NULL;
+}
+
+
+static void MosaicClose(struct mosaic_stream *m)
+{
+	StreamSelect(m->stream);
+	V4l2Select(&m->dec);
+	if (m->have_pkt)
+		av_packet_unref(&m->pkt);
+	StreamClose();
+	StreamOff();
+	MunmapBuffer();
+	V4l2Close(m->dec.fd);
+	StreamDelete(m->stream);
+	free(m);
+}
+
+
+///
+/// Feed the decoder of the selected stream and set up its capture side.
+///
+static void MosaicFeed(struct mosaic_stream *m, int zero_copy)
+{
+	int ret;
+
+	while (!m->eof) {
+		if (!m->have_pkt) {
+			if (ReadPacket(&m->pkt)) {
+				m->eof = 1;
+				break;
+			}
+			m->have_pkt = 1;
+		}
+		if ((ret = QueuePacketOut(&m->pkt, 0)) > 0)
+			break;
+		m->have_pkt = 0;
+		if (ret < 0) {
+			fprintf(stderr, "MosaicFeed: %s: the decoder takes no more data\n", m->url);
+			m->active = 0;
+			return;
+		}
+	}
+	if (m->eof && !m->drain)
+		m->drain = !V4l2Drain();
+
+	if (m->capture && V4l2CaptureChanged()) {
+		VideoReleaseCapture();
+		V4l2ReleaseCapture();
+		m->capture = 0;
+	}
+	if (!m->capture && dec->start && !V4l2SetupCapture(zero_copy)) {
+		m->capture = 1;
+		if (zero_copy && VideoImportCapture(dec->cap_count))
+			fprintf(stderr, "MosaicFeed: %s: zero-copy import failed, copy frames\n",
+				m->url);
+	}
+}
+
+
+///
+/// Decode the streams at once, each on its own decoder instance, and
+/// show them on planes of their own: a grid, or PiP windows on the
+/// first one. One atomic commit per vblank flips all of them.
+/// @returns 0 if the streams played to the end.
+///
+int MosaicRun(const char *device, const char *sink, const char *card, char *urls[],
+	int count, int pip, int zero_copy, unsigned int out_buffers,
+	volatile sig_atomic_t *quit)
+{
+	struct pollfd fds[MOSAIC_MAX + 1];
+	struct mosaic_stream *m;
+	unsigned int layers = 0;
+	int i, n, ret = -1;
+	int capture;
+
+	if (count > MOSAIC_MAX) {
+		fprintf(stderr, "MosaicRun: %i streams, showing the first %i\n", count, MOSAIC_MAX);
+		count = MOSAIC_MAX;
+	}
+	for (i = 0; i < count; i++) {
+		if (!(m = MosaicOpen(device, urls[i])))
+			fprintf(stderr, "MosaicRun: %s: can't open, skipped\n", urls[i]);
+		else
+			mosaic[mosaic_count++] = m;
+	}
+	if (!mosaic_count)
+		return -1;
+
+	// the mode is chosen for the first stream
+	VideoSetLayers(mosaic_count, pip);
+	MosaicSelect(mosaic[0]);
+	if (VideoInit(sink, card)) {
+		fprintf(stderr, "MosaicRun: can't open the %s sink\n", sink);
+		goto close;
+	}
+
+	// the layers go to the streams the decoder takes
+	for (i = 0; i < mosaic_count; i++) {
+		m = mosaic[i];
+		MosaicSelect(m);
+		if (V4l2SetupOutput(out_buffers)) {
+			fprintf(stderr, "MosaicRun: %s: the decoder can't decode it\n", m->url);
+			continue;
+		}
+		if (VideoSelect(layers)) {
+			fprintf(stderr, "MosaicRun: %s: no plane left, skipped\n", m->url);
+			continue;
+		}
+		m->layer = layers++;
+		m->active = 1;
+	}
+	if (!layers)
+		goto deinit;
+
+	while (!*quit) {
+		capture = 0;
+		for (i = n = 0; i < mosaic_count; i++) {
+			if (!mosaic[i]->active)
+				continue;
+			MosaicSelect(mosaic[i]);
+			MosaicFeed(mosaic[i], zero_copy);
+			capture |= mosaic[i]->capture;
+			n += mosaic[i]->active;
+		}
+		if (!n)
+			break;
+
+		// all layers in one commit
+		if (capture) {
+			ret = VideoPresent();
+			if (ret == -EPIPE) {
+				ret = 0;
+				break;
+			}
+			if (ret < 0)
+				break;
+			if (ret > 0)
+				continue;
+		}
+
+		// frames wait in their decoder until the flip is complete
+		for (i = n = 0; i < mosaic_count; i++) {
+			m = mosaic[i];
+			if (!m->active)
+				continue;
+			MosaicSelect(m);
+			fds[n].fd = m->dec.fd;
+			fds[n].events = POLLPRI;
+			if (!m->eof)
+				fds[n].events |= POLLOUT;
+			// the decoder polls readable after its last buffer
+			if (m->capture && !VideoFlipPending() && !m->dec.cap_last)
+				fds[n].events |= POLLIN;
+			fds[n].revents = 0;
+			n++;
+		}
+		fds[n].fd = VideoFd();
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+
+		if (V4l2Poll(fds, n + 1, capture ? 1000 : 10) < 0 && errno != EINTR) {
+			fprintf(stderr, "MosaicRun: poll failed: (%d): %m\n", errno);
+			break;
+		}
+		for (i = n = 0; i < mosaic_count; i++) {
+			if (!mosaic[i]->active)
+				continue;
+			if (fds[n++].revents & POLLPRI) {
+				MosaicSelect(mosaic[i]);
+				V4l2HandleEvent();
+			}
+		}
+		if (fds[n].revents & POLLIN)
+			VideoHandleEvent();
+	}
+
+deinit:
+	VideoDeInit();
+close:
+	for (i = 0; i < mosaic_count; i++)
+		MosaicClose(mosaic[i]);
+	mosaic_count = 0;
+	StreamSelect(NULL);
+	V4l2Select(NULL);
+
+	return ret;
+}
@@ -0,0 +1,5 @@
+#define MOSAIC_MAX	4	///< streams at once, the planes may allow fewer
+
+int MosaicRun(const char *device, const char *sink, const char *card, char *urls[],
+	int count, int pip, int zero_copy, unsigned int out_buffers,
+	volatile sig_atomic_t *quit);
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include <linux/videodev2.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "main.h"
+#include "backend.h"
+#include "pipeline.h"
+#include "queue.h"
+#include "stream.h"
+#include "v4l2.h"
+#include "video.h"
+
+#define PKT_QUEUE_SIZE	64	///< demuxed packets between demux and feed
+
+static struct queue pkt_queue;
+static AVPacket pkt_eof;		///< end of stream marker in pkt_queue
+static volatile sig_atomic_t *pipe_quit;
+static _Atomic int feed_started;	///< first packet reached the decoder
+static _Atomic int feed_done;		///< no more OUTPUT buffers follow
+
+// statistics
+static unsigned long decoder_stalls;	///< feed waited for an OUTPUT buffer
+static unsigned long present_stalls;	///< no frame ready after a flip
+static unsigned long present_frames;
+
+
+///
+/// Demux thread: read packets ahead into pkt_queue.
+///
+static void *DemuxThread(__attribute__ ((unused)) void *arg)
+{
+	AVPacket *pkt;
+
+	while (!*pipe_quit) {
+		if (!(pkt = av_packet_alloc()))
+			break;
+		if (ReadPacket(pkt)) {
+			av_packet_free(&pkt);
+			break;
+		}
+		if (QueuePushWait(&pkt_queue, pkt, pipe_quit)) {
+			av_packet_free(&pkt);
+			return NULL;
+		}
+	}
+	QueuePushWait(&pkt_queue, &pkt_eof, pipe_quit);
+
+	return NULL;
+}
+
+
+///
+/// Wait until the decoder returns an OUTPUT buffer.
+///
+static void FeedWait(void)
+{
+	struct pollfd pfd = { .fd = dec->fd, .events = POLLOUT };
+
+	V4l2Poll(&pfd, 1, 100);
+}
+
+
+///
+/// Decoder feed thread for MPEG-TS files: the PES payload is read
+/// straight into the OUTPUT buffers, there is no demux thread.
+///
+static void *FeedDirectThread(__attribute__ ((unused)) void *arg)
+{
+	int stalled = 0;
+	int ret;
+
+	while (!*pipe_quit) {
+		if ((ret = QueuePesOut()) < -1) {
+			fprintf(stderr, "FeedDirectThread: the decoder takes no more data\n");
+			*pipe_quit = 1;
+			break;
+		}
+		if (ret < 0) {
+			while (V4l2Drain() && !*pipe_quit)
+				FeedWait();
+			break;
+		}
+		if (ret > 0) {
+			if (!stalled++)
+				decoder_stalls++;
+			FeedWait();
+			continue;
+		}
+		stalled = 0;
+		atomic_store(&feed_started, 1);
+	}
+	atomic_store(&feed_done, 1);
+
+	return NULL;
+}
+
+
+///
+/// Decoder feed thread: move packets from pkt_queue into the decoder.
+///
+static void *FeedThread(__attribute__ ((unused)) void *arg)
+{
+	AVPacket *pkt;
+	int stalled;
+	int ret;
+
+	while (!*pipe_quit) {
+		if (!(pkt = QueuePopWait(&pkt_queue, pipe_quit)))
+			break;
+
+		if (pkt == &pkt_eof) {
+			while (V4l2Drain() && !*pipe_quit)
+				FeedWait();
+			break;
+		}
+
+		stalled = 0;
+		while ((ret = QueuePacketOut(pkt, 0)) > 0 && !*pipe_quit) {
+			if (!stalled++)
+				decoder_stalls++;
+			FeedWait();
+		}
+		av_packet_free(&pkt);
+		if (ret < 0) {
+			fprintf(stderr, "FeedThread: the decoder takes no more data\n");
+			*pipe_quit = 1;
+			break;
+		}
+		atomic_store(&feed_started, 1);
+	}
+	atomic_store(&feed_done, 1);
+
+	return NULL;
+}
+
+
+///
+/// Presentation, runs in the calling thread. Ends with the last buffer
+/// of the drain, or if nothing happens for a second after feeding
+/// stopped, e.g. on a feed error.
+///
+static void PresentLoop(int zero_copy)
+{
+	struct pollfd fds[2];
+	int capture = 0;
+	int waiting = 0;
+	int done;
+	int ret;
+
+	while (!*pipe_quit) {
+		// new resolution: only the capture side is set up again
+		if (capture && V4l2CaptureChanged()) {
+			VideoReleaseCapture();
+			V4l2ReleaseCapture();
+			capture = 0;
+		}
+
+		if (!capture && atomic_load(&feed_started)) {
+			if (!V4l2SetupCapture(zero_copy)) {
+				capture = 1;
+				if (zero_copy && VideoImportCapture(dec->cap_count))
+					fprintf(stderr, "PresentLoop: zero-copy import failed, copy frames\n");
+			}
+		}
+
+		if (capture) {
+			ret = VideoPresent();
+			if (ret < 0)
+				break;
+			if (ret > 0) {
+				present_frames++;
+				waiting = 0;
+			} else if (!VideoFlipPending() && !waiting) {
+				present_stalls++;
+				waiting = 1;
+			}
+		}
+
+		fds[0].fd = dec->fd;
+		fds[0].events = (capture && !VideoFlipPending()) ? POLLIN | POLLPRI : POLLPRI;
+		fds[0].revents = 0;
+		fds[1].fd = VideoFd();
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		done = atomic_load(&feed_done);
+		ret = V4l2Poll(fds, 2, capture || done ? 1000 : 10);
+		if (ret < 0 && errno != EINTR) {
+			fprintf(stderr, "PresentLoop: poll failed: (%d): %m\n", errno);
+			break;
+		}
+		if (!ret && done) {
+			fprintf(stderr, "PresentLoop: feeding stopped, no more frames\n");
+			break;
+		}
+		if (fds[0].revents & POLLPRI)
+			V4l2HandleEvent();
+		if (fds[1].revents & POLLIN)
+			VideoHandleEvent();
+	}
+}
+
+
+///
+/// Play with separate demux, decoder feed and presentation threads.
+///
+void PipelineRun(int zero_copy, int direct, volatile sig_atomic_t *quit)
+{
+	pthread_t demux, feed;
+	AVPacket *pkt;
+
+	pipe_quit = quit;
+	if (QueueInit(&pkt_queue, "demux->feed", PKT_QUEUE_SIZE))
+		return;
+
+	if (!direct && pthread_create(&demux, NULL, DemuxThread, NULL)) {
+		fprintf(stderr, "PipelineRun: cannot create demux thread\n");
+		goto out;
+	}
+	if (pthread_create(&feed, NULL, direct ? FeedDirectThread : FeedThread, NULL)) {
+		fprintf(stderr, "PipelineRun: cannot create feed thread\n");
+		*quit = 1;
+		if (!direct)
+			pthread_join(demux, NULL);
+		goto out;
+	}
+
+	PresentLoop(zero_copy);
+
+	*quit = 1;
+	pthread_join(feed, NULL);
+	if (!direct)
+		pthread_join(demux, NULL);
+
+	if (!direct) {
+		fprintf(stderr, "pipeline: demux   ");
+		QueuePrintStats(&pkt_queue);
+	}
+	fprintf(stderr, "pipeline: feed    decoder OUTPUT full stalls %lu\n",
+		decoder_stalls);
+	fprintf(stderr, "pipeline: present frames %lu no frame after flip %lu\n",
+		present_frames, present_stalls);
+
+out:
+	while ((pkt = QueuePop(&pkt_queue))) {
+		if (pkt != &pkt_eof)
+			av_packet_free(&pkt);
+	}
+	QueueFree(&pkt_queue);
+}
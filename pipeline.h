@@ -0,0 +1,2 @@
+
+void PipelineRun(int zero_copy, int direct, volatile sig_atomic_t *quit);
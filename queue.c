@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "queue.h"
+
+#define QUEUE_SPINS	64	///< polls before the waiter starts to sleep
+#define QUEUE_SLEEP_MAX	1000000	///< ns, longest sleep of a waiter
+
+
+int QueueInit(struct queue *q, const char *name, unsigned int size)
+{
+	unsigned int n = 1;
+
+	while (n < size)
+		n <<= 1;
+
+	q->name = name;
+	q->size = n;
+	if (!(q->slots = calloc(n, sizeof(*q->slots)))) {
+		fprintf(stderr, "QueueInit: %s: out of memory\n", name);
+		return -1;
+	}
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->pushed, 0);
+	atomic_init(&q->full_stalls, 0);
+	atomic_init(&q->empty_stalls, 0);
+	atomic_init(&q->max_depth, 0);
+	atomic_init(&q->depth_sum, 0);
+
+	return 0;
+}
+
+
+void QueueFree(struct queue *q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
+
+
+///
+/// @returns 0 or -1 if the queue is full.
+///
+int QueuePush(struct queue *q, void *item)
+{
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	unsigned int depth = head - tail;
+
+	if (depth == q->size)
+		return -1;
+
+	q->slots[head & (q->size - 1)] = item;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	// statistics are only written by the producer
+	depth++;
+	atomic_store_explicit(&q->pushed,
+		atomic_load_explicit(&q->pushed, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+	atomic_store_explicit(&q->depth_sum,
+		atomic_load_explicit(&q->depth_sum, memory_order_relaxed) + depth,
+		memory_order_relaxed);
+	if (depth > atomic_load_explicit(&q->max_depth, memory_order_relaxed))
+		atomic_store_explicit(&q->max_depth, depth, memory_order_relaxed);
+
+	return 0;
+}
+
+
+///
+/// @returns the oldest item or NULL if the queue is empty.
+///
+void *QueuePop(struct queue *q)
+{
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+	void *item;
+
+	if (head == tail)
+		return NULL;
+
+	item = q->slots[tail & (q->size - 1)];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	return item;
+}
+
+
+unsigned int QueueDepth(struct queue *q)
+{
+	return atomic_load_explicit(&q->head, memory_order_acquire) -
+		atomic_load_explicit(&q->tail, memory_order_acquire);
+}
+
+
+///
+/// Spin a little, then sleep with growing intervals.
+///
+static void QueueBackoff(unsigned int *round)
+{
+	struct timespec ts = { 0, 0 };
+	long ns;
+
+	if (++(*round) < QUEUE_SPINS) {
+		sched_yield();
+		return;
+	}
+
+	ns = 10000L << ((*round - QUEUE_SPINS) < 7 ? (*round - QUEUE_SPINS) : 7);
+	ts.tv_nsec = ns < QUEUE_SLEEP_MAX ? ns : QUEUE_SLEEP_MAX;
+	nanosleep(&ts, NULL);
+}
+
+
+///
+/// Push and wait while the queue is full.
+/// @returns 0 or -1 if quit was set while waiting.
+///
+int QueuePushWait(struct queue *q, void *item, volatile sig_atomic_t *quit)
+{
+	unsigned int round = 0;
+
+	while (QueuePush(q, item)) {
+		if (!round)
+			atomic_fetch_add_explicit(&q->full_stalls, 1, memory_order_relaxed);
+		if (quit && *quit)
+			return -1;
+		QueueBackoff(&round);
+	}
+
+	return 0;
+}
+
+
+///
+/// Pop and wait while the queue is empty.
+/// @returns the item or NULL if quit was set while waiting.
+///
+void *QueuePopWait(struct queue *q, volatile sig_atomic_t *quit)
+{
+	unsigned int round = 0;
+	void *item;
+
+	while (!(item = QueuePop(q))) {
+		if (!round)
+			atomic_fetch_add_explicit(&q->empty_stalls, 1, memory_order_relaxed);
+		if (quit && *quit)
+			return NULL;
+		QueueBackoff(&round);
+	}
+
+	return item;
+}
+
+
+void QueuePrintStats(struct queue *q)
+{
+	unsigned long pushed = atomic_load(&q->pushed);
+
+	fprintf(stderr, "queue %s: size %u items %lu depth max %u avg %.1f "
+		"stalls full %lu empty %lu\n", q->name, q->size, pushed,
+		atomic_load(&q->max_depth),
+		pushed ? (double)atomic_load(&q->depth_sum) / pushed : 0.0,
+		atomic_load(&q->full_stalls), atomic_load(&q->empty_stalls));
+}
@@ -0,0 +1,33 @@
+
+///
+/// Bounded single-producer/single-consumer ring of pointers.
+///
+struct queue {
+	const char *name;
+	unsigned int size;		///< slots, power of two
+	void **slots;
+	_Atomic unsigned int head;	///< next slot to write, producer only
+	_Atomic unsigned int tail;	///< next slot to read, consumer only
+	// statistics
+	_Atomic unsigned long pushed;
+	_Atomic unsigned long full_stalls;	///< producer waited for a free slot
+	_Atomic unsigned long empty_stalls;	///< consumer waited for an item
+	_Atomic unsigned int max_depth;
+	_Atomic unsigned long long depth_sum;
+};
+
+int QueueInit(struct queue *q, const char *name, unsigned int size);
+
+void QueueFree(struct queue *q);
+
+int QueuePush(struct queue *q, void *item);
+
+void *QueuePop(struct queue *q);
+
+unsigned int QueueDepth(struct queue *q);
+
+int QueuePushWait(struct queue *q, void *item, volatile sig_atomic_t *quit);
+
+void *QueuePopWait(struct queue *q, volatile sig_atomic_t *quit);
+
+void QueuePrintStats(struct queue *q);
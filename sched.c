@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sched.h"
+
+#define SCHED_MARGIN	1000000LL	///< ns a commit needs before the vblank
+#define SCHED_RESYNC	1000000000LL	///< ns off the clock: a PTS jump
+#define SCHED_MAX_DROP	3		///< then the clock slips instead
+
+static uint64_t sched_delay;		///< ns, jitter buffer of live inputs
+
+
+static uint64_t SchedNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+///
+/// @param period	ns between vblanks
+///
+void SchedInit(struct sched *s, const char *name, uint64_t period)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->period = period;
+	s->speed = 1;
+	s->delay = sched_delay;
+}
+
+
+///
+/// Show the frames of the clocks SchedInit() sets up from then on ms
+/// later than they could: a live input may deliver that late and still
+/// be on time. A clock that gets further ahead than twice that drops
+/// the latency it gathered.
+///
+void SchedSetDelay(unsigned int ms)
+{
+	sched_delay = (uint64_t)ms * 1000000;
+	// more is a PTS jump
+	if (sched_delay > SCHED_RESYNC / 2)
+		sched_delay = SCHED_RESYNC / 2;
+}
+
+
+///
+/// Forget the clock, the next frame is shown at once, e.g. after a
+/// source change.
+///
+void SchedReset(struct sched *s)
+{
+	s->anchored = 0;
+	s->late_run = 0;
+}
+
+
+///
+/// Show speed times faster than the PTS say, e.g. the keyframes of a
+/// fast-forward. The clock restarts.
+///
+void SchedSetSpeed(struct sched *s, unsigned int speed)
+{
+	s->speed = speed ? speed : 1;
+	SchedReset(s);
+}
+
+
+///
+/// A vblank happened, from the flip event or a vblank event.
+///
+void SchedVblank(struct sched *s, uint64_t ns)
+{
+	s->vblank = ns;
+}
+
+
+static void SchedAnchor(struct sched *s, uint64_t vblank, int64_t pts)
+{
+	s->base_ns = vblank;
+	s->base_pts = pts;
+	s->anchored = 1;
+	s->late_run = 0;
+}
+
+
+///
+/// Decide what to do with a decoded frame, committed now it is scanned
+/// out at the next vblank. The first frame sets the clock, a delay later.
+/// @param pts	presentation time in us
+/// @param ahead	frames queued before this one, e.g. a pending flip
+///
+enum sched_decision SchedFrame(struct sched *s, int64_t pts, unsigned int ahead)
+{
+	uint64_t now = SchedNow();
+	uint64_t next;
+	int64_t diff;
+
+	// first vblank a commit now still reaches
+	if (s->vblank) {
+		next = s->vblank + s->period;
+		if (next < now + SCHED_MARGIN)
+			next += ((now + SCHED_MARGIN - next) / s->period + 1) * s->period;
+	} else {
+		next = now + s->period;
+	}
+	next += ahead * s->period;
+
+	if (!s->anchored)
+		SchedAnchor(s, next + s->delay, pts);
+
+	diff = (int64_t)(s->base_ns + (pts - s->base_pts) * 1000 / (int64_t)s->speed - next);
+	if (diff > SCHED_RESYNC || diff < -SCHED_RESYNC ||
+			(s->delay && diff > (int64_t)(2 * s->delay + s->period))) {
+		SchedAnchor(s, next + s->delay, pts);
+		s->resyncs++;
+		diff = s->delay;
+	}
+
+	if (diff < -(int64_t)s->period / 2) {
+		if (s->late_run < SCHED_MAX_DROP) {
+			s->late_run++;
+			s->dropped++;
+			return SCHED_DROP;
+		}
+		// overload or a stalled input: show late frames at a slower
+		// clock, don't drop all
+		SchedAnchor(s, next + s->delay, pts);
+		s->resyncs++;
+		diff = s->delay;
+	}
+
+	if (diff >= (int64_t)s->period / 2) {
+		s->waits++;
+		return SCHED_WAIT;
+	}
+
+	s->late_run = 0;
+	s->shown++;
+	return SCHED_SHOW;
+}
+
+
+void SchedPrintStats(struct sched *s)
+{
+	fprintf(stderr, "sched %s: period %.3f ms shown %lu dropped %lu "
+		"waits %lu resyncs %lu\n", s->name, s->period / 1e6, s->shown,
+		s->dropped, s->waits, s->resyncs);
+}
@@ -0,0 +1,40 @@
+
+///
+/// Presentation clock: maps frame PTS to vblanks.
+///
+struct sched {
+	const char *name;
+	uint64_t period;		///< ns between two vblanks
+	uint64_t vblank;		///< CLOCK_MONOTONIC ns of the last vblank, 0 unknown
+	int anchored;
+	uint64_t base_ns;		///< vblank of the anchor frame
+	int64_t base_pts;		///< PTS of the anchor frame, us
+	unsigned int late_run;		///< frames dropped in a row
+	unsigned int speed;		///< PTS run this much faster, fast-forward
+	uint64_t delay;			///< ns the first frame waits, jitter buffer
+	// statistics
+	unsigned long shown;
+	unsigned long dropped;
+	unsigned long waits;		///< vblanks a frame waited for its turn
+	unsigned long resyncs;
+};
+
+enum sched_decision {
+	SCHED_SHOW,			///< commit now, it lands on its vblank
+	SCHED_WAIT,			///< too early, wait for the next vblank
+	SCHED_DROP,			///< its vblank passed, give it back
+};
+
+void SchedInit(struct sched *s, const char *name, uint64_t period);
+
+void SchedSetDelay(unsigned int ms);
+
+void SchedReset(struct sched *s);
+
+void SchedSetSpeed(struct sched *s, unsigned int speed);
+
+void SchedVblank(struct sched *s, uint64_t ns);
+
+enum sched_decision SchedFrame(struct sched *s, int64_t pts, unsigned int ahead);
+
+void SchedPrintStats(struct sched *s);
@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "live.h"
+#include "main.h"
+#include "sched.h"
+#include "sink.h"
+#include "stream.h"
+#include "trace.h"
+#include "v4l2.h"
+#include "video.h"
+
+#define NULL_HZ_DEFAULT	60
+
+
+// null sink: holds each frame for one simulated vblank
+
+static struct {
+	int fd;				///< periodic timerfd, -1 if unpaced
+	unsigned int hz;
+	int flip_pending;
+	int held;			///< decoded frame not yet due
+	int64_t held_tag;
+	int next;			///< frame committed for the vblank
+	int64_t next_tag;
+	int shown;			///< frame "on screen"
+	struct sched sched;
+	unsigned long frames;
+	unsigned long vblanks;
+	struct timespec start;
+} null = { .fd = -1 };
+
+
+///
+/// @param arg	refresh rate in Hz, 0 takes frames as fast as they come
+///
+static int NullInit(const char *arg)
+{
+	struct itimerspec its;
+
+	null.hz = arg ? strtoul(arg, NULL, 0) : NULL_HZ_DEFAULT;
+	null.fd = -1;
+	null.flip_pending = 0;
+	null.held = null.next = null.shown = -1;
+	null.frames = null.vblanks = 0;
+	clock_gettime(CLOCK_MONOTONIC, &null.start);
+
+	if (!null.hz)
+		return 0;
+	SchedInit(&null.sched, "null", 1000000000 / null.hz);
+
+	if ((null.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		fprintf(stderr, "NullInit: timerfd_create failed: (%d): %m\n", errno);
+		return -1;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_nsec = 1000000000 / null.hz;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(null.fd, 0, &its, NULL)) {
+		fprintf(stderr, "NullInit: timerfd_settime failed: (%d): %m\n", errno);
+		close(null.fd);
+		null.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void NullDeInit(void)
+{
+	struct timespec now;
+	double sec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sec = now.tv_sec - null.start.tv_sec + (now.tv_nsec - null.start.tv_nsec) / 1e9;
+
+	fprintf(stderr, "NullDeInit: %lu frames %lu vblanks in %.2f s (%.1f fps) at %u Hz\n",
+		null.frames, null.vblanks, sec, sec > 0 ? null.frames / sec : 0.0, null.hz);
+
+	if (null.fd >= 0) {
+		SchedPrintStats(&null.sched);
+		close(null.fd);
+	}
+	null.fd = -1;
+}
+
+
+static int NullCaptureFormat(__attribute__ ((unused)) uint32_t pixelformat,
+					__attribute__ ((unused)) int zero_copy)
+{
+	return 1;
+}
+
+
+static int NullImportCapture(__attribute__ ((unused)) unsigned int count)
+{
+	return 0;
+}
+
+
+///
+/// The decoder frees the held buffers, forget them.
+///
+static void NullReleaseCapture(void)
+{
+	null.flip_pending = 0;
+	null.held = null.next = null.shown = -1;
+	SchedReset(&null.sched);
+}
+
+
+static int NullFd(void)
+{
+	return null.fd;
+}
+
+
+static int NullFlipPending(void)
+{
+	return null.flip_pending;
+}
+
+
+///
+/// vblank: the committed frame replaces the shown one, which goes back
+/// to the decoder.
+///
+static void NullHandleEvent(void)
+{
+	struct timespec now;
+	uint64_t expired;
+
+	if (read(null.fd, &expired, sizeof(expired)) != sizeof(expired))
+		return;
+	null.vblanks += expired;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	SchedVblank(&null.sched, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+
+	if (!null.flip_pending)
+		return;
+	null.flip_pending = 0;
+	if (null.next < 0)
+		return;
+	TraceEvent(TRACE_FLIP, null.next_tag);
+	LiveShown(V4l2TagPts(null.next_tag), 0);
+	if (null.shown >= 0)
+		QueueBufferCapture(null.shown);
+	null.shown = null.next;
+	null.next = -1;
+	null.frames++;
+}
+
+
+static int NullPresent(void)
+{
+	int index;
+
+	if (null.flip_pending)
+		return 0;
+
+	for (;;) {
+		if (null.held < 0) {
+			if ((index = DequeueIndexCapture()) < 0)
+				return index == -EAGAIN ? 0 : index;
+			null.held = index;
+			null.held_tag = V4l2CaptureTag();
+		}
+		if (!null.hz)
+			break;
+
+		switch (SchedFrame(&null.sched, V4l2TagPts(null.held_tag), 0)) {
+		case SCHED_SHOW:
+			break;
+		case SCHED_WAIT:
+			null.flip_pending = 1;
+			return 0;
+		case SCHED_DROP:
+			QueueBufferCapture(null.held);
+			null.held = -1;
+			continue;
+		}
+		break;
+	}
+
+	TraceEvent(TRACE_COMMIT, null.held_tag);
+	if (!null.hz) {
+		QueueBufferCapture(null.held);
+		null.held = -1;
+		null.frames++;
+		return 1;
+	}
+
+	null.next = null.held;
+	null.next_tag = null.held_tag;
+	null.held = -1;
+	null.flip_pending = 1;
+	return 1;
+}
+
+
+///
+/// Seek: the frames not on the simulated screen go back to the decoder.
+///
+static void NullFlush(unsigned int speed)
+{
+	if (null.held >= 0)
+		QueueBufferCapture(null.held);
+	if (null.next >= 0)
+		QueueBufferCapture(null.next);
+	null.held = null.next = -1;
+	SchedSetSpeed(&null.sched, speed);
+}
+
+
+const struct video_sink null_sink = {
+	.name = "null",
+	.init = NullInit,
+	.deinit = NullDeInit,
+	.capture_format = NullCaptureFormat,
+	.import_capture = NullImportCapture,
+	.release_capture = NullReleaseCapture,
+	.fd = NullFd,
+	.flip_pending = NullFlipPending,
+	.handle_event = NullHandleEvent,
+	.present = NullPresent,
+	.flush = NullFlush,
+};
+
+
+// file sink: raw frames in the capture layout or I420 in a y4m file
+
+static struct {
+	FILE *f;
+	int y4m;
+	int header;			///< y4m stream header written
+	uint32_t width, height;		///< size of the y4m stream
+	uint32_t pixelformat;		///< layout of buf[]
+	uint32_t cap_width, cap_height;
+	struct v4l2_rect visible;	///< part of the frames written
+	unsigned int planes;		///< color planes
+	uint32_t stride[3];
+	uint8_t *buf[3];
+	size_t size[3];
+	uint8_t *row;			///< deinterleaved chroma row
+	unsigned long frames;
+	unsigned long dropped;
+} file;
+
+
+///
+/// @param arg	output file, "-" is stdout. A .y4m suffix writes y4m.
+///
+static int FileInit(const char *arg)
+{
+	size_t len;
+
+	if (!arg || !*arg) {
+		fprintf(stderr, "FileInit: no file name\n");
+		return -1;
+	}
+
+	memset(&file, 0, sizeof(file));
+	len = strlen(arg);
+	file.y4m = len > 4 && !strcasecmp(arg + len - 4, ".y4m");
+
+	if (!strcmp(arg, "-"))
+		file.f = stdout;
+	else if (!(file.f = fopen(arg, "wb"))) {
+		fprintf(stderr, "FileInit: can't open %s: (%d): %m\n", arg, errno);
+		return -1;
+	}
+	return 0;
+}
+
+
+static void FileFree(void)
+{
+	unsigned int p;
+
+	for (p = 0; p < 3; p++) {
+		free(file.buf[p]);
+		file.buf[p] = NULL;
+	}
+	free(file.row);
+	file.row = NULL;
+	file.pixelformat = 0;
+}
+
+
+static void FileDeInit(void)
+{
+	fprintf(stderr, "FileDeInit: %lu frames written, %lu dropped\n",
+		file.frames, file.dropped);
+
+	if (file.f && file.f != stdout)
+		fclose(file.f);
+	else if (file.f)
+		fflush(file.f);
+	file.f = NULL;
+	FileFree();
+}
+
+
+///
+/// Only linear 4:2:0 formats, the frames are copied out of the decoder.
+///
+static int FileCaptureFormat(uint32_t pixelformat,
+					__attribute__ ((unused)) int zero_copy)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV12M:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_NV21M:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YUV420M:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+
+static int FileImportCapture(__attribute__ ((unused)) unsigned int count)
+{
+	return 0;
+}
+
+
+static void FileReleaseCapture(void)
+{
+	FileFree();
+}
+
+
+static int FileFd(void)
+{
+	return -1;
+}
+
+
+static int FileFlipPending(void)
+{
+	return 0;
+}
+
+
+static void FileHandleEvent(void)
+{
+}
+
+
+///
+/// Frames are written as they come, none wait.
+///
+static void FileFlush(__attribute__ ((unused)) unsigned int speed)
+{
+}
+
+
+///
+/// Size the copy buffers for the current capture format.
+///
+static int FileSetup(void)
+{
+	const struct v4l2_pix_format_mplane *pix = &dec->cap_fmt.fmt.pix_mp;
+	uint32_t height;
+	unsigned int p;
+
+	// the decoder crops the padding of the macroblocks
+	file.visible = dec->cap_rect;
+	if (!file.visible.width || !file.visible.height) {
+		file.visible.left = file.visible.top = 0;
+		file.visible.width = pix->width;
+		file.visible.height = pix->height;
+	}
+
+	if (file.pixelformat == pix->pixelformat && file.cap_width == pix->width
+			&& file.cap_height == pix->height)
+		return 0;
+
+	FileFree();
+	file.planes = (pix->pixelformat == V4L2_PIX_FMT_YUV420
+		|| pix->pixelformat == V4L2_PIX_FMT_YUV420M) ? 3 : 2;
+	for (p = 0; p < file.planes; p++) {
+		if (pix->num_planes >= file.planes)
+			file.stride[p] = pix->plane_fmt[p].bytesperline;
+		else if (p && file.planes == 3)
+			file.stride[p] = pix->plane_fmt[0].bytesperline / 2;
+		else
+			file.stride[p] = pix->plane_fmt[0].bytesperline;
+		height = p ? (pix->height + 1) / 2 : pix->height;
+		file.size[p] = (size_t)file.stride[p] * height;
+		if (!(file.buf[p] = malloc(file.size[p])))
+			goto fail;
+	}
+	if (!(file.row = malloc(pix->width)))
+		goto fail;
+
+	file.pixelformat = pix->pixelformat;
+	file.cap_width = pix->width;
+	file.cap_height = pix->height;
+	return 0;
+
+fail:
+	fprintf(stderr, "FileSetup: out of memory\n");
+	FileFree();
+	return -1;
+}
+
+
+static int FileWriteRows(const uint8_t *src, uint32_t stride, uint32_t width, uint32_t height)
+{
+	uint32_t y;
+
+	for (y = 0; y < height; y++)
+		if (fwrite(src + (size_t)y * stride, 1, width, file.f) != width)
+			return -1;
+	return 0;
+}
+
+
+///
+/// Write one chroma component of an interleaved plane.
+///
+static int FileWriteChroma(const uint8_t *src, uint32_t stride, uint32_t width,
+					uint32_t height, unsigned int component)
+{
+	uint32_t x, y;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++)
+			file.row[x] = src[(size_t)y * stride + 2 * x + component];
+		if (fwrite(file.row, 1, width, file.f) != width)
+			return -1;
+	}
+	return 0;
+}
+
+
+static int FileWriteFrame(void)
+{
+	const struct v4l2_rect *r = &file.visible;
+	uint32_t cw = (r->width + 1) / 2;
+	uint32_t ch = (r->height + 1) / 2;
+	int nv21 = file.pixelformat == V4L2_PIX_FMT_NV21
+		|| file.pixelformat == V4L2_PIX_FMT_NV21M;
+	const uint8_t *luma = file.buf[0] + (size_t)r->top * file.stride[0] + r->left;
+	const uint8_t *u, *v;
+
+	if (FileWriteRows(luma, file.stride[0], r->width, r->height))
+		return -1;
+
+	if (file.planes == 3) {
+		u = file.buf[1] + (size_t)(r->top / 2) * file.stride[1] + r->left / 2;
+		v = file.buf[2] + (size_t)(r->top / 2) * file.stride[2] + r->left / 2;
+		return FileWriteRows(u, file.stride[1], cw, ch)
+			|| FileWriteRows(v, file.stride[2], cw, ch) ? -1 : 0;
+	}
+
+	// interleaved: a pair of bytes per chroma sample
+	u = file.buf[1] + (size_t)(r->top / 2) * file.stride[1] + (r->left & ~1);
+
+	// raw keeps the interleaved chroma
+	if (!file.y4m)
+		return FileWriteRows(u, file.stride[1], 2 * cw, ch);
+
+	return FileWriteChroma(u, file.stride[1], cw, ch, nv21)
+		|| FileWriteChroma(u, file.stride[1], cw, ch, !nv21) ? -1 : 0;
+}
+
+
+static int FilePresent(void)
+{
+	AVRational rate;
+	int ret;
+
+	if (FileSetup())
+		return -ENOMEM;
+
+	if ((ret = DequeueBufferCapture(file.buf, file.size, file.planes)) < 0)
+		return ret == -EAGAIN ? 0 : ret;
+
+	if (file.y4m && !file.header) {
+		rate = StreamFrameRate();
+		if (!rate.num || !rate.den)
+			rate = (AVRational){ 25, 1 };
+		fprintf(file.f, "YUV4MPEG2 W%u H%u F%d:%d Ip A1:1 C420jpeg\n",
+			file.visible.width, file.visible.height, rate.num, rate.den);
+		file.width = file.visible.width;
+		file.height = file.visible.height;
+		file.header = 1;
+	}
+	// a y4m stream has one size
+	if (file.y4m && (file.width != file.visible.width || file.height != file.visible.height)) {
+		if (!file.dropped++)
+			fprintf(stderr, "FilePresent: %ux%u frames don't fit the %ux%u y4m stream, dropped\n",
+				file.visible.width, file.visible.height, file.width, file.height);
+		return 1;
+	}
+
+	if ((file.y4m && fputs("FRAME\n", file.f) < 0) || FileWriteFrame()) {
+		fprintf(stderr, "FilePresent: write failed: (%d): %m\n", errno);
+		return -EIO;
+	}
+	TraceEvent(TRACE_FLIP, V4l2CaptureTag());
+	LiveShown(V4l2TagPts(V4l2CaptureTag()), 0);
+	file.frames++;
+	return 1;
+}
+
+
+const struct video_sink file_sink = {
+	.name = "file",
+	.init = FileInit,
+	.deinit = FileDeInit,
+	.capture_format = FileCaptureFormat,
+	.import_capture = FileImportCapture,
+	.release_capture = FileReleaseCapture,
+	.fd = FileFd,
+	.flip_pending = FileFlipPending,
+	.handle_event = FileHandleEvent,
+	.present = FilePresent,
+	.flush = FileFlush,
+};
@@ -0,0 +1,4 @@
+
+extern const struct video_sink null_sink;
+
+extern const struct video_sink file_sink;
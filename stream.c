@@ -1,28 +1,437 @@
 #include <fcntl.h>
 #include <libintl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#if __has_include(<libavcodec/bsf.h>)
+#include <libavcodec/bsf.h>
+#endif
 
+#include "queue.h"
 #include "stream.h"
+#include "trace.h"
+
+#define RA_QUEUE_SIZE	4096	///< packets in the read-ahead cache
+
+
+///
+/// One input: demuxer, bitstream filter and read-ahead cache. The
+/// Stream functions work on the one StreamSelect() chose.
+///
+struct stream {
+	AVFormatContext *fmtctx;
+	int index;			///< the video stream
+	AVBSFContext *bsf;		///< MP4/MKV framing to Annex-B
+	int key_only;			///< fast-forward: keyframes only
+	int key_wait;			///< after a seek: drop packets up to a keyframe
+
+	// read-ahead cache
+	struct queue ra_queue;
+	pthread_t ra_thread;
+	pthread_mutex_t ra_mutex;
+	pthread_cond_t ra_cond;
+	int ra_running;
+	volatile sig_atomic_t ra_quit;
+	_Atomic int ra_eof;
+	size_t ra_max_bytes;
+	int64_t ra_max_duration;	///< AV_TIME_BASE units
+	_Atomic size_t ra_bytes;
+	_Atomic int64_t ra_duration;
+	// read-ahead statistics
+	unsigned long ra_reads;
+	unsigned long ra_underruns;
+	unsigned long long ra_fill_sum;	///< bytes cached at each read
+
+	// next input of the playlist, opened in the background
+	pthread_t next_thread;
+	int next_running;
+	char *next_url;
+	int next_ret;
+	AVFormatContext *next_fmtctx;
+	int next_index;
+	AVBSFContext *next_bsf;
+};
+
+static struct stream stream_default = {
+	.ra_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.ra_cond = PTHREAD_COND_INITIALIZER,
+};
+static struct stream *stream = &stream_default;
+
+static int live;			///< inputs are live feeds
+static int live_jitter_ms;		///< their jitter buffer
+
+
+static int64_t PacketDuration(struct stream *s, AVPacket *pkt)
+{
+	AVStream *st = s->fmtctx->streams[s->index];
+
+	if (pkt->duration > 0)
+		return av_rescale_q(pkt->duration, st->time_base, AV_TIME_BASE_Q);
+	if (st->avg_frame_rate.num && st->avg_frame_rate.den)
+		return av_rescale_q(1, (AVRational){ st->avg_frame_rate.den,
+			st->avg_frame_rate.num }, AV_TIME_BASE_Q);
+	return 0;
+}
+
+
+///
+/// Read the next packet of the video stream from the demuxer. The
+/// decoder restarts at a keyframe after a seek.
+///
+static int DemuxPacket(struct stream *s, AVPacket *pkt)
+{
+	for (;;) {
+		if (av_read_frame(s->fmtctx, pkt) < 0)
+			return -1;
+		if (s->index == pkt->stream_index
+				&& (pkt->flags & AV_PKT_FLAG_KEY || (!s->key_only && !s->key_wait))) {
+			s->key_wait = 0;
+			return 0;
+		}
+		av_packet_unref(pkt);
+	}
+}
+
+
+///
+/// Read the next video packet in the framing the decoder takes.
+///
+static int StreamRead(struct stream *s, AVPacket *pkt)
+{
+	int ret;
+
+	if (!s->bsf)
+		return DemuxPacket(s, pkt);
+
+	for (;;) {
+		ret = av_bsf_receive_packet(s->bsf, pkt);
+		if (!ret)
+			return 0;
+		if (ret != AVERROR(EAGAIN))
+			return -1;
+
+		// end of file flushes the filter
+		if (DemuxPacket(s, pkt)) {
+			av_bsf_send_packet(s->bsf, NULL);
+			continue;
+		}
+		if (av_bsf_send_packet(s->bsf, pkt) < 0) {
+			fprintf(stderr, "StreamRead: bitstream filter failed\n");
+			av_packet_unref(pkt);
+		}
+	}
+}
+
+
+static int ReadAheadFull(struct stream *s)
+{
+	return atomic_load(&s->ra_bytes) >= s->ra_max_bytes ||
+		atomic_load(&s->ra_duration) >= s->ra_max_duration ||
+		QueueDepth(&s->ra_queue) == s->ra_queue.size;
+}
+
+
+///
+/// Refill thread: keep the cache filled up to the byte and time budget.
+///
+static void *ReadAheadThread(void *arg)
+{
+	struct stream *s = arg;
+	AVPacket *pkt;
+
+	while (!s->ra_quit) {
+		pthread_mutex_lock(&s->ra_mutex);
+		while (ReadAheadFull(s) && !s->ra_quit)
+			pthread_cond_wait(&s->ra_cond, &s->ra_mutex);
+		pthread_mutex_unlock(&s->ra_mutex);
+		if (s->ra_quit)
+			break;
+
+		if (!(pkt = av_packet_alloc()))
+			break;
+		if (StreamRead(s, pkt)) {
+			av_packet_free(&pkt);
+			break;
+		}
+
+		atomic_fetch_add(&s->ra_bytes, pkt->size);
+		atomic_fetch_add(&s->ra_duration, PacketDuration(s, pkt));
+		QueuePush(&s->ra_queue, pkt);
+
+		pthread_mutex_lock(&s->ra_mutex);
+		pthread_cond_signal(&s->ra_cond);
+		pthread_mutex_unlock(&s->ra_mutex);
+	}
+
+	pthread_mutex_lock(&s->ra_mutex);
+	atomic_store(&s->ra_eof, 1);
+	pthread_cond_signal(&s->ra_cond);
+	pthread_mutex_unlock(&s->ra_mutex);
+
+	return NULL;
+}
+
+
+///
+/// A new input context, for several streams at once.
+///
+struct stream *StreamNew(void)
+{
+	struct stream *s;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return NULL;
+	pthread_mutex_init(&s->ra_mutex, NULL);
+	pthread_cond_init(&s->ra_cond, NULL);
+	return s;
+}
+
+
+void StreamDelete(struct stream *s)
+{
+	if (stream == s)
+		stream = &stream_default;
+	pthread_cond_destroy(&s->ra_cond);
+	pthread_mutex_destroy(&s->ra_mutex);
+	free(s);
+}
+
+
+///
+/// Make s the input the Stream functions and ReadPacket() work on, NULL
+/// the default one.
+///
+void StreamSelect(struct stream *s)
+{
+	stream = s ? s : &stream_default;
+}
+
+
+///
+/// Start prefetching video packets in the background.
+/// @param max_bytes	byte budget of the cache
+/// @param max_ms	time budget of the cache
+///
+int StreamReadAhead(size_t max_bytes, int max_ms)
+{
+	struct stream *s = stream;
+
+	if (!s->fmtctx || s->ra_running)
+		return -1;
+
+	if (QueueInit(&s->ra_queue, "read-ahead", RA_QUEUE_SIZE))
+		return -1;
+
+	s->ra_max_bytes = max_bytes;
+	s->ra_max_duration = (int64_t)max_ms * 1000;
+	atomic_store(&s->ra_bytes, 0);
+	atomic_store(&s->ra_duration, 0);
+	atomic_store(&s->ra_eof, 0);
+	s->ra_quit = 0;
+	s->ra_reads = s->ra_underruns = 0;
+	s->ra_fill_sum = 0;
+
+	if (pthread_create(&s->ra_thread, NULL, ReadAheadThread, s)) {
+		fprintf(stderr, "StreamReadAhead: cannot create thread\n");
+		QueueFree(&s->ra_queue);
+		return -1;
+	}
+	s->ra_running = 1;
+
+	fprintf(stderr, "StreamReadAhead: %zu KiB %i ms\n", max_bytes / 1024, max_ms);
+	return 0;
+}
+
+
+static void ReadAheadStop(struct stream *s)
+{
+	AVPacket *pkt;
+
+	if (!s->ra_running)
+		return;
+
+	pthread_mutex_lock(&s->ra_mutex);
+	s->ra_quit = 1;
+	pthread_cond_broadcast(&s->ra_cond);
+	pthread_mutex_unlock(&s->ra_mutex);
+	pthread_join(s->ra_thread, NULL);
+	s->ra_running = 0;
+
+	fprintf(stderr, "StreamReadAhead: %lu reads %lu underruns average fill %llu KiB\n",
+		s->ra_reads, s->ra_underruns, s->ra_reads ? s->ra_fill_sum / s->ra_reads / 1024 : 0);
 
+	while ((pkt = QueuePop(&s->ra_queue)))
+		av_packet_free(&pkt);
+	QueueFree(&s->ra_queue);
+}
+
+
+///
+/// Take the next packet out of the read-ahead cache.
+///
+static int ReadAheadPacket(struct stream *s, AVPacket *pkt)
+{
+	AVPacket *cached;
+
+	if (!(cached = QueuePop(&s->ra_queue))) {
+		if (atomic_load(&s->ra_eof))
+			goto eof;
+
+		// the decoder waits for the network or disk
+		s->ra_underruns++;
+		pthread_mutex_lock(&s->ra_mutex);
+		while (!(cached = QueuePop(&s->ra_queue)) && !atomic_load(&s->ra_eof))
+			pthread_cond_wait(&s->ra_cond, &s->ra_mutex);
+		pthread_mutex_unlock(&s->ra_mutex);
+		if (!cached)
+			goto eof;
+	}
 
-AVFormatContext *avfmtctx;
-int stream_index;
+	s->ra_reads++;
+	s->ra_fill_sum += atomic_load(&s->ra_bytes);
+
+	atomic_fetch_sub(&s->ra_bytes, cached->size);
+	atomic_fetch_sub(&s->ra_duration, PacketDuration(s, cached));
+	av_packet_move_ref(pkt, cached);
+	av_packet_free(&cached);
+
+	pthread_mutex_lock(&s->ra_mutex);
+	pthread_cond_signal(&s->ra_cond);
+	pthread_mutex_unlock(&s->ra_mutex);
+
+	return 0;
+
+eof:
+	// packets pushed just before the end
+	if ((cached = QueuePop(&s->ra_queue))) {
+		av_packet_move_ref(pkt, cached);
+		av_packet_free(&cached);
+		return 0;
+	}
+	return -1;
+}
+
+
+static void StreamCloseInput(struct stream *s)
+{
+	ReadAheadStop(s);
+
+	if (s->bsf)
+		av_bsf_free(&s->bsf);
+
+	if (s->fmtctx)
+		avformat_close_input(&s->fmtctx);
+}
+
+
+///
+/// Wait for the input opened by StreamPrefetch().
+/// @returns 0 or -1 if there is none or it can't be played.
+///
+static int PrefetchWait(struct stream *s)
+{
+	if (!s->next_running)
+		return -1;
+
+	pthread_join(s->next_thread, NULL);
+	s->next_running = 0;
+	return s->next_ret;
+}
 
 
 void StreamClose(void)
 {
-	if (avfmtctx)
-		avformat_close_input(&avfmtctx);
+	struct stream *s = stream;
+
+	if (!PrefetchWait(s)) {
+		if (s->next_bsf)
+			av_bsf_free(&s->next_bsf);
+		avformat_close_input(&s->next_fmtctx);
+	}
+
+	StreamCloseInput(s);
 }
 
 
-int StreamOpen(char *url)
+///
+/// Convert length prefixed H.264/HEVC (avcC/hvcC in MP4, MKV) to the
+/// Annex-B start codes of the V4L2 decoders and split VP9 superframes.
+///
+static int StreamSetupBsf(AVStream *st, AVBSFContext **bsf)
 {
+	AVCodecParameters *par = st->codecpar;
+	const AVBitStreamFilter *filter;
+	const char *name = NULL;
+
+	switch (par->codec_id) {
+	case AV_CODEC_ID_H264:
+		// Annex-B extradata starts with a start code
+		if (par->extradata_size && par->extradata[0] == 1)
+			name = "h264_mp4toannexb";
+		break;
+	case AV_CODEC_ID_HEVC:
+		if (par->extradata_size && par->extradata[0] == 1)
+			name = "hevc_mp4toannexb";
+		break;
+	case AV_CODEC_ID_VP9:
+		name = "vp9_superframe_split";
+		break;
+	default:
+		break;
+	}
+	if (!name)
+		return 0;
+
+	if (!(filter = av_bsf_get_by_name(name))) {
+		fprintf(stderr, "StreamSetupBsf: no %s filter\n", name);
+		return -1;
+	}
+	if (av_bsf_alloc(filter, bsf) < 0)
+		return -1;
+	if (avcodec_parameters_copy((*bsf)->par_in, par) < 0)
+		goto fail;
+	(*bsf)->time_base_in = st->time_base;
+	if (av_bsf_init(*bsf) < 0)
+		goto fail;
+
+	fprintf(stderr, "StreamSetupBsf: %s\n", name);
+	return 0;
+
+fail:
+	fprintf(stderr, "StreamSetupBsf: cannot setup %s\n", name);
+	av_bsf_free(bsf);
+	return -1;
+}
+
+
+///
+/// Open the inputs from then on as live feeds (UDP, RTP, SRT): probe a
+/// short start only, don't hold packets back in the demuxer and reorder
+/// or wait for late ones at most jitter_ms.
+///
+void StreamSetLive(int jitter_ms)
+{
+	live = 1;
+	live_jitter_ms = jitter_ms < 0 ? 0 : jitter_ms;
+}
+
+
+///
+/// Open url and find its video stream.
+///
+static int StreamOpenInput(const char *url, AVFormatContext **fmtctx, int *index,
+	AVBSFContext **filter)
+{
+	AVDictionary *opts = NULL;
+	unsigned int i;
 	int ret;
 
 //	av_log_set_level(get_av_log_level());
@@ -32,42 +441,271 @@ int StreamOpen(char *url)
 #endif
 	avformat_network_init();
 
-	ret = avformat_open_input(&avfmtctx, url, NULL, NULL);
+	if (live) {
+		av_dict_set(&opts, "probesize", "32768", 0);
+		av_dict_set(&opts, "analyzeduration", "200000", 0);
+		av_dict_set(&opts, "fflags", "nobuffer", 0);
+		// RTP reorder buffer
+		av_dict_set_int(&opts, "max_delay", live_jitter_ms * 1000LL, 0);
+		// UDP: a full receive FIFO drops, it doesn't stop the input
+		av_dict_set(&opts, "overrun_nonfatal", "1", 0);
+		// SRT receiver latency in us
+		if (live_jitter_ms)
+			av_dict_set_int(&opts, "latency", live_jitter_ms * 1000LL, 0);
+	}
+
+	ret = avformat_open_input(fmtctx, url, NULL, &opts);
+	av_dict_free(&opts);
 	if (ret < 0) {
 		fprintf(stderr, "failed to open %s\n", url);
-		goto fail;
+		return -1;
 	}
 
-	ret = avformat_find_stream_info(avfmtctx, NULL);
+	ret = avformat_find_stream_info(*fmtctx, NULL);
 	if (ret < 0) {
 		fprintf(stderr, "failed to get streams info\n");
 		goto fail;
 	}
 
-	av_dump_format(avfmtctx, -1, url, 0);
+	av_dump_format(*fmtctx, -1, url, 0);
 
-	ret = av_find_best_stream(avfmtctx, AVMEDIA_TYPE_VIDEO, -1, -1,
+	ret = av_find_best_stream(*fmtctx, AVMEDIA_TYPE_VIDEO, -1, -1,
 				  NULL, 0);
 	if (ret < 0) {
 		fprintf(stderr, "stream does not seem to contain video\n");
 		goto fail;
 	}
-	stream_index = ret;
+	*index = ret;
+
+	// let the demuxer skip everything else
+	for (i = 0; i < (*fmtctx)->nb_streams; i++) {
+		if ((int)i != *index)
+			(*fmtctx)->streams[i]->discard = AVDISCARD_ALL;
+	}
+
+	if (StreamSetupBsf((*fmtctx)->streams[*index], filter))
+		goto fail;
+
 	return 0;
 
 fail:
-	StreamClose();
+	avformat_close_input(fmtctx);
 	return -1;
 }
 
 
-int ReadPacket(AVPacket * pkt)
+int StreamOpen(char *url)
+{
+	struct stream *s = stream;
+
+	return StreamOpenInput(url, &s->fmtctx, &s->index, &s->bsf);
+}
+
+
+static void *PrefetchThread(void *arg)
+{
+	struct stream *s = arg;
+
+	s->next_ret = StreamOpenInput(s->next_url, &s->next_fmtctx, &s->next_index, &s->next_bsf);
+	return NULL;
+}
+
+
+///
+/// Open the next input of a playlist in the background, while the
+/// current one plays. StreamNext() switches to it.
+///
+int StreamPrefetch(char *url)
 {
-read:
-	if (av_read_frame(avfmtctx, pkt) < 0) {
+	struct stream *s = stream;
+
+	// an unused one is dropped
+	if (!PrefetchWait(s)) {
+		if (s->next_bsf)
+			av_bsf_free(&s->next_bsf);
+		avformat_close_input(&s->next_fmtctx);
+	}
+
+	s->next_url = url;
+	s->next_ret = -1;
+	if (pthread_create(&s->next_thread, NULL, PrefetchThread, s)) {
+		fprintf(stderr, "StreamPrefetch: cannot create thread\n");
 		return -1;
 	}
-	if (stream_index != pkt->stream_index)
-		goto read;
+	s->next_running = 1;
 	return 0;
 }
+
+
+///
+/// Close the current input and continue with the one from
+/// StreamPrefetch(), read ahead like the last one.
+/// @returns 0 or -1 if the next input can't be played, the current one
+/// stays open then.
+///
+int StreamNext(void)
+{
+	struct stream *s = stream;
+	int read_ahead = s->ra_running;
+
+	if (PrefetchWait(s)) {
+		fprintf(stderr, "StreamNext: skip %s\n", s->next_url ? s->next_url : "-");
+		return -1;
+	}
+
+	StreamCloseInput(s);
+	s->fmtctx = s->next_fmtctx;
+	s->index = s->next_index;
+	s->bsf = s->next_bsf;
+	s->next_fmtctx = NULL;
+	s->next_bsf = NULL;
+	s->key_only = s->key_wait = 0;
+
+	if (read_ahead)
+		StreamReadAhead(s->ra_max_bytes, s->ra_max_duration / 1000);
+
+	return 0;
+}
+
+
+///
+/// @returns the pid of the video stream if the input is MPEG-TS or -1.
+///
+int StreamTsPid(void)
+{
+	struct stream *s = stream;
+
+	if (!s->fmtctx || strcmp(s->fmtctx->iformat->name, "mpegts"))
+		return -1;
+
+	return s->fmtctx->streams[s->index]->id;
+}
+
+
+///
+/// @returns the us after which the PTS of the video stream wrap around,
+/// 0 if they don't.
+///
+int64_t StreamPtsWrap(void)
+{
+	struct stream *s = stream;
+	AVStream *st;
+
+	if (!s->fmtctx)
+		return 0;
+	st = s->fmtctx->streams[s->index];
+	if (st->pts_wrap_bits <= 0 || st->pts_wrap_bits >= 63)
+		return 0;
+
+	return av_rescale_q(1LL << st->pts_wrap_bits, st->time_base, AV_TIME_BASE_Q);
+}
+
+
+///
+/// @returns the codec parameters of the video stream.
+///
+AVCodecParameters *StreamCodecParameters(void)
+{
+	struct stream *s = stream;
+
+	if (!s->fmtctx)
+		return NULL;
+
+	return s->fmtctx->streams[s->index]->codecpar;
+}
+
+
+///
+/// @returns the frame rate of the video stream, 0/1 if unknown.
+///
+AVRational StreamFrameRate(void)
+{
+	struct stream *s = stream;
+
+	if (!s->fmtctx)
+		return (AVRational){ 0, 1 };
+
+	return av_guess_frame_rate(s->fmtctx, s->fmtctx->streams[s->index], NULL);
+}
+
+
+///
+/// @returns the first PTS of the input in us, 0 if unknown.
+///
+int64_t StreamStartTime(void)
+{
+	struct stream *s = stream;
+
+	if (!s->fmtctx || s->fmtctx->start_time == AV_NOPTS_VALUE)
+		return 0;
+
+	return s->fmtctx->start_time;
+}
+
+
+///
+/// Continue reading at the keyframe before pts. The read-ahead cache is
+/// dropped and refilled from there.
+/// @param pts		us, on the clock of V4l2TagPts()
+/// @param keyframes	read only keyframes from then on, for fast-forward
+/// @returns 0 or -1 if the input can't seek.
+///
+int StreamSeek(int64_t pts, int keyframes)
+{
+	struct stream *s = stream;
+	AVStream *st;
+	int read_ahead = s->ra_running;
+	int ret;
+
+	if (!s->fmtctx)
+		return -1;
+	st = s->fmtctx->streams[s->index];
+
+	ReadAheadStop(s);
+
+	ret = av_seek_frame(s->fmtctx, s->index, av_rescale_q(pts, AV_TIME_BASE_Q,
+		st->time_base), AVSEEK_FLAG_BACKWARD);
+	if (ret < 0)
+		fprintf(stderr, "StreamSeek: can't seek to %.3f s\n", pts / 1e6);
+	if (s->bsf)
+		av_bsf_flush(s->bsf);
+	s->key_wait = 1;
+	s->key_only = keyframes;
+	// demuxers that index the samples don't even read the others
+	st->discard = keyframes ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+
+	if (read_ahead)
+		StreamReadAhead(s->ra_max_bytes, s->ra_max_duration / 1000);
+
+	return ret < 0 ? -1 : 0;
+}
+
+
+///
+/// Time base of the packet timestamps.
+///
+AVRational StreamTimeBase(void)
+{
+	struct stream *s = stream;
+
+	if (!s->fmtctx)
+		return (AVRational){ 1, 1000000 };
+
+	return s->fmtctx->streams[s->index]->time_base;
+}
+
+
+int ReadPacket(AVPacket * pkt)
+{
+	struct stream *s = stream;
+	int ret;
+
+	if (s->ra_running)
+		ret = ReadAheadPacket(s, pkt);
+	else
+		ret = StreamRead(s, pkt);
+	if (!ret)
+		TraceEvent(TRACE_READ, pkt->pts);
+
+	return ret;
+}
@@ -1,6 +1,36 @@
 
+struct stream;
+
+struct stream *StreamNew(void);
+
+void StreamDelete(struct stream *s);
+
+void StreamSelect(struct stream *s);
+
 void StreamClose(void);
 
+void StreamSetLive(int jitter_ms);
+
 extern int StreamOpen(char *url);
 
+int StreamPrefetch(char *url);
+
+int StreamNext(void);
+
+int StreamReadAhead(size_t max_bytes, int max_ms);
+
+int StreamTsPid(void);
+
+AVCodecParameters *StreamCodecParameters(void);
+
+AVRational StreamFrameRate(void);
+
+AVRational StreamTimeBase(void);
+
+int64_t StreamStartTime(void);
+
+int64_t StreamPtsWrap(void);
+
+int StreamSeek(int64_t pts, int keyframes);
+
 int ReadPacket(AVPacket * pkt);
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct trace_rec {
+	uint64_t ns;			///< CLOCK_MONOTONIC
+	int64_t arg;
+	uint32_t point;
+	uint32_t tid;
+};
+
+static const char *const trace_names[TRACE_POINTS] = {
+	[TRACE_READ] = "read",
+	[TRACE_OUT_QBUF] = "out_qbuf",
+	[TRACE_OUT_DQBUF] = "out_dqbuf",
+	[TRACE_CAP_DQBUF] = "cap_dqbuf",
+	[TRACE_COMMIT] = "commit",
+	[TRACE_FLIP] = "flip",
+	[TRACE_SEEK] = "seek",
+	[TRACE_LATENCY] = "latency",
+};
+
+static struct trace_rec *trace_ring;	///< NULL while tracing is off
+static unsigned int trace_mask;
+static _Atomic unsigned long trace_head;
+static __thread uint32_t trace_tid;
+
+
+///
+/// Allocate the ring for the last size records. The memory is touched
+/// here, recording never faults or allocates.
+///
+int TraceInit(unsigned int size)
+{
+	unsigned int n = 1;
+
+	while (n < size)
+		n <<= 1;
+
+	if (!(trace_ring = malloc(n * sizeof(*trace_ring)))) {
+		fprintf(stderr, "TraceInit: out of memory\n");
+		return -1;
+	}
+	memset(trace_ring, 0, n * sizeof(*trace_ring));
+	trace_mask = n - 1;
+	atomic_init(&trace_head, 0);
+
+	return 0;
+}
+
+
+///
+/// Record a point with its own time, e.g. the vblank of a flip.
+/// Lock-free: every writer reserves its slot, the oldest are overwritten.
+///
+void TraceEventAt(enum trace_point point, uint64_t ns, int64_t arg)
+{
+	struct trace_rec *rec;
+
+	if (!trace_ring)
+		return;
+	if (!trace_tid)
+		trace_tid = syscall(SYS_gettid);
+
+	rec = &trace_ring[atomic_fetch_add_explicit(&trace_head, 1,
+		memory_order_relaxed) & trace_mask];
+	rec->ns = ns;
+	rec->arg = arg;
+	rec->point = point;
+	rec->tid = trace_tid;
+}
+
+
+void TraceEvent(enum trace_point point, int64_t arg)
+{
+	struct timespec ts;
+
+	if (!trace_ring)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	TraceEventAt(point, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, arg);
+}
+
+
+static FILE *TraceOpen(const char *prefix, const char *suffix)
+{
+	char name[4096];
+	FILE *f;
+
+	snprintf(name, sizeof(name), "%s%s", prefix, suffix);
+	if (!(f = fopen(name, "w")))
+		fprintf(stderr, "TraceDump: can't open %s: (%d): %m\n", name, errno);
+	return f;
+}
+
+
+///
+/// Write the recorded points as <prefix>.json (Chrome trace, open in
+/// chrome://tracing or Perfetto) and <prefix>.csv. Call after all
+/// threads stopped.
+///
+int TraceDump(const char *prefix)
+{
+	unsigned long head, count, i;
+	const struct trace_rec *rec;
+	uint64_t base;
+	FILE *json, *csv;
+
+	if (!trace_ring)
+		return 0;
+
+	head = atomic_load(&trace_head);
+	count = head > trace_mask + 1UL ? trace_mask + 1UL : head;
+	base = count ? trace_ring[(head - count) & trace_mask].ns : 0;
+
+	if (!(json = TraceOpen(prefix, ".json")))
+		return -1;
+	if (!(csv = TraceOpen(prefix, ".csv"))) {
+		fclose(json);
+		return -1;
+	}
+
+	fprintf(json, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(csv, "ns,point,tid,arg\n");
+	for (i = head - count; i != head; i++) {
+		rec = &trace_ring[i & trace_mask];
+		fprintf(json, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,"
+			"\"tid\":%" PRIu32 ",\"ts\":%.3f,\"args\":{\"arg\":%" PRId64 "}}",
+			i != head - count ? ",\n" : "", trace_names[rec->point], getpid(),
+			rec->tid, (int64_t)(rec->ns - base) / 1000.0, rec->arg);
+		fprintf(csv, "%" PRIu64 ",%s,%" PRIu32 ",%" PRId64 "\n",
+			rec->ns, trace_names[rec->point], rec->tid, rec->arg);
+	}
+	fprintf(json, "\n]}\n");
+
+	fclose(json);
+	fclose(csv);
+
+	fprintf(stderr, "TraceDump: %lu events to %s.json/.csv, %lu overwritten\n",
+		count, prefix, head - count);
+	return 0;
+}
+
+
+void TraceFree(void)
+{
+	free(trace_ring);
+	trace_ring = NULL;
+}
@@ -0,0 +1,25 @@
+
+///
+/// Points of a frame on its way from the file to the screen.
+///
+enum trace_point {
+	TRACE_READ,		///< ReadPacket() returned a packet, arg pts
+	TRACE_OUT_QBUF,		///< OUTPUT buffer queued, arg tag
+	TRACE_OUT_DQBUF,	///< OUTPUT buffer back from the decoder, arg tag
+	TRACE_CAP_DQBUF,	///< decoded frame dequeued, arg tag
+	TRACE_COMMIT,		///< frame committed to the display, arg tag
+	TRACE_FLIP,		///< frame on screen, arg tag
+	TRACE_SEEK,		///< seek or fast-forward started, arg target pts
+	TRACE_LATENCY,		///< live frame on screen, arg us since its wall-clock pts
+	TRACE_POINTS
+};
+
+int TraceInit(unsigned int size);
+
+void TraceEvent(enum trace_point point, int64_t arg);
+
+void TraceEventAt(enum trace_point point, uint64_t ns, int64_t arg);
+
+int TraceDump(const char *prefix);
+
+void TraceFree(void);
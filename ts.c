@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+
+#include "ts.h"
+
+#define TS_PACKET_SIZE	188
+#define TS_SYNC_BYTE	0x47
+#define TS_READ_SIZE	(TS_PACKET_SIZE * 512)	///< bytes per read()
+
+static int ts_fd = -1;
+static int ts_pid;
+static uint8_t ts_buf[TS_READ_SIZE];
+static size_t ts_pos;		///< next TS packet in ts_buf
+static size_t ts_len;		///< valid bytes in ts_buf
+static int ts_pes_started;	///< payload of the current PES is copied
+static size_t ts_resume;	///< payload offset in ts_pos to continue a split PES
+
+
+int TsOpen(const char *url, int pid)
+{
+	if (pid < 0)
+		return -1;
+
+	if ((ts_fd = open(url, O_RDONLY)) < 0) {
+		fprintf(stderr, "TsOpen: open %s failed: (%d): %m\n", url, errno);
+		return -1;
+	}
+	posix_fadvise(ts_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ts_pid = pid;
+	ts_pos = ts_len = 0;
+	ts_pes_started = 0;
+	ts_resume = 0;
+
+	fprintf(stderr, "TsOpen: %s video pid %i\n", url, pid);
+	return 0;
+}
+
+
+void TsClose(void)
+{
+	if (ts_fd >= 0)
+		close(ts_fd);
+	ts_fd = -1;
+}
+
+
+///
+/// Make a complete TS packet available at ts_buf + ts_pos.
+/// @returns the packet or NULL at end of file.
+///
+static uint8_t *TsNextPacket(void)
+{
+	ssize_t n;
+
+	for (;;) {
+		// resync
+		while (ts_pos < ts_len && ts_buf[ts_pos] != TS_SYNC_BYTE)
+			ts_pos++;
+
+		if (ts_len - ts_pos >= TS_PACKET_SIZE)
+			return ts_buf + ts_pos;
+
+		memmove(ts_buf, ts_buf + ts_pos, ts_len - ts_pos);
+		ts_len -= ts_pos;
+		ts_pos = 0;
+
+		n = read(ts_fd, ts_buf + ts_len, sizeof(ts_buf) - ts_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return NULL;
+		ts_len += n;
+	}
+}
+
+
+static int64_t TsParsePts(const uint8_t *p)
+{
+	return ((int64_t)(p[0] & 0x0e) << 29) | (p[1] << 22) |
+		((p[2] & 0xfe) << 14) | (p[3] << 7) | (p[4] >> 1);
+}
+
+
+///
+/// Read the next PES packet of the video pid and copy its payload
+/// directly to dst, e.g. a mmap'ed V4L2 OUTPUT buffer.
+/// @param dst	destination
+/// @param size	size of dst
+/// @param len	returns the payload size
+/// @param pts	returns the PTS in 90 kHz or AV_NOPTS_VALUE
+/// @returns 0, 1 if dst is full and the PES continues with the next
+/// call, or -1 at end of file.
+///
+int TsReadPes(uint8_t *dst, size_t size, size_t *len, int64_t *pts)
+{
+	uint8_t *p;
+	size_t off, n;
+	int pid, pusi;
+
+	*len = 0;
+	*pts = AV_NOPTS_VALUE;
+
+	while ((p = TsNextPacket())) {
+		// rest of the packet that did not fit the last time
+		if (ts_resume) {
+			off = ts_resume;
+			ts_resume = 0;
+			goto copy;
+		}
+
+		pid = ((p[1] & 0x1f) << 8) | p[2];
+		pusi = p[1] & 0x40;
+
+		// skip other pids, transport errors and packets without payload
+		if (pid != ts_pid || (p[1] & 0x80) || !(p[3] & 0x10)) {
+			ts_pos += TS_PACKET_SIZE;
+			continue;
+		}
+
+		off = 4;
+		if (p[3] & 0x20)
+			off += 1 + p[4];
+
+		if (pusi) {
+			// the next PES starts, this one is complete
+			if (ts_pes_started && *len) {
+				ts_pes_started = 0;
+				return 0;
+			}
+
+			// PES header
+			if (off + 9 > TS_PACKET_SIZE || p[off] || p[off + 1] || p[off + 2] != 1) {
+				ts_pos += TS_PACKET_SIZE;
+				continue;
+			}
+			if ((p[off + 7] & 0x80) && off + 14 <= TS_PACKET_SIZE)
+				*pts = TsParsePts(p + off + 9);
+			off += 9 + p[off + 8];
+			ts_pes_started = 1;
+		}
+
+copy:
+		if (ts_pes_started && off < TS_PACKET_SIZE) {
+			n = TS_PACKET_SIZE - off;
+			if (*len + n > size) {
+				n = size - *len;
+				memcpy(dst + *len, p + off, n);
+				*len += n;
+				ts_resume = off + n;
+				return 1;
+			}
+			memcpy(dst + *len, p + off, n);
+			*len += n;
+		}
+		ts_pos += TS_PACKET_SIZE;
+	}
+
+	// end of file
+	ts_pes_started = 0;
+	return *len ? 0 : -1;
+}
@@ -0,0 +1,6 @@
+
+int TsOpen(const char *url, int pid);
+
+void TsClose(void);
+
+int TsReadPes(uint8_t *dst, size_t size, size_t *len, int64_t *pts);
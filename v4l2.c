@@ -1,17 +1,61 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <poll.h>
+
 #include <linux/videodev2.h>
 
 #include <libavcodec/avcodec.h>
 
 #include "main.h"
+#include "backend.h"
+#include "detile.h"
 #include "stream.h"
+#include "trace.h"
+#include "ts.h"
 #include "v4l2.h"
+#include "video.h"
+
+#ifndef V4L2_PIX_FMT_HEVC
+#define V4L2_PIX_FMT_HEVC	v4l2_fourcc('H', 'E', 'V', 'C')
+#endif
+#ifndef V4L2_PIX_FMT_FWHT
+#define V4L2_PIX_FMT_FWHT	v4l2_fourcc('F', 'W', 'H', 'T')
+#endif
+#ifndef V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM
+#define V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM	0x0004
+#endif
+
+#define OUT_SIZE_MIN		(64 * 1024)
+#define OUT_SIZE_DEFAULT	(1024 * 1024)
+#define OUT_ALIGN(size)		(((size) + 4095) & ~(size_t)4095)
+
+
+/// V4L2 timestamps are PTS in us, shifted to stay positive
+#define PTS_OFFSET		(3600LL * 1000000)
+
+#define CAP_COUNT_DEFAULT	13	///< if the decoder doesn't tell its minimum
+
+static unsigned int cap_margin = 3;	///< capture buffers held by the display
+static int low_delay;			///< frames out without display delay
+
+static struct decoder dec_default;
+struct decoder *dec = &dec_default;
+
+
+///
+/// Make d the decoder instance the V4l2 functions work on, NULL the
+/// default one.
+///
+void V4l2Select(struct decoder *d)
+{
+	dec = d ? d : &dec_default;
+}
 
 
 void PrintCaps(int fd_v4l2)
@@ -19,7 +63,7 @@ void PrintCaps(int fd_v4l2)
 	struct v4l2_capability caps;
 	memset(&caps, 0, sizeof caps);
 
-	if (ioctl(fd_v4l2, VIDIOC_QUERYCAP, &caps) != 0)
+	if (V4l2Ioctl(fd_v4l2, VIDIOC_QUERYCAP, &caps) != 0)
 		fprintf(stderr, "VIDIOC_QUERYCAP failed: (%d): %m\n", errno);
 
 	fprintf(stderr, "driver: %s card: %s bus_info: %s\n",
@@ -79,7 +123,60 @@ void PrintCaps(int fd_v4l2)
 }
 
 
-void V4l2SetupOutput(void)
+///
+/// Estimate the OUTPUT buffer size from the stream: ten times the average
+/// frame for intra frames, but not more than half of the raw picture.
+///
+static size_t OutputSize(void)
+{
+	AVCodecParameters *par = StreamCodecParameters();
+	AVRational fps = StreamFrameRate();
+	size_t raw = 0;
+	size_t size = 0;
+
+	if (par && par->width > 0 && par->height > 0)
+		raw = (size_t)par->width * par->height * 3 / 2;
+	if (par && par->bit_rate > 0 && fps.num > 0 && fps.den > 0)
+		size = par->bit_rate / 8 * fps.den / fps.num * 10;
+
+	if (!size || (raw && size > raw / 2))
+		size = raw / 2;
+	if (!size)
+		size = OUT_SIZE_DEFAULT;
+	if (size < dec->out_max_packet)
+		size = dec->out_max_packet;
+	if (size < OUT_SIZE_MIN)
+		size = OUT_SIZE_MIN;
+
+	return OUT_ALIGN(size);
+}
+
+
+static void V4l2FreeOutput(void)
+{
+	struct v4l2_requestbuffers reqbuf_out;
+	unsigned int i;
+
+	for (i = 0; i < dec->out_count; i++) {
+		if (V4l2Munmap(dec->buffers_out[i].start, dec->buffers_out[i].length, dec->fd))
+			fprintf(stderr, "munmap_buffer: munmap_buffer output failed: (%d): %m\n", errno);
+	}
+
+	memset (&reqbuf_out, 0, sizeof (reqbuf_out));
+	reqbuf_out.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbuf_out.memory = V4L2_MEMORY_MMAP;
+	reqbuf_out.count = 0;
+	if (V4l2Ioctl(dec->fd, VIDIOC_REQBUFS, &reqbuf_out) < 0)
+		fprintf(stderr, "V4l2FreeOutput: VIDIOC_REQBUFS 0 failed: (%d): %m\n", errno);
+
+	dec->out_count = dec->out_nfree = 0;
+}
+
+
+///
+/// Set the OUTPUT format, allocate and map the buffers.
+///
+static int V4l2AllocOutput(size_t size, unsigned int count)
 {
 	// buffer out FORMAT OUT
 	struct v4l2_buffer buf;
@@ -88,15 +185,16 @@ void V4l2SetupOutput(void)
 
 	memset(&fmt, 0, sizeof fmt);
 	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+	fmt.fmt.pix_mp.pixelformat = dec->out_pixelformat;
 //	fmt.fmt.pix_mp.width = 1280;
 //	fmt.fmt.pix_mp.height = 720;
-	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = 524288; // Das muss nachgebessert werden!!!
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = size;
 
-	if (ioctl(fd_v4l2_dec, VIDIOC_S_FMT, &fmt) < 0)
+	if (V4l2Ioctl(dec->fd, VIDIOC_S_FMT, &fmt) < 0)
 		fprintf(stderr, "V4l2SetupOutput: Output VIDIOC_S_FMT failed: (%d): %m\n", errno);
 
-	printf("V4l2SetupOutput: FMT OUT: width %u height %u size %u 4cc = %.4s\n",
+	fprintf(stderr, "V4l2SetupOutput: FMT OUT: width %u height %u size %u 4cc = %.4s\n",
 		fmt.fmt.pix_mp.width, fmt.fmt.pix_mp.height, fmt.fmt.pix_mp.plane_fmt[0].sizeimage,
 		(char*)&fmt.fmt.pix_mp.pixelformat);
 
@@ -107,10 +205,14 @@ void V4l2SetupOutput(void)
 	memset (&reqbuf_out, 0, sizeof (reqbuf_out));
 	reqbuf_out.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	reqbuf_out.memory = V4L2_MEMORY_MMAP;
-	reqbuf_out.count = BUF_OUT;
+	reqbuf_out.count = count;
 
-	if (ioctl (fd_v4l2_dec, VIDIOC_REQBUFS, &reqbuf_out) < 0)
+	if (V4l2Ioctl(dec->fd, VIDIOC_REQBUFS, &reqbuf_out) < 0) {
 		fprintf(stderr, "V4l2SetupOutput: Output VIDIOC_REQBUFS OUT failed: (%d): %m\n", errno);
+		return -1;
+	}
+	if (reqbuf_out.count > BUF_OUT)
+		reqbuf_out.count = BUF_OUT;
 
 	// QUERYBUF & MAP OUT
 	for (i = 0; i < reqbuf_out.count; i++) {
@@ -123,78 +225,443 @@ void V4l2SetupOutput(void)
 		buf.m.planes = &plane;
 		buf.length = 1;
 
-		if (-1 == ioctl(fd_v4l2_dec, VIDIOC_QUERYBUF, &buf))
+		if (-1 == V4l2Ioctl(dec->fd, VIDIOC_QUERYBUF, &buf)) {
 			fprintf(stderr, "V4l2SetupOutput: Output VIDIOC_QUERYBUF OUT failed: count %i (%d): %m\n", i, errno);
+			goto fail;
+		}
 
-		buffers_out[i].length = buf.m.planes[0].length;
-		buffers_out[i].offset = buf.m.planes[0].m.mem_offset;
-		buffers_out[i].start = mmap(NULL, buf.m.planes[0].length,
-			PROT_READ | PROT_WRITE, MAP_SHARED, fd_v4l2_dec,
+		dec->buffers_out[i].length = buf.m.planes[0].length;
+		dec->buffers_out[i].offset = buf.m.planes[0].m.mem_offset;
+		dec->buffers_out[i].start = V4l2Mmap(buf.m.planes[0].length, dec->fd,
 			buf.m.planes[0].m.mem_offset);
 
-		if (buffers_out[i].start == MAP_FAILED)
+		if (dec->buffers_out[i].start == MAP_FAILED) {
 			fprintf(stderr, "V4l2SetupOutput: Output MAP_FAILED OUT failed: (%d): %m\n", errno);
+			goto fail;
+		}
+
+		// all buffers are free
+		dec->out_free[i] = reqbuf_out.count - 1 - i;
 	}
+	dec->out_count = reqbuf_out.count;
+	dec->out_nfree = dec->out_count;
+
+	fprintf(stderr, "V4l2SetupOutput: %u OUTPUT buffers of %zu KiB\n",
+		dec->out_count, dec->out_count ? dec->buffers_out[0].length / 1024 : 0);
+
+	return 0;
+
+fail:
+	// the buffers before i are mapped
+	dec->out_count = i;
+	V4l2FreeOutput();
+	return -1;
 }
 
 
-void V4l2SetupCapture(void)
+///
+/// Grow the OUTPUT buffers to dec->out_resize. All buffers must be dequeued.
+/// Like a seek the decoder restarts after STREAMON.
+///
+static int V4l2ResizeOutput(void)
+{
+	enum v4l2_buf_type type_out = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	unsigned int count = dec->out_count;
+	size_t size = dec->out_resize;
+
+	dec->out_resize = 0;
+	fprintf(stderr, "V4l2ResizeOutput: %zu KiB -> %zu KiB\n",
+		dec->buffers_out[0].length / 1024, size / 1024);
+
+	if (dec->out_streaming && V4l2Ioctl(dec->fd, VIDIOC_STREAMOFF, &type_out) < 0)
+		fprintf(stderr, "VIDIOC_STREAMOFF Output failed: (%d): %m\n", errno);
+	dec->out_streaming = 0;
+
+	V4l2FreeOutput();
+	if (V4l2AllocOutput(size, count))
+		return -1;
+
+	// the driver clamps sizeimage, don't ask again
+	if (dec->buffers_out[0].length < size) {
+		dec->out_size_limit = dec->buffers_out[0].length;
+		fprintf(stderr, "V4l2ResizeOutput: the decoder grants only %zu KiB\n",
+			dec->out_size_limit / 1024);
+	}
+	return 0;
+}
+
+
+///
+/// Map the codec of the stream to the V4L2 OUTPUT fourcc.
+///
+static uint32_t OutputFourcc(enum AVCodecID codec_id)
+{
+	switch (codec_id) {
+	case AV_CODEC_ID_H264:
+		return V4L2_PIX_FMT_H264;
+	case AV_CODEC_ID_HEVC:
+		return V4L2_PIX_FMT_HEVC;
+	case AV_CODEC_ID_VP8:
+		return V4L2_PIX_FMT_VP8;
+	case AV_CODEC_ID_VP9:
+		return V4L2_PIX_FMT_VP9;
+	case AV_CODEC_ID_MPEG2VIDEO:
+		return V4L2_PIX_FMT_MPEG2;
+	case AV_CODEC_ID_MPEG1VIDEO:
+		return V4L2_PIX_FMT_MPEG1;
+	case AV_CODEC_ID_MPEG4:
+		return V4L2_PIX_FMT_MPEG4;
+	case AV_CODEC_ID_VC1:
+		return V4L2_PIX_FMT_VC1_ANNEX_G;
+	case AV_CODEC_ID_H263:
+		return V4L2_PIX_FMT_H263;
+	case AV_CODEC_ID_FWHT:
+		return V4L2_PIX_FMT_FWHT;
+	default:
+		return 0;
+	}
+}
+
+
+///
+/// Check that the decoder takes pixelformat on the OUTPUT queue and
+/// find out if it takes frames split over several buffers.
+/// @returns 0 or -1 if the format is not supported.
+///
+static int OutputFormat(uint32_t pixelformat)
 {
-	// buffer in FORMAT Capture
-	struct v4l2_format fmt;
 	struct v4l2_fmtdesc fdesc;
+
+	memset(&fdesc, 0, sizeof(fdesc));
+	fdesc.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	for (fdesc.index = 0; !V4l2Ioctl(dec->fd, VIDIOC_ENUM_FMT, &fdesc); fdesc.index++) {
+		if (fdesc.pixelformat == pixelformat) {
+			dec->out_continuous = !!(fdesc.flags & V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+///
+/// @returns us of a frame of the stream.
+///
+static int64_t FrameDuration(void)
+{
+	AVRational rate = StreamFrameRate();
+
+	return rate.num > 0 ? 1000000LL * rate.den / rate.num : 40000;
+}
+
+
+///
+/// Let the decoder return each frame as soon as it is decoded instead of
+/// holding it back for reordering. Streams with B-frames come out in
+/// decode order then, live encoders don't use them.
+///
+static void DisplayDelay(void)
+{
+	static const uint32_t ids[][2] = {
+#ifdef V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY
+		{ V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY,
+			V4L2_CID_MPEG_VIDEO_DEC_DISPLAY_DELAY_ENABLE },
+#endif
+		// Exynos MFC, before the generic controls
+		{ V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY,
+			V4L2_CID_MPEG_MFC51_VIDEO_DECODER_H264_DISPLAY_DELAY_ENABLE },
+	};
+	struct v4l2_control ctrl;
 	unsigned int i;
 
+	for (i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+		memset(&ctrl, 0, sizeof(ctrl));
+		ctrl.id = ids[i][0];
+		if (V4l2Ioctl(dec->fd, VIDIOC_S_CTRL, &ctrl))
+			continue;
+		ctrl.id = ids[i][1];
+		ctrl.value = 1;
+		if (V4l2Ioctl(dec->fd, VIDIOC_S_CTRL, &ctrl))
+			continue;
+		fprintf(stderr, "DisplayDelay: frames out without display delay\n");
+		return;
+	}
+	fprintf(stderr, "DisplayDelay: the decoder can't: (%d): %m\n", errno);
+}
+
+
+///
+/// Setup the OUTPUT queue for the codec of the stream with buffers
+/// sized for it.
+/// @param count	number of OUTPUT buffers
+/// @returns 0 or -1 if the decoder can't decode the stream.
+///
+int V4l2SetupOutput(unsigned int count)
+{
+	AVCodecParameters *par = StreamCodecParameters();
+
+	if (count < 1)
+		count = 1;
+	if (count > BUF_OUT)
+		count = BUF_OUT;
+
+	dec->out_streaming = 0;
+	dec->out_resize = 0;
+	dec->out_continuous = 0;
+	dec->out_max_packet = 0;
+	dec->out_size_limit = 0;
+	dec->out_tag = PTS_OFFSET;
+	dec->out_duration = FrameDuration();
+	dec->out_pes_split = 0;
+	dec->out_pes_len = 0;
+
+	dec->out_pixelformat = OutputFourcc(par ? par->codec_id : AV_CODEC_ID_H264);
+	if (!dec->out_pixelformat) {
+		fprintf(stderr, "V4l2SetupOutput: codec %s has no V4L2 format\n",
+			avcodec_get_name(par->codec_id));
+		return -1;
+	}
+	if (OutputFormat(dec->out_pixelformat)) {
+		fprintf(stderr, "V4l2SetupOutput: decoder doesn't support %.4s\n",
+			(char*)&dec->out_pixelformat);
+		return -1;
+	}
+
+	if (low_delay)
+		DisplayDelay();
+
+	if (V4l2AllocOutput(OutputSize(), count))
+		return -1;
+
+	// resolution changes reallocate only the capture queue
+	struct v4l2_event_subscription sub;
+
+	memset(&sub, 0, sizeof(sub));
+	sub.type = V4L2_EVENT_SOURCE_CHANGE;
+	dec->cap_events = !V4l2Ioctl(dec->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
+	if (!dec->cap_events)
+		fprintf(stderr, "V4l2SetupOutput: no source change events: (%d): %m\n", errno);
+
+	return 0;
+}
+
+
+///
+/// Number of capture buffers above the decoder's minimum, e.g. for the
+/// frame on screen and the one waiting for the page flip.
+///
+void V4l2SetCaptureMargin(unsigned int margin)
+{
+	cap_margin = margin;
+}
+
+
+///
+/// Set up the decoders from then on for live inputs: no display delay.
+///
+void V4l2SetLowDelay(int enable)
+{
+	low_delay = enable;
+}
+
+
+///
+/// Dequeue pending decoder events.
+/// A source change after the capture queue is set up is acted on when
+/// the decoder returned the last buffer of the old format.
+///
+void V4l2HandleEvent(void)
+{
+	struct v4l2_event ev;
+
+	while (dec->cap_events) {
+		memset(&ev, 0, sizeof(ev));
+		if (V4l2Ioctl(dec->fd, VIDIOC_DQEVENT, &ev) < 0) {
+			if (errno != ENOENT && errno != EAGAIN)
+				fprintf(stderr, "VIDIOC_DQEVENT failed: (%d): %m\n", errno);
+			return;
+		}
+		if (ev.type != V4L2_EVENT_SOURCE_CHANGE ||
+			!(ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION))
+			continue;
+
+		// the first one only tells that the header is parsed
+		fprintf(stderr, "V4l2HandleEvent: source change%s\n",
+			dec->cap_count ? "" : " (header parsed)");
+		if (dec->cap_count)
+			dec->cap_source_change = 1;
+	}
+}
+
+
+///
+/// @returns 1 if the capture queue must be released and set up again
+/// after a source change.
+///
+int V4l2CaptureChanged(void)
+{
+	return dec->cap_changed;
+}
+
+
+///
+/// @returns the first capture format of the decoder the display can
+/// show, 0 if there is none.
+///
+static uint32_t CaptureFormat(int zero_copy)
+{
+	struct v4l2_fmtdesc fdesc;
+
+	memset(&fdesc, 0, sizeof(fdesc));
 	fdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	fdesc.index = 0;
-	if (ioctl(fd_v4l2_dec, VIDIOC_ENUM_FMT, &fdesc))
-		fprintf(stderr, "VIDIOC_ENUM_FMT Capture failed: (%d): %m\n", errno);
+	for (fdesc.index = 0; !V4l2Ioctl(dec->fd, VIDIOC_ENUM_FMT, &fdesc); fdesc.index++) {
+		fprintf(stderr, "CaptureFormat: %.4s %s\n", (char*)&fdesc.pixelformat,
+			fdesc.description);
+		if (VideoCaptureFormat(fdesc.pixelformat, zero_copy))
+			return fdesc.pixelformat;
+	}
+	return 0;
+}
+
+
+///
+/// Number of color planes in the formats the display takes.
+///
+static unsigned int ColorPlanes(uint32_t pixelformat)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YUV420M:
+		return 3;
+	default:
+		return 2;
+	}
+}
+
+
+static void UnmapCapture(void)
+{
+	unsigned int i, p;
+
+	for (i = 0; i < dec->cap_count; i++) {
+		for (p = 0; p < dec->cap_fmt.fmt.pix_mp.num_planes; p++) {
+			if (V4l2Munmap(dec->buffers_cap[i][p].start, dec->buffers_cap[i][p].length,
+					dec->fd))
+				fprintf(stderr, "munmap_buffer: munmap_buffer capture failed: (%d): %m\n", errno);
+		}
+	}
+}
+
+
+///
+/// Read the visible part of the decoded frames, the compose rectangle.
+/// Decoders without the selection API show all of the buffer.
+///
+static void CaptureRect(const struct v4l2_format *fmt)
+{
+	struct v4l2_selection sel;
+
+	memset(&sel, 0, sizeof(sel));
+	// the selection API takes the single-planar buffer types
+	sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	sel.target = V4L2_SEL_TGT_COMPOSE;
+	if (V4l2Ioctl(dec->fd, VIDIOC_G_SELECTION, &sel) || !sel.r.width || !sel.r.height
+			|| sel.r.left < 0 || sel.r.top < 0
+			|| sel.r.left + sel.r.width > fmt->fmt.pix_mp.width
+			|| sel.r.top + sel.r.height > fmt->fmt.pix_mp.height) {
+		sel.r.left = sel.r.top = 0;
+		sel.r.width = fmt->fmt.pix_mp.width;
+		sel.r.height = fmt->fmt.pix_mp.height;
+	}
+	dec->cap_rect = sel.r;
+	fprintf(stderr, "CaptureRect: %ux%u at %i,%i of %ux%u\n", sel.r.width, sel.r.height,
+		sel.r.left, sel.r.top, fmt->fmt.pix_mp.width, fmt->fmt.pix_mp.height);
+}
+
+
+///
+/// Allocate, map and queue the capture buffers and start streaming.
+/// @returns -1 while the decoder has not parsed the stream header yet
+/// or if the buffers can't be set up.
+///
+int V4l2SetupCapture(int zero_copy)
+{
+	// buffer in FORMAT Capture
+	struct v4l2_format fmt;
+	uint32_t pixelformat;
+	unsigned int i, p;
 
 	memset(&fmt, 0, sizeof(fmt));
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	fmt.fmt.pix_mp.pixelformat = fdesc.pixelformat;
 
-	if (ioctl(fd_v4l2_dec, VIDIOC_G_FMT, &fmt))
-		fprintf(stderr, "VIDIOC_G_FMT Capture failed: (%d): %m\n", errno);
-
-//	fmt.fmt.pix_mp.width = 1280;
-//	fmt.fmt.pix_mp.height = 720;
-//	if (ioctl(fd_v4l2_dec, VIDIOC_S_FMT, &fmt))
-//		fprintf(stderr, "VIDIOC_S_FMT Capture failed: (%d): %m\n", errno);
+	if (V4l2Ioctl(dec->fd, VIDIOC_G_FMT, &fmt)) {
+		// EACCES: no header parsed yet
+		if (errno != EACCES && errno != EAGAIN)
+			fprintf(stderr, "VIDIOC_G_FMT Capture failed: (%d): %m\n", errno);
+		return -1;
+	}
+	if (!fmt.fmt.pix_mp.width || !fmt.fmt.pix_mp.height)
+		return -1;
+	// the display sizes its buffers for it
+	CaptureRect(&fmt);
+
+	// the native layout of the decoder, if the video plane can show it
+	pixelformat = CaptureFormat(zero_copy);
+	if (pixelformat && pixelformat != fmt.fmt.pix_mp.pixelformat) {
+		fmt.fmt.pix_mp.pixelformat = pixelformat;
+		if (V4l2Ioctl(dec->fd, VIDIOC_S_FMT, &fmt)) {
+			fprintf(stderr, "VIDIOC_S_FMT Capture %.4s failed: (%d): %m\n",
+				(char*)&pixelformat, errno);
+			V4l2Ioctl(dec->fd, VIDIOC_G_FMT, &fmt);
+		}
+	}
+	if (!pixelformat)
+		fprintf(stderr, "V4l2SetupCapture: no capture format the video plane can show\n");
 
 	// read video stream properties
-/*	struct v4l2_control control = { 0, };
+	struct v4l2_control control = { 0, };
+	unsigned int count = CAP_COUNT_DEFAULT;
 	control.id = V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
-	if (ioctl(fd_v4l2_dec, VIDIOC_G_CTRL, &control)) {
+	if (V4l2Ioctl(dec->fd, VIDIOC_G_CTRL, &control)) {
 		fprintf(stderr, "Get a minimum buffers failed: (%d): %m\n", errno);
 	} else {
-		fprintf(stderr, "Get a minimum of %d buffers\n", control.value);
-	}*/
+		count = control.value + cap_margin;
+		fprintf(stderr, "Get a minimum of %d buffers, use %u\n", control.value, count);
+	}
+	if (count > BUF_CAP)
+		count = BUF_CAP;
 
-	fprintf(stderr, "FMT CAPTURE: width %u height %u 4cc %.4s num_planes %d\n"
-		"v4l2 plane 0 sizeimage %d bytesperline %d\n"
-		"v4l2 plane 1 sizeimage %d bytesperline %d\n",
-		fmt.fmt.pix_mp.width, fmt.fmt.pix_mp.height,
-		(char*)&fmt.fmt.pix_mp.pixelformat, fmt.fmt.pix_mp.num_planes,
-		fmt.fmt.pix_mp.plane_fmt[0].sizeimage, fmt.fmt.pix_mp.plane_fmt[0].bytesperline,
-		fmt.fmt.pix_mp.plane_fmt[1].sizeimage, fmt.fmt.pix_mp.plane_fmt[1].bytesperline);
+	if (fmt.fmt.pix_mp.num_planes > VIDEO_MAX_PLANES)
+		fmt.fmt.pix_mp.num_planes = VIDEO_MAX_PLANES;
 
-// VIDIOC_G_SELECTION
+	fprintf(stderr, "FMT CAPTURE: width %u height %u 4cc %.4s num_planes %d\n",
+		fmt.fmt.pix_mp.width, fmt.fmt.pix_mp.height,
+		(char*)&fmt.fmt.pix_mp.pixelformat, fmt.fmt.pix_mp.num_planes);
+	for (p = 0; p < fmt.fmt.pix_mp.num_planes; p++)
+		fprintf(stderr, "v4l2 plane %u sizeimage %d bytesperline %d\n", p,
+			fmt.fmt.pix_mp.plane_fmt[p].sizeimage, fmt.fmt.pix_mp.plane_fmt[p].bytesperline);
 
 	// REQBUFS Capture
 	struct v4l2_requestbuffers reqbuf_cap;
 	memset (&reqbuf_cap, 0, sizeof(reqbuf_cap));
 	reqbuf_cap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	reqbuf_cap.memory = V4L2_MEMORY_MMAP;
-	reqbuf_cap.count = BUF_CAP;
+	reqbuf_cap.count = count;
 
-	if (ioctl (fd_v4l2_dec, VIDIOC_REQBUFS, &reqbuf_cap))
+	if (V4l2Ioctl(dec->fd, VIDIOC_REQBUFS, &reqbuf_cap)) {
 		fprintf(stderr, "VIDIOC_REQBUFS Capture failed: (%d): %m\n", errno);
+		return -1;
+	}
+	if (reqbuf_cap.count > BUF_CAP)
+		reqbuf_cap.count = BUF_CAP;
+
+	dec->cap_fmt = fmt;
+	dec->cap_count = reqbuf_cap.count;
 
 	// QUERYBUF & MAP Capture
 	for (i = 0; i < reqbuf_cap.count; i++) {
 		struct v4l2_buffer buf;
-		struct v4l2_plane planes[2] = { {0} };
+		struct v4l2_plane planes[VIDEO_MAX_PLANES];
 		memset(&buf, 0, sizeof(buf));
 		memset(planes, 0, sizeof(planes));
 
@@ -204,44 +671,185 @@ void V4l2SetupCapture(void)
 		buf.m.planes = planes;
 		buf.length = fmt.fmt.pix_mp.num_planes;
 
-		if ((ioctl(fd_v4l2_dec, VIDIOC_QUERYBUF, &buf)) < 0) {
+		if ((V4l2Ioctl(dec->fd, VIDIOC_QUERYBUF, &buf)) < 0) {
 			fprintf(stderr, "VIDIOC_QUERYBUF Capture failed: (%d): %m\n", errno);
 			fprintf(stderr, "num_planes %d index %i\n",
 				fmt.fmt.pix_mp.num_planes, buf.index);
-			return;
+			goto fail;
 		}
 
-		buffers_cap[i].length = buf.m.planes[0].length;
-		buffers_cap[i].offset = buf.m.planes[0].m.mem_offset;
-		buffers_cap[i].start = mmap(NULL, buf.m.planes[0].length,
-			PROT_READ | PROT_WRITE, MAP_SHARED, fd_v4l2_dec,
-			buf.m.planes[0].m.mem_offset);
+		// every memory plane has its own offset
+		for (p = 0; p < fmt.fmt.pix_mp.num_planes; p++) {
+			dec->buffers_cap[i][p].length = buf.m.planes[p].length;
+			dec->buffers_cap[i][p].offset = buf.m.planes[p].m.mem_offset;
+			dec->buffers_cap[i][p].data_offset = buf.m.planes[p].data_offset;
+			dec->buffers_cap[i][p].start = V4l2Mmap(buf.m.planes[p].length, dec->fd,
+				buf.m.planes[p].m.mem_offset);
 
-		if (buffers_cap[i].start == MAP_FAILED)
-			fprintf(stderr, "MAP_FAILED Capture failed: (%d): %m\n", errno);
+			if (dec->buffers_cap[i][p].start == MAP_FAILED)
+				fprintf(stderr, "MAP_FAILED Capture failed: plane %u (%d): %m\n", p, errno);
+		}
 
 		// Queue buffer CAPTURE
-		if (ioctl(fd_v4l2_dec, VIDIOC_QBUF, &buf) < 0)
+		if (V4l2Ioctl(dec->fd, VIDIOC_QBUF, &buf) < 0)
 			fprintf(stderr, "VIDIOC_QBUF Capture failed: (%d): %m\n", errno);
+		else
+			dec->cap_queued[i] = 1;
 	}
 	// STREAMON Capture hier ???
 	enum v4l2_buf_type type_cap = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	if (ioctl(fd_v4l2_dec, VIDIOC_STREAMON, &type_cap)< 0)
+	if (V4l2Ioctl(dec->fd, VIDIOC_STREAMON, &type_cap)< 0)
 		fprintf(stderr, "VIDIOC_STREAMON Capture failed: (%d): %m\n", errno);
 	else fprintf(stderr, "VIDIOC_STREAMON Capture\n");
+
+	dec->cap_source_change = 0;
+	dec->cap_changed = 0;
+	dec->cap_last = 0;
+
+	return 0;
+
+fail:
+	// the buffers before i are mapped
+	dec->cap_count = i;
+	UnmapCapture();
+	memset(dec->cap_queued, 0, sizeof(dec->cap_queued));
+	dec->cap_count = 0;
+	reqbuf_cap.count = 0;
+	if (V4l2Ioctl(dec->fd, VIDIOC_REQBUFS, &reqbuf_cap) < 0)
+		fprintf(stderr, "V4l2SetupCapture: VIDIOC_REQBUFS 0 failed: (%d): %m\n", errno);
+	return -1;
 }
 
 
-void StreamOff(void)
+///
+/// Stop and free the capture queue. The OUTPUT queue keeps streaming,
+/// the decoder continues after V4l2SetupCapture().
+///
+void V4l2ReleaseCapture(void)
+{
+	enum v4l2_buf_type type_cap = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	struct v4l2_requestbuffers reqbuf_cap;
+
+	if (V4l2Ioctl(dec->fd, VIDIOC_STREAMOFF, &type_cap) < 0)
+		fprintf(stderr, "VIDIOC_STREAMOFF Capture failed: (%d): %m\n", errno);
+
+	UnmapCapture();
+	memset(dec->cap_queued, 0, sizeof(dec->cap_queued));
+
+	memset(&reqbuf_cap, 0, sizeof(reqbuf_cap));
+	reqbuf_cap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbuf_cap.memory = V4L2_MEMORY_MMAP;
+	reqbuf_cap.count = 0;
+	if (V4l2Ioctl(dec->fd, VIDIOC_REQBUFS, &reqbuf_cap) < 0)
+		fprintf(stderr, "V4l2ReleaseCapture: VIDIOC_REQBUFS 0 failed: (%d): %m\n", errno);
+
+	dec->cap_count = 0;
+}
+
+
+///
+/// Ask the decoder to finish all queued OUTPUT buffers. The last capture
+/// buffer then carries V4L2_BUF_FLAG_LAST.
+/// @returns 0 when the drain started, 1 if it must be tried again.
+///
+int V4l2Drain(void)
+{
+	struct v4l2_decoder_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = V4L2_DEC_CMD_STOP;
+
+	if (V4l2Ioctl(dec->fd, VIDIOC_DECODER_CMD, &cmd) == 0)
+		return 0;
+
+	// older drivers: an empty buffer flagged as last
+	return QueuePacketOut(NULL, V4L2_BUF_FLAG_LAST) > 0;
+}
+
+
+///
+/// Drop everything in the decoder, for a seek. The OUTPUT queue starts
+/// again with the next buffer, which must begin at a keyframe. Frames
+/// decoded but not dequeued are discarded. The capture buffers stay
+/// allocated, the ones the display holds come back as usual with
+/// QueueBufferCapture().
+///
+void V4l2Flush(void)
 {
-	QueuePacketOut(NULL, V4L2_BUF_FLAG_LAST);
+	enum v4l2_buf_type type_out = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	enum v4l2_buf_type type_cap = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	char queued[VIDEO_MAX_FRAME];
+	unsigned int i;
 
+	if (dec->out_streaming && V4l2Ioctl(dec->fd, VIDIOC_STREAMOFF, &type_out) < 0)
+		fprintf(stderr, "V4l2Flush: VIDIOC_STREAMOFF Output failed: (%d): %m\n", errno);
+	dec->out_streaming = 0;
+	for (i = 0; i < dec->out_count; i++)
+		dec->out_free[i] = dec->out_count - 1 - i;
+	dec->out_nfree = dec->out_count;
+	dec->out_pes_split = 0;
+	dec->out_pes_len = 0;
+	dec->cap_last = 0;
+
+	// a pending resolution change is handled with the new data
+	if (!dec->cap_count || dec->cap_changed)
+		return;
+
+	if (V4l2Ioctl(dec->fd, VIDIOC_STREAMOFF, &type_cap) < 0)
+		fprintf(stderr, "V4l2Flush: VIDIOC_STREAMOFF Capture failed: (%d): %m\n", errno);
+	if (V4l2Ioctl(dec->fd, VIDIOC_STREAMON, &type_cap) < 0)
+		fprintf(stderr, "V4l2Flush: VIDIOC_STREAMON Capture failed: (%d): %m\n", errno);
+
+	memcpy(queued, dec->cap_queued, sizeof(queued));
+	memset(dec->cap_queued, 0, sizeof(dec->cap_queued));
+	for (i = 0; i < dec->cap_count; i++) {
+		if (queued[i])
+			QueueBufferCapture(i);
+	}
+}
+
+
+///
+/// Continue with the next stream after the drain of the last one ended
+/// with -EPIPE. The queues and buffers are kept, a new resolution comes
+/// as source change like within a stream.
+/// @returns 0 or -1 if the codec differs, then the OUTPUT queue must be
+/// set up again.
+///
+int V4l2Resume(void)
+{
+	AVCodecParameters *par = StreamCodecParameters();
+	struct v4l2_decoder_cmd cmd;
+
+	if (!par || OutputFourcc(par->codec_id) != dec->out_pixelformat)
+		return -1;
+
+	dec->out_tag = PTS_OFFSET;
+	dec->out_duration = FrameDuration();
+	dec->out_pes_split = 0;
+	dec->out_pes_len = 0;
+	dec->cap_last = 0;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = V4L2_DEC_CMD_START;
+	if (V4l2Ioctl(dec->fd, VIDIOC_DECODER_CMD, &cmd) < 0) {
+		// drained with an empty buffer: restart the queues
+		fprintf(stderr, "V4l2Resume: V4L2_DEC_CMD_START failed: (%d): %m\n", errno);
+		V4l2Flush();
+	}
+
+	return 0;
+}
+
+
+void StreamOff(void)
+{
 	enum v4l2_buf_type type_out = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	if (ioctl(fd_v4l2_dec, VIDIOC_STREAMOFF, &type_out)< 0)
+	if (V4l2Ioctl(dec->fd, VIDIOC_STREAMOFF, &type_out)< 0)
 		fprintf(stderr, "VIDIOC_STREAMOFF Output failed: (%d): %m\n", errno);
 
 	enum v4l2_buf_type type_cap = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	if (ioctl(fd_v4l2_dec, VIDIOC_STREAMOFF, &type_cap)< 0)
+	if (V4l2Ioctl(dec->fd, VIDIOC_STREAMOFF, &type_cap)< 0)
 		fprintf(stderr, "VIDIOC_STREAMOFF Capture failed: (%d): %m\n", errno);
 }
 
@@ -260,29 +868,90 @@ int DequeuePacketOut(void)
 	buf.length = 1;
 	buf.m.planes = planes;
 
-	if (ioctl(fd_v4l2_dec, VIDIOC_DQBUF, &buf) < 0) {
-		fprintf(stderr, "VIDIOC_DQBUF OUTPUT failed: (%d): %m\n", errno);
+	if (V4l2Ioctl(dec->fd, VIDIOC_DQBUF, &buf) < 0) {
+		if (errno != EAGAIN)
+			fprintf(stderr, "VIDIOC_DQBUF OUTPUT failed: (%d): %m\n", errno);
 		return 1;
 	} else {
+		TraceEvent(TRACE_OUT_DQBUF, (int64_t)buf.timestamp.tv_sec * 1000000
+			+ buf.timestamp.tv_usec);
+		dec->out_free[dec->out_nfree++] = buf.index;
 		return 0;
 	}
 }
 
 
-void QueuePacketOut(AVPacket *pkt, uint32_t flags)
+///
+/// Get the memory of the next free OUTPUT buffer, to fill it in place.
+/// @returns 0, 1 while all OUTPUT buffers are busy or -1 if there are
+/// none, the reallocation failed.
+///
+int GetBufferOut(uint8_t **data, size_t *size)
+{
+	if (!dec->out_count)
+		return -1;
+
+	// a resize waits until the decoder returned all buffers
+	if (dec->out_resize) {
+		while (dec->out_nfree < dec->out_count && !DequeuePacketOut())
+			;
+		if (dec->out_nfree < dec->out_count)
+			return 1;
+		if (V4l2ResizeOutput())
+			return -1;
+	}
+
+	if (!dec->out_nfree && DequeuePacketOut())
+		return 1;
+
+	dec->out_index = dec->out_free[dec->out_nfree - 1];
+	*size = dec->buffers_out[dec->out_index].length;
+	*data = dec->buffers_out[dec->out_index].start;
+	return 0;
+}
+
+
+///
+/// Timestamp of an OUTPUT buffer, the decoder copies it to the capture
+/// buffer of the frame.
+/// @param pts	us or AV_NOPTS_VALUE
+/// @param cont	the buffer continues the frame of the last one
+///
+static int64_t OutputTag(int64_t pts, int cont)
+{
+	if (pts != AV_NOPTS_VALUE)
+		return pts + PTS_OFFSET;
+	return cont ? dec->out_tag : dec->out_tag + dec->out_duration;
+}
+
+
+///
+/// PTS in us of a tag from V4l2CaptureTag().
+///
+int64_t V4l2TagPts(int64_t tag)
+{
+	return tag - PTS_OFFSET;
+}
+
+
+///
+/// @returns the timestamp of the last queued OUTPUT buffer.
+///
+int64_t V4l2OutputTag(void)
+{
+	return dec->out_tag;
+}
+
+
+///
+/// Queue the OUTPUT buffer returned by GetBufferOut().
+///
+int QueueBufferOut(uint32_t bytesused, uint32_t flags, int64_t tag)
 {
 	// Queue buffer OUT
 	struct v4l2_buffer buf;
 	struct v4l2_plane planes[1];
 
-	if (decoder_start > (BUF_OUT - 1)) {
-		if (DequeuePacketOut()) {
-			if (pkt)
-				av_packet_unref(pkt);
-			return;
-		}
-	}
-
 	// set buffer
 	memset(&buf, 0, sizeof(buf));
 	memset(planes, 0, sizeof(planes));
@@ -290,93 +959,494 @@ void QueuePacketOut(AVPacket *pkt, uint32_t flags)
 	buf.memory = V4L2_MEMORY_MMAP;
 	buf.length = 1;
 	buf.m.planes = planes;
-	buf.index = dec_buf_out_index;
-
-	// fill buffer
-	if (pkt) {
-		buf.m.planes[0].bytesused = pkt->size;
-		memcpy(buffers_out[dec_buf_out_index].start, pkt->data, pkt->size);
-	} else {
-		buf.m.planes[0].bytesused = 0;
-	}
+	buf.index = dec->out_index;
+	buf.m.planes[0].bytesused = bytesused;
 	buf.m.planes[0].data_offset = 0;
 	buf.flags = flags;
+	// the decoder copies the timestamp to the capture buffer of the frame
+	buf.timestamp.tv_sec = tag / 1000000;
+	buf.timestamp.tv_usec = tag % 1000000;
 
-	if (ioctl(fd_v4l2_dec, VIDIOC_QBUF, &buf) < 0) {
+	if (V4l2Ioctl(dec->fd, VIDIOC_QBUF, &buf) < 0) {
 		fprintf(stderr, "VIDIOC_QBUF OUT failed: (%d): %m\n", errno);
-		if (pkt)
+		return -1;
+	}
+	TraceEvent(TRACE_OUT_QBUF, tag);
+	dec->out_tag = tag;
+	dec->out_nfree--;
+
+	if (!dec->out_streaming) {
+		// STREAMON OUT hier ???
+		enum v4l2_buf_type type_out = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		if (V4l2Ioctl(dec->fd, VIDIOC_STREAMON, &type_out)< 0)
+			fprintf(stderr, "VIDIOC_STREAMON OUT failed: (%d): %m\n", errno);
+		else fprintf(stderr, "VIDIOC_STREAMON OUT\n");
+		dec->out_streaming = 1;
+	}
+	dec->start++;
+
+	return 0;
+}
+
+
+///
+/// Copy a packet to the next free OUTPUT buffer and queue it.
+/// A packet larger than the buffers is split if the decoder parses a
+/// continuous bytestream, otherwise the buffers are reallocated.
+/// @returns 0 if the packet is consumed, 1 if all OUTPUT buffers are
+/// busy (the packet is kept, try again later), -1 on error.
+///
+int QueuePacketOut(AVPacket *pkt, uint32_t flags)
+{
+	uint8_t *data;
+	size_t size;
+	int64_t tag;
+	int ret;
+
+	if (pkt && (size_t)pkt->size > dec->out_max_packet)
+		dec->out_max_packet = pkt->size;
+	tag = OutputTag(pkt && pkt->pts != AV_NOPTS_VALUE ? av_rescale_q(pkt->pts,
+		StreamTimeBase(), AV_TIME_BASE_Q) : AV_NOPTS_VALUE, !pkt);
+
+	for (;;) {
+		if ((ret = GetBufferOut(&data, &size)) > 0)
+			return 1;
+		if (ret < 0) {
+			if (pkt)
+				av_packet_unref(pkt);
+			return -1;
+		}
+		if (!pkt || (size_t)pkt->size <= size)
+			break;
+
+		if (!dec->out_continuous) {
+			if (dec->out_size_limit && size >= dec->out_size_limit) {
+				fprintf(stderr, "QueuePacketOut: packet of %i bytes truncated\n", pkt->size);
+				pkt->size = size;
+				break;
+			}
+			dec->out_resize = OUT_ALIGN(dec->out_max_packet + dec->out_max_packet / 2);
+			continue;
+		}
+
+		// the rest follows in the next buffer
+		memcpy(data, pkt->data, size);
+		if (QueueBufferOut(size, 0, tag)) {
 			av_packet_unref(pkt);
+			return -1;
+		}
+		pkt->data += size;
+		pkt->size -= size;
+	}
+
+	// fill buffer
+	if (pkt)
+		memcpy(data, pkt->data, pkt->size);
+
+	ret = QueueBufferOut(pkt ? pkt->size : 0, flags, tag);
+
+	if (pkt)
+		av_packet_unref(pkt);
+
+	return ret;
+}
+
+
+///
+/// Read the next PES of the TS input straight into a free OUTPUT buffer
+/// and queue it, without an AVPacket in between.
+/// A PES larger than the buffers is split if the decoder parses a
+/// continuous bytestream, otherwise the buffers are reallocated first.
+/// @returns 0 if a PES is queued or kept, 1 if all OUTPUT buffers are busy,
+/// -1 at end of file, -2 if the decoder takes no more buffers.
+///
+int QueuePesOut(void)
+{
+	uint8_t *data, *pes;
+	size_t size, len, held;
+	int64_t pts;
+	int ret;
+
+	if ((ret = GetBufferOut(&data, &size)))
+		return ret > 0 ? 1 : -2;
+
+	// start of a PES kept over the resize
+	held = dec->out_pes_len;
+	if (held > size) {
+		fprintf(stderr, "QueuePesOut: PES of %zu KiB truncated\n", held / 1024);
+		held = size;
+	}
+	if (held)
+		memcpy(data, dec->out_pes, held);
+	ret = TsReadPes(data + held, size - held, &len, &pts);
+	if (held) {
+		len += held;
+		pts = dec->out_pes_pts;
+		dec->out_pes_len = 0;
+		// the end of file completes it
+		if (ret < 0)
+			ret = 0;
+	} else if (ret < 0) {
+		return -1;
+	}
+
+	// whole frames only: the PES waits for larger buffers
+	if (ret > 0 && !dec->out_continuous &&
+			(!dec->out_size_limit || size < dec->out_size_limit)) {
+		if (!(pes = realloc(dec->out_pes, len))) {
+			fprintf(stderr, "QueuePesOut: out of memory\n");
+			return -2;
+		}
+		memcpy(pes, data, len);
+		dec->out_pes = pes;
+		dec->out_pes_len = len;
+		dec->out_pes_pts = pts;
+		dec->out_resize = OUT_ALIGN(size * 2);
+		return 0;
+	}
+
+	// the PES continues in the next buffer
+	if (ret > 0 && !dec->out_continuous && !dec->out_pes_split)
+		fprintf(stderr, "QueuePesOut: PES larger than %zu KiB split, "
+			"the decoder may not accept it\n", size / 1024);
+
+	// 90 kHz PTS, the rest of a split PES belongs to the same frame
+	if (QueueBufferOut(len, 0, OutputTag(pts != AV_NOPTS_VALUE ?
+			av_rescale(pts, 100, 9) : AV_NOPTS_VALUE, dec->out_pes_split)))
+		return -2;
+	dec->out_pes_split = ret > 0;
+
+	return 0;
+}
+
+
+///
+/// @returns the timestamp of the last dequeued capture buffer, the
+/// tag of the OUTPUT buffer the frame was decoded from.
+///
+int64_t V4l2CaptureTag(void)
+{
+	return dec->cap_tag;
+}
+
+
+///
+/// Dequeue a capture buffer, check for a frame and the end of stream.
+/// @returns index, -EAGAIN if no frame is ready, -EPIPE after the last
+/// or another -errno if the decoder failed, e.g. the device is gone.
+///
+static int DequeueCapture(struct v4l2_buffer *buf)
+{
+	unsigned int p;
+	int err;
+
+	if (dec->cap_changed)
+		return -EAGAIN;
+
+	if (V4l2Ioctl(dec->fd, VIDIOC_DQBUF, buf) < 0) {
+		if (errno != EAGAIN && errno != EPIPE) {
+			err = errno;
+			fprintf(stderr, "VIDIOC_DQBUF Capture failed: (%d): %m\n", err);
+			return -err;
+		}
+		if (errno == EAGAIN)
+			return -EAGAIN;
+		buf->flags = V4L2_BUF_FLAG_LAST;
+		buf->m.planes[0].bytesused = 0;
 	} else {
-		if (dec_buf_out_index == BUF_OUT - 1) {
-			dec_buf_out_index = 0;
-		} else {
-			dec_buf_out_index++;
+		dec->cap_queued[buf->index] = 0;
+	}
+
+	dec->cap_tag = (int64_t)buf->timestamp.tv_sec * 1000000 + buf->timestamp.tv_usec;
+	if (buf->m.planes[0].bytesused) {
+		TraceEvent(TRACE_CAP_DQBUF, dec->cap_tag);
+		// the frame may be copied later, see CopyBufferCapture()
+		for (p = 0; p < buf->length; p++) {
+			dec->buffers_cap[buf->index][p].bytesused = buf->m.planes[p].bytesused;
+			dec->buffers_cap[buf->index][p].data_offset = buf->m.planes[p].data_offset;
 		}
+	}
+
+	if (!(buf->flags & V4L2_BUF_FLAG_LAST))
+		return buf->index;
+
+	// the event may still wait behind the last buffer
+	V4l2HandleEvent();
+	if (dec->cap_source_change) {
+		fprintf(stderr, "DequeueCapture: last buffer before the source change\n");
+		dec->cap_changed = 1;
+		return buf->m.planes[0].bytesused ? (int)buf->index : -EAGAIN;
+	}
+	dec->cap_last = 1;
+
+	// an empty buffer only marks the end of the stream
+	if (!buf->m.planes[0].bytesused) {
+		fprintf(stderr, "DequeueCapture: last buffer\n");
+		return -EPIPE;
+	}
+
+	return buf->index;
+}
+
+
+///
+/// Bytes of data in a dequeued capture plane, none if the driver puts
+/// the offset past the used bytes.
+///
+static size_t PlaneData(const struct buffers *b)
+{
+	return b->bytesused > b->data_offset ? b->bytesused - b->data_offset : 0;
+}
 
-		if(decoder_start == 0) {
-			// STREAMON OUT hier ???
-			enum v4l2_buf_type type_out = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-			if (ioctl(fd_v4l2_dec, VIDIOC_STREAMON, &type_out)< 0)
-				fprintf(stderr, "VIDIOC_STREAMON OUT failed: (%d): %m\n", errno);
-			else fprintf(stderr, "VIDIOC_STREAMON OUT\n");
 
-			sleep(1);
+///
+/// Find the color planes of a dequeued capture buffer. Formats with one
+/// memory plane keep the chroma right after bytesperline * height luma.
+/// @returns number of color planes.
+///
+static unsigned int CapturePlanes(int index, uint8_t *ptr[], size_t len[])
+{
+	struct v4l2_pix_format_mplane *pix = &dec->cap_fmt.fmt.pix_mp;
+	struct buffers *b = dec->buffers_cap[index];
+	unsigned int n = ColorPlanes(pix->pixelformat);
+	unsigned int p;
+	size_t size;
+
+	if (pix->num_planes >= n) {
+		for (p = 0; p < n; p++) {
+			ptr[p] = (uint8_t *)b[p].start + b[p].data_offset;
+			len[p] = PlaneData(&b[p]);
 		}
-		decoder_start++;
-		if (pkt)
-			av_packet_unref(pkt);
+		return n;
 	}
+
+	ptr[0] = (uint8_t *)b[0].start + b[0].data_offset;
+	size = PlaneData(&b[0]);
+	len[0] = (size_t)pix->plane_fmt[0].bytesperline * pix->height;
+	if (len[0] > size)
+		len[0] = size;
+	for (p = 1; p < n; p++) {
+		ptr[p] = ptr[p - 1] + len[p - 1];
+		len[p] = (size - len[0]) / (n - 1);
+	}
+	return n;
 }
 
 
-	// Dequeue buffer Capture
-void DequeueBufferCapture(uint8_t *plane0, uint8_t *plane1)
+///
+/// Dequeue a decoded frame and copy its color planes.
+/// @param dst		destination planes
+/// @param size		size of each destination plane
+/// @param count	number of destination planes
+/// @returns index, -EAGAIN, -EPIPE or -errno.
+///
+int DequeueBufferCapture(uint8_t *dst[], const size_t size[], unsigned int count)
 {
-	struct v4l2_plane planes[2];	// Das muss noch automatisiert werden!!!
-	struct v4l2_buffer buf;
 	int index;
 
+	if ((index = DequeueIndexCapture()) < 0)
+		return index;
+
+	CopyBufferCapture(index, dst, size, count);
+	QueueBufferCapture(index);
+
+	return index;
+}
+
+
+///
+/// Copy the color planes of a capture buffer dequeued with
+/// DequeueIndexCapture(), so a frame is only copied if it is shown.
+///
+void CopyBufferCapture(int index, uint8_t *dst[], const size_t size[], unsigned int count)
+{
+	uint8_t *ptr[VIDEO_MAX_PLANES];
+	size_t len[VIDEO_MAX_PLANES];
+	unsigned int p, n;
+
+	n = CapturePlanes(index, ptr, len);
+	for (p = 0; p < n && p < count; p++)
+		memcpy(dst[p], ptr[p], len[p] < size[p] ? len[p] : size[p]);
+}
+
+
+///
+/// Bytes per line of a color plane, planar chroma in the luma memory
+/// plane has half of them.
+///
+static unsigned int CapturePitch(unsigned int plane, unsigned int planes)
+{
+	struct v4l2_pix_format_mplane *pix = &dec->cap_fmt.fmt.pix_mp;
+
+	if (plane < pix->num_planes)
+		return pix->plane_fmt[plane].bytesperline;
+	return pix->plane_fmt[0].bytesperline / (planes == 3 ? 2 : 1);
+}
+
+
+///
+/// Copy the visible lines of a capture buffer dequeued with
+/// DequeueIndexCapture() to a 4:2:0 picture with other pitches. Unlike
+/// CopyBufferCapture() no padding is copied.
+/// @param pitch	bytes per line of each destination plane
+/// @param width, height	size of the destination picture
+///
+void CopyLinesCapture(int index, uint8_t *dst[], const uint32_t pitch[], unsigned int count,
+	unsigned int width, unsigned int height)
+{
+	struct v4l2_pix_format_mplane *pix = &dec->cap_fmt.fmt.pix_mp;
+	uint8_t *ptr[VIDEO_MAX_PLANES];
+	size_t len[VIDEO_MAX_PLANES];
+	unsigned int n, p, w, h, src_pitch;
+
+	n = CapturePlanes(index, ptr, len);
+	if (width > pix->width)
+		width = pix->width;
+	if (height > pix->height)
+		height = pix->height;
+
+	for (p = 0; p < n && p < count; p++) {
+		// chroma has half the lines, planar chroma half the width too
+		w = p && n == 3 ? width / 2 : width;
+		h = p ? height / 2 : height;
+		src_pitch = CapturePitch(p, n);
+		if (!src_pitch)
+			continue;
+		if ((size_t)src_pitch * h > len[p])
+			h = len[p] / src_pitch;
+		CopyPlane(dst[p], pitch[p], ptr[p], src_pitch, w, h);
+	}
+}
+
+
+///
+/// Convert an NV12MT capture buffer dequeued with DequeueIndexCapture()
+/// to linear NV12, for planes without the tiled modifier.
+/// @param dst		luma and chroma planes
+/// @param pitch	bytes per line of each destination plane
+/// @param width, height	size of the destination picture
+///
+void DetileBufferCapture(int index, uint8_t *dst[], const uint32_t pitch[],
+	unsigned int width, unsigned int height)
+{
+	struct v4l2_pix_format_mplane *pix = &dec->cap_fmt.fmt.pix_mp;
+	uint8_t *ptr[VIDEO_MAX_PLANES];
+	size_t len[VIDEO_MAX_PLANES];
+
+	if (CapturePlanes(index, ptr, len) < 2 || !len[0])
+		return;
+	if (width > pix->width)
+		width = pix->width;
+	if (height > pix->height)
+		height = pix->height;
+
+	DetilePlane(dst[0], pitch[0], ptr[0], pix->plane_fmt[0].bytesperline, width, height);
+	DetilePlane(dst[1], pitch[1], ptr[1], pix->plane_fmt[pix->num_planes > 1].bytesperline,
+		width, height / 2);
+}
+
+
+///
+/// Dequeue a decoded frame without touching its content.
+/// @returns index of the capture buffer, -EAGAIN, -EPIPE or -errno.
+///
+int DequeueIndexCapture(void)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buf;
+
 	memset(&buf, 0, sizeof(buf));
 	memset(planes, 0, sizeof(planes));
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	buf.memory = V4L2_MEMORY_MMAP;
-	buf.length = 2;
+	buf.length = dec->cap_fmt.fmt.pix_mp.num_planes;
 	buf.m.planes = planes;
 
-	if (ioctl(fd_v4l2_dec, VIDIOC_DQBUF, &buf) < 0) {
-		fprintf(stderr, "VIDIOC_DQBUF Capture failed: (%d): %m\n", errno);
-	} else {
+	return DequeueCapture(&buf);
+}
 
-		memcpy(plane0, buffers_cap[buf.index].start, buf.m.planes[0].length);
-		memcpy(plane1, buffers_cap[buf.index].start + buf.m.planes[0].bytesused,
-			buf.m.planes[1].length);
 
-		index = buf.index;
-		memset(&buf, 0, sizeof(buf));
-		memset(planes, 0, sizeof(planes));
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.length = 2;
-		buf.m.planes = planes;
-		buf.index = index;
+void QueueBufferCapture(int index)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buf;
 
-		if (ioctl(fd_v4l2_dec, VIDIOC_QBUF, &buf)) {
-			fprintf(stderr, "VIDIOC_QBUF Capture failed: (%d): %m\n", errno);
-		}
+	memset(&buf, 0, sizeof(buf));
+	memset(planes, 0, sizeof(planes));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.length = dec->cap_fmt.fmt.pix_mp.num_planes;
+	buf.m.planes = planes;
+	buf.index = index;
+
+	if (V4l2Ioctl(dec->fd, VIDIOC_QBUF, &buf)) {
+		fprintf(stderr, "VIDIOC_QBUF Capture failed: (%d): %m\n", errno);
+		return;
 	}
+	dec->cap_queued[index] = 1;
 }
 
 
-void MunmapBuffer(void)
+///
+/// Export all memory planes of a capture buffer with VIDIOC_EXPBUF.
+/// A single memory plane NV12/NV21 buffer is described as two color
+/// planes sharing one fd, so the caller can hand it to KMS as is.
+///
+int ExportBufferCapture(int index, struct dmabuf_frame *frame)
 {
+	struct v4l2_pix_format_mplane *pix = &dec->cap_fmt.fmt.pix_mp;
+	struct v4l2_exportbuffer expbuf;
 	int i;
 
-	for (i = 0; i < BUF_OUT; i++) {
-		if (munmap(buffers_out[i].start, buffers_out[i].length))
-			fprintf(stderr, "munmap_buffer: munmap_buffer output failed: (%d): %m\n", errno);
+	memset(frame, 0, sizeof(*frame));
+	frame->width = pix->width;
+	frame->height = pix->height;
+	frame->visible = dec->cap_rect;
+	frame->pixelformat = pix->pixelformat;
+	frame->num_planes = ColorPlanes(pix->pixelformat);
+
+	for (i = 0; i < pix->num_planes && i < 4; i++) {
+		memset(&expbuf, 0, sizeof(expbuf));
+		expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		expbuf.index = index;
+		expbuf.plane = i;
+		expbuf.flags = O_CLOEXEC | O_RDWR;
+
+		if (V4l2Ioctl(dec->fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+			fprintf(stderr, "VIDIOC_EXPBUF Capture failed: index %i plane %i (%d): %m\n",
+				index, i, errno);
+			goto fail;
+		}
+		frame->fd[i] = expbuf.fd;
+		frame->pitch[i] = pix->plane_fmt[i].bytesperline;
+		frame->offset[i] = dec->buffers_cap[index][i].data_offset;
+		frame->num_fds++;
 	}
-	for (i = 0; i < BUF_CAP; i++) {
-		if (munmap(buffers_cap[i].start, buffers_cap[i].length))
-			fprintf(stderr, "munmap_buffer: munmap_buffer capture failed: (%d): %m\n", errno);
+
+	// the chroma follows the luma in the same memory plane
+	for (i = frame->num_fds; i < frame->num_planes; i++) {
+		frame->fd[i] = frame->fd[0];
+		frame->pitch[i] = frame->num_planes == 3 ? frame->pitch[0] / 2 : frame->pitch[0];
+		frame->offset[i] = frame->offset[i - 1] + (i == 1 ? frame->pitch[0] * pix->height :
+			frame->pitch[i - 1] * pix->height / 2);
 	}
+
+	return 0;
+
+fail:
+	for (i = 0; i < frame->num_fds; i++)
+		close(frame->fd[i]);
+	frame->num_fds = 0;
+	return -1;
+}
+
+
+void MunmapBuffer(void)
+{
+	V4l2FreeOutput();
+	free(dec->out_pes);
+	dec->out_pes = NULL;
+	dec->out_pes_len = 0;
+
+	UnmapCapture();
 }
@@ -1,14 +1,76 @@
 
+struct decoder;
+
+void V4l2Select(struct decoder *d);
+
 void PrintCaps(int fd_v4l2);
 
-void V4l2SetupOutput(void);
+int V4l2SetupOutput(unsigned int count);
+
+int V4l2SetupCapture(int zero_copy);
+
+void V4l2ReleaseCapture(void);
+
+void V4l2SetCaptureMargin(unsigned int margin);
+
+void V4l2SetLowDelay(int enable);
+
+void V4l2HandleEvent(void);
+
+int V4l2CaptureChanged(void);
+
+int GetBufferOut(uint8_t **data, size_t *size);
+
+int QueueBufferOut(uint32_t bytesused, uint32_t flags, int64_t tag);
+
+int64_t V4l2OutputTag(void);
+
+int QueuePacketOut(AVPacket *pkt, uint32_t flags);
 
-void V4l2SetupCapture(void);
+int QueuePesOut(void);
 
-void QueuePacketOut(AVPacket *pkt, uint32_t flags);
+int DequeueBufferCapture(uint8_t *dst[], const size_t size[], unsigned int count);
 
-void DequeueBufferCapture(uint8_t *plane0, uint8_t *plane1);
+int DequeueIndexCapture(void);
+
+void CopyBufferCapture(int index, uint8_t *dst[], const size_t size[], unsigned int count);
+
+void CopyLinesCapture(int index, uint8_t *dst[], const uint32_t pitch[], unsigned int count,
+	unsigned int width, unsigned int height);
+
+void DetileBufferCapture(int index, uint8_t *dst[], const uint32_t pitch[],
+	unsigned int width, unsigned int height);
+
+int64_t V4l2CaptureTag(void);
+
+int64_t V4l2TagPts(int64_t tag);
+
+void QueueBufferCapture(int index);
+
+///
+/// Capture buffer exported as dmabuf, described per color plane.
+/// The fds (fd[0] .. fd[num_fds - 1]) belong to the caller, color planes
+/// without an own memory plane share fd[0].
+///
+struct dmabuf_frame {
+	uint32_t width, height;
+	struct v4l2_rect visible;	///< compose rectangle of the decoder
+	uint32_t pixelformat;	///< V4L2 fourcc
+	int num_planes;		///< color planes
+	int num_fds;
+	int fd[4];
+	uint32_t pitch[4];
+	uint32_t offset[4];
+};
+
+int ExportBufferCapture(int index, struct dmabuf_frame *frame);
 
 void MunmapBuffer(void);
 
+int V4l2Drain(void);
+
+void V4l2Flush(void);
+
+int V4l2Resume(void);
+
 void StreamOff(void);
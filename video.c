@@ -1,17 +1,35 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 #include <inttypes.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/videodev2.h>
 
 #include <libavcodec/avcodec.h>
 
+#include "detile.h"
+#include "live.h"
+#include "main.h"
+#include "sched.h"
+#include "sink.h"
+#include "stream.h"
+#include "trace.h"
 #include "v4l2.h"
+#include "video.h"
 
 #define DRM_ALIGN(val, align)	((val + (align - 1)) & ~(align - 1))
+#define DRM_MAX_OBJECTS	8	///< cached KMS objects
+#define DRM_MAX_PROPS	64	///< cached properties per object
+#define DRM_MAX_FBS	8	///< copy framebuffers
+#define DRM_MAX_LAYERS	4	///< streams on planes of their own
 
 
 struct drm_buf {
@@ -23,29 +41,92 @@ struct drm_buf {
 	uint32_t pitch[4];
 	uint32_t offset[4];
 	uint8_t *plane[4];
+	uint32_t src_x, src_y, src_w, src_h;	///< visible part, SRC_* of the plane
+	uint64_t modifier;
+	int index;			///< V4L2 capture buffer (zero-copy only)
+	uint32_t prime_handle[4];	///< GEM handles of the imported dmabufs
+	int64_t tag;			///< decoder tag of the frame shown
+	int fence;			///< out-fence of the commit that replaced it, -1 none
+	int in_fence;			///< scanout waits for it, -1 none
+	int dmabuf_fd;			///< zero-copy: first plane, for its fences
+};
+
+struct drm_props {
+	uint32_t object_id;
+	uint32_t object_type;
+	uint32_t count_props;
+	uint32_t prop_id[DRM_MAX_PROPS];
+	char name[DRM_MAX_PROPS][DRM_PROP_NAME_LEN];
+};
+
+///
+/// One stream on a plane of its own: the whole screen, a mosaic tile or
+/// the PiP window.
+///
+struct drm_layer {
+	uint32_t plane;
+	uint32_t x, y, w, h;		///< rectangle on the CRTC
+	struct decoder *dec;		///< decoder of the frames, NULL unused
+	unsigned int count_bufs;
+	struct drm_buf bufs[DRM_MAX_FBS];	///< copy framebuffers
+	int zero_copy;
+	int tiled_fbs;			///< copy framebuffers are NV12MT, no detiling
+	int detile;			///< the capture format is converted on copy
+	int in_fences;			///< plane has IN_FENCE_FD
+	unsigned int cap_count;
+	struct drm_buf cap_bufs[VIDEO_MAX_FRAME];
+	struct drm_buf *shown_buf;	///< buffer on screen
+	struct drm_buf *pending_buf;	///< committed, the flip is not done
+	struct drm_buf *ready;		///< next frame, waits for the flip
+	int held;			///< decoded frame waiting for its vblank, -1 none
+	int64_t held_tag;
+	struct sched sched;
+	int eos;			///< the decoder returned its last frame
+	AVRational sar;			///< pixel aspect of the stream
+	uint32_t src_x, src_y, src_w, src_h;	///< SRC_* set on the plane
 };
 
 struct data_priv {
 	int fd_drm;
 	int loops;
-	int front_buf;
 	uint32_t encoder_id;
 	uint32_t connector_id;
 	uint32_t crtc_id;
+	uint32_t crtc_index;		///< pipe of the CRTC for vblank events
 	uint32_t video_plane;
 	uint32_t osd_plane;
+	uint32_t extra_planes[DRM_MAX_LAYERS - 1];	///< more NV12 planes
+	unsigned int count_extra;
 	int use_zpos;
 	uint64_t zpos_overlay;
 	uint64_t zpos_primary;
-	struct drm_buf bufs[2];
+	struct drm_layer layers[DRM_MAX_LAYERS];	///< layers[0] on video_plane
+	unsigned int count_layers;
+	struct drm_layer *layer;	///< current, see VideoSelect()
 	struct drm_buf buf_black;
+	uint32_t flip_flags;		///< flags of the per-frame commit
+	int out_fences;			///< CRTC has OUT_FENCE_PTR
+	int no_sched;			///< no vblank events, show every frame
+	int flip_pending;		///< page flip outstanding
+	int vblank_pending;		///< vblank event outstanding
 	drmModeCrtc *saved_crtc;
-	drmModeModeInfo mode_hd;
-	drmModeModeInfo mode_hdr;
+	drmModeModeInfo mode;		///< mode of the CRTC
+	drmModeModeInfo *modes;		///< modes of the connector
+	int count_modes;
+	int vrr_capable;		///< connector and CRTC support VRR
+	int vrr;			///< VRR_ENABLED
 	drmEventContext ev;
+	int no_prop_cache;
+	int count_objects;
+	struct drm_props props[DRM_MAX_OBJECTS];
+	unsigned long ioctls;		///< DRM ioctls since KmsInit
 };
 
 static struct data_priv *d_priv = NULL;
+static int no_prop_cache = 0;
+static unsigned int fb_count = 3;
+static unsigned int layer_count = 1;
+static int layer_pip;
 
 
 // helper functions
@@ -84,34 +165,87 @@ static uint64_t GetPropertyValue(int fd_drm, uint32_t objectID,
 }
 
 
-static int DrmSetPropertyRequest(drmModeAtomicReqPtr ModeReq, int fd_drm,
-					uint32_t objectID, uint32_t objectType,
-					const char *propName, uint32_t value)
+///
+/// Return the property table of a KMS object. The names and ids are read
+/// from the kernel only on the first call for that object.
+///
+static struct drm_props *DrmGetProps(struct data_priv *priv, uint32_t objectID,
+					uint32_t objectType)
 {
-	uint32_t i;
-	int found = 0;
-	uint64_t id = 0;
+	struct drm_props *props;
 	drmModePropertyPtr Prop;
-	drmModeObjectPropertiesPtr objectProps =
-		drmModeObjectGetProperties(fd_drm, objectID, objectType);
+	drmModeObjectPropertiesPtr objectProps;
+	uint32_t i;
+	int n;
 
-	for (i = 0; i < objectProps->count_props; i++) {
-		if ((Prop = drmModeGetProperty(fd_drm, objectProps->props[i])) == NULL)
-			fprintf(stderr, "Unable to query property.\n");
+	// measure the uncached case
+	if (priv->no_prop_cache)
+		priv->count_objects = 0;
 
-		if (strcmp(propName, Prop->name) == 0) {
-			id = Prop->prop_id;
-			found = 1;
+	for (n = 0; n < priv->count_objects; n++) {
+		if (priv->props[n].object_id == objectID &&
+				priv->props[n].object_type == objectType)
+			return &priv->props[n];
+	}
+
+	if (priv->count_objects < DRM_MAX_OBJECTS)
+		n = priv->count_objects++;
+	else
+		n = DRM_MAX_OBJECTS - 1;
+	props = &priv->props[n];
+	memset(props, 0, sizeof(*props));
+	props->object_id = objectID;
+	props->object_type = objectType;
+
+	// libdrm needs two ioctls for each of these calls
+	objectProps = drmModeObjectGetProperties(priv->fd_drm, objectID, objectType);
+	priv->ioctls += 2;
+	if (!objectProps) {
+		fprintf(stderr, "Unable to query properties of object %i.\n", objectID);
+		return props;
+	}
+
+	for (i = 0; i < objectProps->count_props && i < DRM_MAX_PROPS; i++) {
+		priv->ioctls += 2;
+		if ((Prop = drmModeGetProperty(priv->fd_drm, objectProps->props[i])) == NULL) {
+			fprintf(stderr, "Unable to query property.\n");
+			continue;
 		}
 
-		drmModeFreeProperty(Prop);
+		props->prop_id[props->count_props] = Prop->prop_id;
+		strncpy(props->name[props->count_props], Prop->name, DRM_PROP_NAME_LEN - 1);
+		props->count_props++;
 
-		if (found)
-			break;
+		drmModeFreeProperty(Prop);
 	}
 
 	drmModeFreeObjectProperties(objectProps);
 
+	return props;
+}
+
+
+static uint32_t DrmGetPropertyId(struct data_priv *priv, uint32_t objectID,
+					uint32_t objectType, const char *propName)
+{
+	struct drm_props *props = DrmGetProps(priv, objectID, objectType);
+	uint32_t i;
+
+	for (i = 0; i < props->count_props; i++) {
+		if (strcmp(propName, props->name[i]) == 0)
+			return props->prop_id[i];
+	}
+
+	return 0;
+}
+
+
+static int DrmSetPropertyRequest(drmModeAtomicReqPtr ModeReq, struct data_priv *priv,
+					uint32_t objectID, uint32_t objectType,
+					const char *propName, uint64_t value)
+{
+	uint32_t id = DrmGetPropertyId(priv, objectID, objectType, propName);
+
 	if (id == 0)
 		fprintf(stderr, "Unable to find value for property \'%s\'.\n", propName);
 
@@ -119,64 +253,251 @@ static int DrmSetPropertyRequest(drmModeAtomicReqPtr ModeReq, int fd_drm,
 }
 
 
-void Drm_page_flip_event( __attribute__ ((unused)) int fd,
-					__attribute__ ((unused)) unsigned int frame,
-					__attribute__ ((unused)) unsigned int sec,
-					__attribute__ ((unused)) unsigned int usec,
-					__attribute__ ((unused)) void *data)
+static int DrmCommit(struct data_priv *priv, drmModeAtomicReqPtr ModeReq,
+					uint32_t flags, void *data)
 {
-	struct data_priv *priv = d_priv;
-	struct drm_buf *buf = 0;
+	priv->ioctls++;
+	return drmModeAtomicCommit(priv->fd_drm, ModeReq, flags, data);
+}
 
-	buf = &priv->bufs[priv->front_buf];
 
-	if (priv->loops < 100) {
+///
+/// @returns 1 if the fence is signaled or there is none.
+///
+static int DrmFenceSignaled(int *fence)
+{
+	struct pollfd pfd;
 
-		DequeueBufferCapture(buf->plane[0], buf->plane[1]);
+	if (*fence < 0)
+		return 1;
 
-		drmModeAtomicReqPtr ModeReq;
-		const uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT;
-		if (!(ModeReq = drmModeAtomicAlloc()))
-			fprintf(stderr, "cannot allocate atomic request (%d): %m\n", errno);
+	pfd.fd = *fence;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
 
-		DrmSetPropertyRequest(ModeReq, priv->fd_drm, priv->video_plane,
-						DRM_MODE_OBJECT_PLANE, "FB_ID", buf->fb_id);
-		if (drmModeAtomicCommit(priv->fd_drm, ModeReq, flags, NULL) != 0)
-			fprintf(stderr, "cannot page flip to FB %i (%d): %m\n",
-				buf->fb_id, errno);
+	close(*fence);
+	*fence = -1;
+	return 1;
+}
 
-		drmModeAtomicFree(ModeReq);
-		priv->front_buf ^= 1;
-		priv->loops++;
 
-/*		if (drmModePageFlip(priv->fd_drm, priv->crtc_id, buf->fb_id,
-				DRM_MODE_PAGE_FLIP_EVENT, buf)) {
-			fprintf(stderr, "Drm_page_flip_event: cannot page flip fb_id %i %i x %i (%d): %m\n",
-				buf->fb_id, buf->width, buf->height, errno);
-		} else {
-			priv->front_buf ^= 1;
-			priv->loops++;
-		}*/
+///
+/// A copy framebuffer the display is done with. Its out-fence signals
+/// when the commit that replaced it reached the screen.
+/// @returns NULL if all are in use.
+///
+static struct drm_buf *DrmFreeBuf(struct drm_layer *l)
+{
+	struct drm_buf *buf;
+	unsigned int i;
+
+	for (i = 0; i < l->count_bufs; i++) {
+		buf = &l->bufs[i];
+		if (buf == l->shown_buf || buf == l->pending_buf || buf == l->ready)
+			continue;
+		if (DrmFenceSignaled(&buf->fence))
+			return buf;
 	}
+	return NULL;
 }
 
 
-static int Drm_find_dev(void)
+///
+/// Let scanout wait for the writes to a decoder buffer, from the fences
+/// of its dmabuf. Decoders that signal at DQBUF have none.
+///
+static void DrmInFence(struct drm_layer *l, struct drm_buf *buf)
+{
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	struct dma_buf_export_sync_file sync;
+
+	if (!l->in_fences || buf->dmabuf_fd < 0)
+		return;
+
+	memset(&sync, 0, sizeof(sync));
+	sync.flags = DMA_BUF_SYNC_READ;
+	sync.fd = -1;
+	if (drmIoctl(buf->dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &sync)) {
+		fprintf(stderr, "DrmInFence: no dmabuf fences (%d): %m\n", errno);
+		l->in_fences = 0;
+		return;
+	}
+	buf->in_fence = sync.fd;
+#else
+	(void)l;
+	(void)buf;
+#endif
+}
+
+
+///
+/// Dequeue the next decoded frame due at the next vblank and get the
+/// framebuffer showing it. In zero-copy mode this is the decoder's own
+/// buffer, otherwise the frame is copied to the back buffer. Late frames
+/// go back to the decoder uncopied.
+/// @returns 0, -EAGAIN if no frame is ready, -EBUSY if the frame is
+/// due at a later vblank, -ENOBUFS if no framebuffer is free or -EPIPE
+/// at end of stream. The decoder of the layer must be selected.
+///
+static int DrmGetFrame(struct data_priv *priv, struct drm_layer *l, struct drm_buf **buf)
+{
+	struct drm_buf *fb = NULL;
+	size_t size[2];
+	int index;
+
+	// leave the frames in the decoder while scanout holds all buffers
+	if (!l->zero_copy && !(fb = DrmFreeBuf(l)))
+		return -ENOBUFS;
+
+	for (;;) {
+		if (l->held < 0) {
+			if ((index = DequeueIndexCapture()) < 0)
+				return index;
+			l->held = index;
+			l->held_tag = V4l2CaptureTag();
+		}
+		if (priv->no_sched)
+			break;
+
+		// with a flip pending the frame goes to the vblank after it
+		switch (SchedFrame(&l->sched, V4l2TagPts(l->held_tag),
+				priv->flip_pending)) {
+		case SCHED_SHOW:
+			break;
+		case SCHED_WAIT:
+			return -EBUSY;
+		case SCHED_DROP:
+			QueueBufferCapture(l->held);
+			l->held = -1;
+			continue;
+		}
+		break;
+	}
+	index = l->held;
+	l->held = -1;
+
+	if (l->zero_copy) {
+		*buf = &l->cap_bufs[index];
+		DrmInFence(l, *buf);
+	} else {
+		*buf = fb;
+		size[0] = (*buf)->offset[1];
+		size[1] = (*buf)->size - (*buf)->offset[1];
+		if (l->detile)
+			DetileBufferCapture(index, (*buf)->plane, (*buf)->pitch,
+				(*buf)->width, (*buf)->height);
+		else if (l->tiled_fbs)
+			CopyBufferCapture(index, (*buf)->plane, size, 2);
+		else
+			CopyLinesCapture(index, (*buf)->plane, (*buf)->pitch, 2,
+				(*buf)->width, (*buf)->height);
+		QueueBufferCapture(index);
+	}
+	(*buf)->tag = l->held_tag;
+
+	return 0;
+}
+
+
+///
+/// Ask for an event at the next vblank, a frame waits for it.
+///
+static int DrmWaitVblank(struct data_priv *priv)
+{
+	drmVBlank vbl;
+
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT;
+	if (priv->crtc_index == 1)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	else if (priv->crtc_index > 1)
+		vbl.request.type |= (priv->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT)
+			& DRM_VBLANK_HIGH_CRTC_MASK;
+	vbl.request.sequence = 1;
+
+	priv->ioctls++;
+	return drmWaitVBlank(priv->fd_drm, &vbl);
+}
+
+
+///
+/// The commit of buf is done, so the frame shown before left the screen.
+/// In zero-copy mode give that one back to the decoder of the layer.
+///
+static void DrmPutFrame(struct drm_layer *l, struct drm_buf *buf)
+{
+	struct decoder *cur = dec;
+
+	if (l->zero_copy && l->shown_buf && l->shown_buf != buf) {
+		V4l2Select(l->dec);
+		QueueBufferCapture(l->shown_buf->index);
+		V4l2Select(cur);
+	}
+	l->shown_buf = buf;
+	l->pending_buf = NULL;
+}
+
+
+void Drm_page_flip_event( __attribute__ ((unused)) int fd,
+					__attribute__ ((unused)) unsigned int frame,
+					unsigned int sec, unsigned int usec, void *data)
+{
+	struct data_priv *priv = d_priv;
+	uint64_t t = (uint64_t)sec * 1000000000 + (uint64_t)usec * 1000;
+	struct drm_layer *l;
+	unsigned int i;
+
+	priv->flip_pending = 0;
+
+	// one commit flipped the frames of all layers
+	for (i = 0; i < priv->count_layers; i++) {
+		l = &priv->layers[i];
+		SchedVblank(&l->sched, t);
+		if (!data || !l->pending_buf)
+			continue;
+		// vblank time of the flip, CLOCK_MONOTONIC
+		TraceEventAt(TRACE_FLIP, t, l->pending_buf->tag);
+		LiveShown(V4l2TagPts(l->pending_buf->tag), t);
+		DrmPutFrame(l, l->pending_buf);
+	}
+	if (data)
+		priv->loops++;
+}
+
+
+static void Drm_vblank_event(__attribute__ ((unused)) int fd,
+					__attribute__ ((unused)) unsigned int frame,
+					unsigned int sec, unsigned int usec,
+					__attribute__ ((unused)) void *data)
+{
+	struct data_priv *priv = d_priv;
+	unsigned int i;
+
+	priv->vblank_pending = 0;
+	for (i = 0; i < priv->count_layers; i++)
+		SchedVblank(&priv->layers[i].sched,
+			(uint64_t)sec * 1000000000 + (uint64_t)usec * 1000);
+}
+
+
+static int Drm_find_dev(const char *card)
 {
 	int fd_drm;
 	drmModeRes *resources;
-	drmModeConnector *connector;
-	drmModeEncoder *encoder;
+	drmModeConnector *connector = NULL;
+	drmModeEncoder *encoder = NULL;
 	drmModeModeInfo *mode;
 	drmModePlane *plane;
 	drmModePlaneRes *plane_res;
 	int i;
 	uint64_t has_cap;
 	uint32_t j, k;
-	struct data_priv *priv;
+	struct data_priv *priv = NULL;
 	
 //	fd_drm = drmOpen("imx-drm", NULL);
-	fd_drm = open("/dev/dri/card0", O_RDWR);
+	fd_drm = open(card, O_RDWR);
 	if (fd_drm < 0) {
 		fprintf(stderr, "Drm_find_dev: drmOpen failed: (%d): %m\n", errno);
 		goto out;
@@ -225,6 +546,7 @@ static int Drm_find_dev(void)
 	priv->video_plane = 0;
 	priv->osd_plane = 0;
 	priv->use_zpos = 0;
+	priv->no_prop_cache = no_prop_cache;
 
 	// find the first available connector with modes
 	for (i=0; i < resources->count_connectors; ++i) {
@@ -236,27 +558,21 @@ static int Drm_find_dev(void)
 		}
 		else
 			fprintf(stderr, "Drm_find_dev: get a null connector pointer\n");
+		drmModeFreeConnector(connector);
+		connector = NULL;
 	}
 	if (i == resources->count_connectors) {
 		fprintf(stderr, "Drm_find_dev: No active connector found.\n");
 		goto free_drm_res;
 	}
 
-    // search Modes for HD and HDready
-	for (i = 0; i < connector->count_modes; i++) {
+	// the mode is chosen for the stream in KmsInit()
+	priv->modes = malloc(connector->count_modes * sizeof(*priv->modes));
+	for (i = 0; priv->modes && i < connector->count_modes; i++) {
 		mode = &connector->modes[i];
-		// Mode HD
-		if (mode->hdisplay == 1920 && mode->vdisplay == 1080 && mode->vrefresh == 50
-				&& !(mode->flags & DRM_MODE_FLAG_INTERLACE)) {
-			memcpy(&priv->mode_hd, mode, sizeof(priv->mode_hd));
-			fprintf(stderr, "Drm_find_dev: Find Mode %ix%i@%i\n", mode->hdisplay, mode->vdisplay, mode->vrefresh);
-		}
-		// Mode HDready
-		if (mode->hdisplay == 1280 && mode->vdisplay == 720 && mode->vrefresh == 50
-				&& !(mode->flags & DRM_MODE_FLAG_INTERLACE)) {
-			memcpy(&priv->mode_hdr, mode, sizeof(priv->mode_hdr));
-			fprintf(stderr, "Drm_find_dev: Find Mode %ix%i@%i\n", mode->hdisplay, mode->vdisplay, mode->vrefresh);
-		}
+		if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+			continue;
+		priv->modes[priv->count_modes++] = *mode;
 	}
 
 	// find the encoder matching the first available connector
@@ -270,11 +586,17 @@ static int Drm_find_dev(void)
 			break;
 		} else
 			fprintf(stderr, "Drm_find_dev: get a null encoder pointer\n");
+		drmModeFreeEncoder(encoder);
+		encoder = NULL;
 	}
 	if (i == resources->count_encoders) {
 		fprintf(stderr, "No matching encoder with connector!\n");
 		goto free_drm_res;
 	}
+	for (i = 0; i < resources->count_crtcs; i++) {
+		if (resources->crtcs[i] == priv->crtc_id)
+			priv->crtc_index = i;
+	}
 
 	// find planes
 	if ((plane_res = drmModeGetPlaneResources(fd_drm)) == NULL)
@@ -315,6 +637,10 @@ static int Drm_find_dev(void)
 							priv->video_plane = plane->plane_id;
 							if (plane->plane_id == priv->osd_plane)
 								priv->osd_plane = 0;
+						} else if (priv->count_extra < DRM_MAX_LAYERS - 1
+								&& type == DRM_PLANE_TYPE_OVERLAY) {
+							// more streams, see VideoSetLayers()
+							priv->extra_planes[priv->count_extra++] = plane->plane_id;
 						}
 						fprintf(stderr, "Drm_find_dev: Pixel format 4cc = %.4s plane_id %i zpos %"PRIu64"\n",
 							(char*)&plane->formats[k], priv->video_plane, zpos);
@@ -348,15 +674,37 @@ static int Drm_find_dev(void)
 			priv->video_plane, priv->osd_plane);
 		goto close_fd;
 	}
+	// the OSD keeps its plane
+	for (j = 0; j < priv->count_extra; j++) {
+		if (priv->extra_planes[j] == priv->osd_plane)
+			priv->extra_planes[j--] = priv->extra_planes[--priv->count_extra];
+	}
+
+	// property ids for all commits
+	DrmGetProps(priv, priv->video_plane, DRM_MODE_OBJECT_PLANE);
+	DrmGetProps(priv, priv->osd_plane, DRM_MODE_OBJECT_PLANE);
+	for (j = 0; j < priv->count_extra; j++)
+		DrmGetProps(priv, priv->extra_planes[j], DRM_MODE_OBJECT_PLANE);
+	DrmGetProps(priv, priv->crtc_id, DRM_MODE_OBJECT_CRTC);
+	DrmGetProps(priv, priv->connector_id, DRM_MODE_OBJECT_CONNECTOR);
+
+	priv->vrr_capable = DrmGetPropertyId(priv, priv->crtc_id, DRM_MODE_OBJECT_CRTC, "VRR_ENABLED")
+		&& DrmGetPropertyId(priv, priv->connector_id, DRM_MODE_OBJECT_CONNECTOR, "vrr_capable")
+		&& GetPropertyValue(fd_drm, priv->connector_id, DRM_MODE_OBJECT_CONNECTOR, "vrr_capable");
 
 	d_priv = priv;
 	return 0;
 
 free_drm_res:
 	drmModeFreeEncoder(encoder);
+	drmModeFreeConnector(connector);
 	drmModeFreeResources(resources);
 
 close_fd:
+	if (priv) {
+		free(priv->modes);
+		free(priv);
+	}
 	drmClose(fd_drm);
 
 out:
@@ -368,6 +716,10 @@ static void DrmDestroyFb(int fd_drm, struct drm_buf *buf)
 {
 	struct drm_mode_destroy_dumb dreq;
 
+	if (buf->fence >= 0)
+		close(buf->fence);
+	buf->fence = -1;
+
 	if (munmap(buf->plane[0], buf->size) < 0)
 		fprintf(stderr, "cannot unmap dumb buffer (%d): %m\n", errno);
 
@@ -382,7 +734,7 @@ static void DrmDestroyFb(int fd_drm, struct drm_buf *buf)
 }
 
 
-static int DrmSetupFb(struct drm_buf *buf, uint32_t pix_fmt)
+static int DrmSetupFb(struct drm_buf *buf, uint32_t pix_fmt, int tiled)
 {
 	struct data_priv *priv = d_priv;
 	struct drm_mode_create_dumb cdumb;
@@ -390,10 +742,14 @@ static int DrmSetupFb(struct drm_buf *buf, uint32_t pix_fmt)
 	uint64_t modifiers[4] = { 0, 0, 0, 0 };
 	uint32_t handle[4] = { 0, 0, 0, 0 };
 
+	// 64x32 tiles come in pairs, linear frames only need the pitch
 	uint32_t width = DRM_ALIGN(buf->width, 128);
-	uint32_t height = DRM_ALIGN(buf->height, 64);
-//	uint32_t width = buf->width;
-//	uint32_t height = buf->height;
+	uint32_t height = tiled ? DRM_ALIGN(buf->height, 64) : DRM_ALIGN(buf->height, 2);
+
+	buf->fence = buf->in_fence = buf->dmabuf_fd = -1;
+	buf->src_x = buf->src_y = 0;
+	buf->src_w = buf->width;
+	buf->src_h = buf->height;
 
 	memset(&cdumb, 0, sizeof(struct drm_mode_create_dumb));
 	cdumb.width = width;
@@ -439,22 +795,28 @@ static int DrmSetupFb(struct drm_buf *buf, uint32_t pix_fmt)
 		buf->offset[1] = buf->pitch[0] * height;
 	}
 
-	modifiers[0] = DRM_FORMAT_MOD_SAMSUNG_64_32_TILE;
-	modifiers[1] = DRM_FORMAT_MOD_SAMSUNG_64_32_TILE;
 	fprintf(stderr, "DRM_ALIGN width %d height %d\n", width, height);
 
-	if (drmModeAddFB2WithModifiers(priv->fd_drm, width, height, pix_fmt,
-			handle, buf->pitch, buf->offset, modifiers, &buf->fb_id, DRM_MODE_FB_MODIFIERS)) {
-		fprintf(stderr, "cannot create modifiers framebuffer (%d): %m\n", errno);
-		goto clean_dumb;
+	// tiled only if the plane takes it, linear frames are detiled on copy
+	if (tiled) {
+		modifiers[0] = DRM_FORMAT_MOD_SAMSUNG_64_32_TILE;
+		modifiers[1] = DRM_FORMAT_MOD_SAMSUNG_64_32_TILE;
+		buf->modifier = modifiers[0];
+		if (drmModeAddFB2WithModifiers(priv->fd_drm, width, height, pix_fmt,
+				handle, buf->pitch, buf->offset, modifiers, &buf->fb_id,
+				DRM_MODE_FB_MODIFIERS)) {
+			fprintf(stderr, "cannot create modifiers framebuffer (%d): %m\n", errno);
+			goto clean_dumb;
+		}
+	} else {
+		buf->modifier = DRM_FORMAT_MOD_LINEAR;
+		if (drmModeAddFB2(priv->fd_drm, width, height,
+				pix_fmt, handle, buf->pitch, buf->offset, &buf->fb_id, 0)) {
+			fprintf(stderr, "cannot create framebuffer (%d): %m\n", errno);
+			goto clean_dumb;
+		}
 	}
 
-/*	if (drmModeAddFB2(priv->fd_drm, width, height,
-		pix_fmt, handle, buf->pitch, buf->offset, &buf->fb_id, 0)) {
-		fprintf(stderr, "cannot create framebuffer (%d): %m\n", errno);
-		goto clean_dumb;
-	}*/
-
 	memset(&mdumb, 0, sizeof(struct drm_mode_map_dumb));
 	mdumb.handle = cdumb.handle;
 
@@ -489,6 +851,223 @@ clean_dumb:
 }
 
 
+///
+/// Map a V4L2 capture format to the DRM format and modifier.
+/// @returns the DRM fourcc or 0 if KMS can't take the layout.
+///
+static uint32_t DrmFourcc(uint32_t pixelformat, uint64_t *modifier)
+{
+	*modifier = 0;
+
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV12M:
+		return DRM_FORMAT_NV12;
+	case V4L2_PIX_FMT_NV12MT:
+		*modifier = DRM_FORMAT_MOD_SAMSUNG_64_32_TILE;
+		return DRM_FORMAT_NV12;
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_NV21M:
+		return DRM_FORMAT_NV21;
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YUV420M:
+		return DRM_FORMAT_YUV420;
+	}
+	return 0;
+}
+
+
+static int DrmPlaneFormat(struct data_priv *priv, uint32_t plane_id, uint32_t format)
+{
+	drmModePlanePtr plane;
+	uint32_t i;
+	int found = 0;
+
+	if (!(plane = drmModeGetPlane(priv->fd_drm, plane_id)))
+		return 0;
+	for (i = 0; i < plane->count_formats; i++) {
+		if (plane->formats[i] == format)
+			found = 1;
+	}
+	drmModeFreePlane(plane);
+
+	return found;
+}
+
+
+///
+/// Does the plane take format with modifier? From its IN_FORMATS blob,
+/// planes without one take no modifiers.
+///
+static int DrmPlaneModifier(struct data_priv *priv, uint32_t plane_id, uint32_t format,
+				uint64_t modifier)
+{
+	drmModePropertyBlobPtr blob;
+	struct drm_format_modifier_blob *head;
+	struct drm_format_modifier *mods;
+	uint32_t *formats;
+	uint32_t i, j;
+	int found = 0;
+
+	if (!DrmGetPropertyId(priv, plane_id, DRM_MODE_OBJECT_PLANE, "IN_FORMATS"))
+		return 0;
+	if (!(blob = drmModeGetPropertyBlob(priv->fd_drm, GetPropertyValue(priv->fd_drm,
+			plane_id, DRM_MODE_OBJECT_PLANE, "IN_FORMATS"))))
+		return 0;
+
+	head = blob->data;
+	formats = (uint32_t *)((uint8_t *)head + head->formats_offset);
+	mods = (struct drm_format_modifier *)((uint8_t *)head + head->modifiers_offset);
+	for (i = 0; i < head->count_formats && formats[i] != format; i++)
+		;
+	// each modifier has a bit mask for 64 formats from its offset
+	for (j = 0; i < head->count_formats && j < head->count_modifiers; j++) {
+		if (mods[j].modifier == modifier && i >= mods[j].offset
+				&& i - mods[j].offset < 64
+				&& (mods[j].formats & (1ULL << (i - mods[j].offset))))
+			found = 1;
+	}
+	drmModeFreePropertyBlob(blob);
+
+	return found;
+}
+
+
+static void DrmDestroyPrimeFb(int fd_drm, struct drm_buf *buf)
+{
+	struct drm_gem_close gclose;
+	int i, j;
+
+	if (buf->in_fence >= 0)
+		close(buf->in_fence);
+	if (buf->dmabuf_fd >= 0)
+		close(buf->dmabuf_fd);
+
+	if (buf->fb_id && drmModeRmFB(fd_drm, buf->fb_id) < 0)
+		fprintf(stderr, "cannot remove prime framebuffer (%d): %m\n", errno);
+
+	for (i = 0; i < 4; i++) {
+		if (!buf->prime_handle[i])
+			continue;
+		// planes in the same dmabuf share one handle
+		for (j = 0; j < i; j++) {
+			if (buf->prime_handle[j] == buf->prime_handle[i])
+				break;
+		}
+		if (j < i)
+			continue;
+
+		memset(&gclose, 0, sizeof(gclose));
+		gclose.handle = buf->prime_handle[i];
+		if (drmIoctl(fd_drm, DRM_IOCTL_GEM_CLOSE, &gclose) < 0)
+			fprintf(stderr, "cannot close prime handle (%d): %m\n", errno);
+	}
+	memset(buf, 0, sizeof(*buf));
+	buf->fence = buf->in_fence = buf->dmabuf_fd = -1;
+}
+
+
+///
+/// Import one exported V4L2 capture buffer as framebuffer.
+///
+static int DrmSetupPrimeFb(struct drm_buf *buf, struct dmabuf_frame *frame)
+{
+	struct data_priv *priv = d_priv;
+	uint64_t modifiers[4] = { 0, 0, 0, 0 };
+	uint32_t flags = 0;
+	int i;
+
+	if (!(buf->pix_fmt = DrmFourcc(frame->pixelformat, &buf->modifier))) {
+		fprintf(stderr, "DrmSetupPrimeFb: capture format %.4s not supported\n",
+			(char*)&frame->pixelformat);
+		return -1;
+	}
+	if (buf->modifier) {
+		for (i = 0; i < frame->num_planes; i++)
+			modifiers[i] = buf->modifier;
+		flags = DRM_MODE_FB_MODIFIERS;
+	}
+
+	buf->width = frame->width;
+	buf->height = frame->height;
+	buf->fence = buf->in_fence = buf->dmabuf_fd = -1;
+	// the plane crops the padding of the decoder
+	buf->src_x = frame->visible.left;
+	buf->src_y = frame->visible.top;
+	buf->src_w = frame->visible.width ? frame->visible.width : frame->width;
+	buf->src_h = frame->visible.height ? frame->visible.height : frame->height;
+
+	for (i = 0; i < frame->num_planes; i++) {
+		if (drmPrimeFDToHandle(priv->fd_drm, frame->fd[i], &buf->prime_handle[i])) {
+			fprintf(stderr, "drmPrimeFDToHandle plane %i failed (%d): %m\n", i, errno);
+			goto fail;
+		}
+		buf->pitch[i] = frame->pitch[i];
+		buf->offset[i] = frame->offset[i];
+	}
+
+	if (drmModeAddFB2WithModifiers(priv->fd_drm, buf->width, buf->height, buf->pix_fmt,
+			buf->prime_handle, buf->pitch, buf->offset, modifiers, &buf->fb_id, flags)) {
+		fprintf(stderr, "cannot create prime framebuffer (%d): %m\n", errno);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	DrmDestroyPrimeFb(priv->fd_drm, buf);
+	return -1;
+}
+
+
+///
+/// Export all capture buffers from the decoder and import them into
+/// KMS, so decoded frames can be scanned out without a copy.
+/// @param count	number of capture buffers
+///
+static int KmsImportCapture(unsigned int count)
+{
+	struct data_priv *priv = d_priv;
+	struct drm_layer *l = priv->layer;
+	struct dmabuf_frame frame;
+	unsigned int i;
+	int j, ret;
+
+	if (count > VIDEO_MAX_FRAME)
+		count = VIDEO_MAX_FRAME;
+
+	for (i = 0; i < count; i++) {
+		if (ExportBufferCapture(i, &frame))
+			goto fail;
+
+		ret = DrmSetupPrimeFb(&l->cap_bufs[i], &frame);
+		l->cap_bufs[i].index = i;
+
+		// the GEM handles keep the buffers alive, the first fd is
+		// kept for the fences of the decoder
+		for (j = ret ? 0 : 1; j < frame.num_fds; j++)
+			close(frame.fd[j]);
+		if (ret)
+			goto fail;
+		l->cap_bufs[i].dmabuf_fd = frame.fd[0];
+	}
+
+	fprintf(stderr, "KmsImportCapture: %u capture buffers imported %ix%i\n",
+		count, l->cap_bufs[0].width, l->cap_bufs[0].height);
+
+	l->cap_count = count;
+	l->zero_copy = 1;
+	l->shown_buf = NULL;
+	l->pending_buf = NULL;
+	return 0;
+
+fail:
+	while (i--)
+		DrmDestroyPrimeFb(priv->fd_drm, &l->cap_bufs[i]);
+	return -1;
+}
+
+
 ///
 /// If primary plane support only rgb and overlay plane nv12
 /// must the zpos change. At the end it must change back.
@@ -498,7 +1077,7 @@ void DrmChangePlanes(int back)
 {
 	struct data_priv *priv = d_priv;
 	drmModeAtomicReqPtr ModeReq;
-	const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	const uint32_t flags = 0;
 	uint64_t zpos_video;
 	uint64_t zpos_osd;
 
@@ -512,43 +1091,50 @@ void DrmChangePlanes(int back)
 		zpos_video = priv->zpos_primary;
 		zpos_osd = priv->zpos_overlay;
 	}
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, priv->video_plane,
+	DrmSetPropertyRequest(ModeReq, priv, priv->video_plane,
 			DRM_MODE_OBJECT_PLANE, "zpos", zpos_video);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, priv->osd_plane,
+	DrmSetPropertyRequest(ModeReq, priv, priv->osd_plane,
 			DRM_MODE_OBJECT_PLANE, "zpos", zpos_osd);
 
-	if (drmModeAtomicCommit(priv->fd_drm, ModeReq, flags, NULL) != 0)
+	if (DrmCommit(priv, ModeReq, flags, NULL) != 0)
 		fprintf(stderr, "cannot change planes (%d): %m\n", errno);
 
 	drmModeAtomicFree(ModeReq);
 }
 
 
+static void DrmSetRect(struct data_priv *priv, drmModeAtomicReqPtr ModeReq,
+				uint32_t plane_id, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "CRTC_X", x);
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "CRTC_Y", y);
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "CRTC_W", w);
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "CRTC_H", h);
+}
+
+
 void DrmSetCrtc(struct data_priv *priv, drmModeAtomicReqPtr ModeReq,
 				uint32_t plane_id)
 {
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
-						DRM_MODE_OBJECT_PLANE, "CRTC_X", 0);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
-						DRM_MODE_OBJECT_PLANE, "CRTC_Y", 0);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
-						DRM_MODE_OBJECT_PLANE, "CRTC_W", priv->mode_hd.hdisplay);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
-						DRM_MODE_OBJECT_PLANE, "CRTC_H", priv->mode_hd.vdisplay);
+	DrmSetRect(priv, ModeReq, plane_id, 0, 0, priv->mode.hdisplay, priv->mode.vdisplay);
 }
 
 
 void DrmSetSrc(struct data_priv *priv, drmModeAtomicReqPtr ModeReq,
 				uint32_t plane_id, struct drm_buf *buf)
 {
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
-						DRM_MODE_OBJECT_PLANE, "SRC_X", 0);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
-						DRM_MODE_OBJECT_PLANE, "SRC_Y", 0);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
-						DRM_MODE_OBJECT_PLANE, "SRC_W", buf->width << 16);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
-						DRM_MODE_OBJECT_PLANE, "SRC_H", buf->height << 16);
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "SRC_X", (uint64_t)buf->src_x << 16);
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "SRC_Y", (uint64_t)buf->src_y << 16);
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "SRC_W", (uint64_t)buf->src_w << 16);
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "SRC_H", (uint64_t)buf->src_h << 16);
 }
 
 
@@ -556,20 +1142,20 @@ void DrmSetPlane(uint32_t plane_id, struct drm_buf *buf)
 {
 	struct data_priv *priv = d_priv;
 	drmModeAtomicReqPtr ModeReq;
-	const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	const uint32_t flags = 0;
 
 	if (!(ModeReq = drmModeAtomicAlloc()))
 		fprintf(stderr, "cannot allocate atomic request (%d): %m\n", errno);
 
 	DrmSetCrtc(priv, ModeReq, plane_id);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
 						DRM_MODE_OBJECT_PLANE, "CRTC_ID", priv->crtc_id);
 
 	DrmSetSrc(priv, ModeReq, plane_id, buf);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
 						DRM_MODE_OBJECT_PLANE, "FB_ID", buf->fb_id);
 
-	if (drmModeAtomicCommit(priv->fd_drm, ModeReq, flags, NULL) != 0)
+	if (DrmCommit(priv, ModeReq, flags, NULL) != 0)
 		fprintf(stderr, "cannot set plane (%d): %m\n", errno);
 
 	drmModeAtomicFree(ModeReq);
@@ -580,126 +1166,724 @@ void DrmSetBuf(uint32_t plane_id, struct drm_buf *buf)
 {
 	struct data_priv *priv = d_priv;
 	drmModeAtomicReqPtr ModeReq;
-	const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	const uint32_t flags = 0;
 
 	if (!(ModeReq = drmModeAtomicAlloc()))
 		fprintf(stderr, "cannot allocate atomic request (%d): %m\n", errno);
 
 	DrmSetSrc(priv, ModeReq, plane_id, buf);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, plane_id,
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
 						DRM_MODE_OBJECT_PLANE, "FB_ID", buf->fb_id);
 
-	if (drmModeAtomicCommit(priv->fd_drm, ModeReq, flags, NULL) != 0)
+	if (DrmCommit(priv, ModeReq, flags, NULL) != 0)
 		fprintf(stderr, "cannot set atomic FB (%d): %m\n", errno);
 
 	drmModeAtomicFree(ModeReq);
 }
 
 
-void VideoInit(void)
+///
+/// Take a plane off the CRTC.
+///
+static void DrmDisablePlane(struct data_priv *priv, uint32_t plane_id)
 {
-	struct data_priv *priv;
+	drmModeAtomicReqPtr ModeReq;
 
-	if (Drm_find_dev()){
-		fprintf(stderr, "VideoInit: drm_find_dev() failed\n");
-	}
+	if (!(ModeReq = drmModeAtomicAlloc()))
+		return;
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "FB_ID", 0);
+	DrmSetPropertyRequest(ModeReq, priv, plane_id,
+						DRM_MODE_OBJECT_PLANE, "CRTC_ID", 0);
+	if (DrmCommit(priv, ModeReq, 0, NULL) != 0)
+		fprintf(stderr, "cannot disable plane %u (%d): %m\n", plane_id, errno);
+	drmModeAtomicFree(ModeReq);
+}
 
-	priv = d_priv;
 
-	// set essentials
-	priv->bufs[0].width = priv->bufs[1].width = priv->mode_hdr.hdisplay; // mode_hdr for scaling
-	priv->bufs[0].height = priv->bufs[1].height = priv->mode_hdr.vdisplay;
-	priv->bufs[0].pix_fmt = priv->bufs[1].pix_fmt = DRM_FORMAT_NV12;
-//	priv->buf_osd.pix_fmt = DRM_FORMAT_ARGB8888;
-//	priv->buf_osd.width = priv->mode_hd.hdisplay;
-//	priv->buf_osd.height = priv->mode_hd.vdisplay;
+///
+/// Wait for the outstanding flip and vblank events.
+///
+static void DrmWaitFlips(struct data_priv *priv)
+{
+	while (priv->flip_pending || priv->vblank_pending) {
+		struct pollfd pfd = { .fd = priv->fd_drm, .events = POLLIN };
+		if (poll(&pfd, 1, 100) <= 0)
+			break;
+		if (drmHandleEvent(priv->fd_drm, &priv->ev))
+			fprintf(stderr, "drmHandleEvent failed (%d): %m\n", errno);
+	}
+}
 
-	// save actual modesetting for connector + CRTC
-	priv->saved_crtc = drmModeGetCrtc(priv->fd_drm, priv->crtc_id);
 
+///
+/// Show black on the plane of a layer, before its buffers go away. The
+/// commit blocks until the black buffer is on screen.
+///
+static void DrmShowBlack(struct data_priv *priv, struct drm_layer *l)
+{
 	drmModeAtomicReqPtr ModeReq;
-	const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
-	uint32_t modeID = 0;
-	uint32_t prime_plane;
-	uint32_t overlay_plane;
 
-	if (priv->use_zpos) {
-		prime_plane = priv->osd_plane;
-		overlay_plane = priv->video_plane;
-	} else {
-		prime_plane = priv->video_plane;
-		overlay_plane = priv->osd_plane;
+	if ((ModeReq = drmModeAtomicAlloc())) {
+		DrmSetSrc(priv, ModeReq, l->plane, &priv->buf_black);
+		DrmSetPropertyRequest(ModeReq, priv, l->plane,
+			DRM_MODE_OBJECT_PLANE, "FB_ID", priv->buf_black.fb_id);
+		if (DrmCommit(priv, ModeReq, 0, NULL) != 0)
+			fprintf(stderr, "DrmShowBlack: plane %u (%d): %m\n", l->plane, errno);
+		drmModeAtomicFree(ModeReq);
 	}
-	// OSD FB
-//	if (DrmSetupFb(&priv->buf_osd, DRM_FORMAT_ARGB8888)){
-//		fprintf(stderr, "DrmSetupFb OSD FB failed\n");
-//	}
-	// black FB
-	priv->buf_black.pix_fmt = DRM_FORMAT_NV12;
-	priv->buf_black.width = 1280;
-	priv->buf_black.height = 720;
-	if (DrmSetupFb(&priv->buf_black, DRM_FORMAT_NV12))
-		fprintf(stderr, "VideoInit: DrmSetupFB black FB %i x %i failed\n",
-			priv->buf_black.width, priv->buf_black.height);
+	l->src_x = priv->buf_black.src_x;
+	l->src_y = priv->buf_black.src_y;
+	l->src_w = priv->buf_black.src_w;
+	l->src_h = priv->buf_black.src_h;
+	l->shown_buf = NULL;
+}
+
+
+///
+/// Size the copy framebuffers of a layer for the visible part of the
+/// decoded frames, the plane crops and scales them. The decoder of the
+/// layer must be selected. A framebuffer that can't be set up ends the
+/// set, the layer flips the ones before it.
+/// @returns -1 if the layer is left without framebuffers.
+///
+static int DrmSizeLayer(struct data_priv *priv, struct drm_layer *l)
+{
+	const struct v4l2_rect *r = &dec->cap_rect;
+	AVCodecParameters *par = StreamCodecParameters();
+	uint32_t width = r->left + r->width;
+	uint32_t height = r->top + r->height;
 	unsigned int i;
-	for (i = 0; i < priv->buf_black.width * priv->buf_black.height; ++i) {
-		priv->buf_black.plane[0][i] = 0x10;
-		if (i < priv->buf_black.width * priv->buf_black.height / 2)
-		priv->buf_black.plane[1][i] = 0x80;
+
+	l->sar = par ? par->sample_aspect_ratio : (AVRational){ 0, 1 };
+	if (!r->width || !r->height)
+		return 0;
+
+	// the rows above and left of the picture are copied too
+	if (!l->count_bufs || width != l->bufs[0].width || height != l->bufs[0].height) {
+		fprintf(stderr, "DrmSizeLayer: copy framebuffers %ux%u -> %ux%u\n",
+			l->bufs[0].width, l->bufs[0].height, width, height);
+		DrmWaitFlips(priv);
+		if (l->shown_buf && !l->zero_copy)
+			DrmShowBlack(priv, l);
+		for (i = 0; i < l->count_bufs; i++)
+			DrmDestroyFb(priv->fd_drm, &l->bufs[i]);
+		for (i = 0; i < fb_count; i++) {
+			l->bufs[i].width = width;
+			l->bufs[i].height = height;
+			l->bufs[i].pix_fmt = DRM_FORMAT_NV12;
+			if (DrmSetupFb(&l->bufs[i], DRM_FORMAT_NV12, l->tiled_fbs)) {
+				fprintf(stderr, "DrmSetupFb FB%u of plane %u failed!\n", i, l->plane);
+				break;
+			}
+		}
+		l->count_bufs = i;
+		if (!l->count_bufs)
+			return -1;
+	}
+	for (i = 0; i < l->count_bufs; i++) {
+		l->bufs[i].src_x = r->left;
+		l->bufs[i].src_y = r->top;
+		l->bufs[i].src_w = r->width;
+		l->bufs[i].src_h = r->height;
 	}
+	return 0;
+}
 
-	fprintf(stderr, "Setting mode  %ix%i@%i crtc_id %i prime_plane %i connector_id %i use_zpos %i\n",
-		priv->mode_hd.hdisplay, priv->mode_hd.vdisplay, priv->mode_hd.vrefresh, priv->crtc_id,
-		prime_plane, priv->connector_id, priv->use_zpos);
 
-	if (drmModeCreatePropertyBlob(priv->fd_drm, &priv->mode_hd, sizeof(priv->mode_hd), &modeID) != 0)
-		fprintf(stderr, "Failed to create mode property.\n");
+///
+/// Largest rectangle of the frame's display aspect in the one of the
+/// layer, centred. The black bars are the CRTC background, the plane
+/// scales: no CPU time and no buffer for them. Square pixels on the
+/// screen.
+///
+static void DrmFit(struct drm_layer *l, struct drm_buf *buf, uint32_t *x, uint32_t *y,
+			uint32_t *w, uint32_t *h)
+{
+	uint64_t num = buf->src_w;
+	uint64_t den = buf->src_h;
+
+	if (l->sar.num > 0 && l->sar.den > 0) {
+		num *= l->sar.num;
+		den *= l->sar.den;
+	}
+	*w = l->w;
+	*h = num && den ? l->w * den / num : l->h;
+	if (*h > l->h) {
+		*h = l->h;
+		*w = l->h * num / den;
+	}
+	*x = l->x + (l->w - *w) / 2;
+	*y = l->y + (l->h - *h) / 2;
+}
+
+
+///
+/// Would the plane take the frame in this rectangle? Some primary
+/// planes must cover the whole CRTC.
+///
+static int DrmTestRect(struct data_priv *priv, struct drm_layer *l, struct drm_buf *buf,
+			uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	drmModeAtomicReqPtr ModeReq;
+	int ret;
+
 	if (!(ModeReq = drmModeAtomicAlloc()))
-		fprintf(stderr, "cannot allocate atomic request (%d): %m\n", errno);
+		return -1;
+	DrmSetSrc(priv, ModeReq, l->plane, buf);
+	DrmSetRect(priv, ModeReq, l->plane, x, y, w, h);
+	DrmSetPropertyRequest(ModeReq, priv, l->plane,
+				DRM_MODE_OBJECT_PLANE, "CRTC_ID", priv->crtc_id);
+	DrmSetPropertyRequest(ModeReq, priv, l->plane,
+				DRM_MODE_OBJECT_PLANE, "FB_ID", buf->fb_id);
+	ret = DrmCommit(priv, ModeReq, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicFree(ModeReq);
+
+	return ret;
+}
+
+
+///
+/// A frame of a new size or crop: set the source and the letterboxed
+/// rectangle of the plane.
+///
+static void DrmPlaceFrame(struct data_priv *priv, drmModeAtomicReqPtr ModeReq,
+				struct drm_layer *l, struct drm_buf *buf)
+{
+	uint32_t x, y, w, h;
+
+	DrmFit(l, buf, &x, &y, &w, &h);
+	if ((w != l->w || h != l->h) && DrmTestRect(priv, l, buf, x, y, w, h)) {
+		fprintf(stderr, "DrmPlaceFrame: plane %u can't letterbox (%d): %m, stretched\n",
+			l->plane, errno);
+		x = l->x;
+		y = l->y;
+		w = l->w;
+		h = l->h;
+	}
+	fprintf(stderr, "DrmPlaceFrame: %ux%u at %u,%u on %ux%u at %u,%u\n",
+		buf->src_w, buf->src_h, buf->src_x, buf->src_y, w, h, x, y);
+
+	DrmSetSrc(priv, ModeReq, l->plane, buf);
+	DrmSetRect(priv, ModeReq, l->plane, x, y, w, h);
+	DrmSetPropertyRequest(ModeReq, priv, l->plane,
+				DRM_MODE_OBJECT_PLANE, "CRTC_ID", priv->crtc_id);
+	l->src_x = buf->src_x;
+	l->src_y = buf->src_y;
+	l->src_w = buf->src_w;
+	l->src_h = buf->src_h;
+}
+
+
+///
+/// Can the plane of the current layer show a capture format? Copied
+/// frames must match the layout of the copy framebuffers, only NV12MT
+/// is converted.
+/// @param pixelformat	V4L2 fourcc
+/// @param zero_copy	the capture buffers are scanned out
+///
+static int KmsCaptureFormat(uint32_t pixelformat, int zero_copy)
+{
+	struct data_priv *priv = d_priv;
+	struct drm_layer *l = priv->layer;
+	uint64_t modifier;
+	uint32_t format = DrmFourcc(pixelformat, &modifier);
+
+	if (!format)
+		return 0;
+	// also the fallback if the import fails
+	if (DrmSizeLayer(priv, l))
+		return 0;
+	if (!zero_copy) {
+		l->detile = format == l->bufs[0].pix_fmt && !l->tiled_fbs
+			&& modifier == DRM_FORMAT_MOD_SAMSUNG_64_32_TILE;
+		return l->detile || (format == l->bufs[0].pix_fmt
+			&& modifier == l->bufs[0].modifier);
+	}
+
+	if (modifier && !DrmPlaneModifier(priv, l->plane, format, modifier))
+		return 0;
+	return DrmPlaneFormat(priv, l->plane, format);
+}
+
+
+///
+/// Disable the property id cache, to measure what it saves.
+///
+void VideoSetPropCache(int enable)
+{
+	no_prop_cache = !enable;
+}
+
+
+///
+/// Number of copy framebuffers, 2 .. DRM_MAX_FBS.
+///
+void VideoSetBuffers(unsigned int count)
+{
+	fb_count = count < 2 ? 2 : count > DRM_MAX_FBS ? DRM_MAX_FBS : count;
+}
+
+
+///
+/// Streams shown at once, each on a plane of its own, set before
+/// VideoInit().
+/// @param count	1 .. DRM_MAX_LAYERS
+/// @param pip		the first stream fills the screen, the others are
+///			small windows on it, otherwise a mosaic
+///
+void VideoSetLayers(unsigned int count, int pip)
+{
+	layer_count = count < 1 ? 1 : count > DRM_MAX_LAYERS ? DRM_MAX_LAYERS : count;
+	layer_pip = pip;
+}
+
+
+///
+/// Refresh rate of a mode in mHz, vrefresh is rounded.
+///
+static uint64_t DrmModeRate(const drmModeModeInfo *mode)
+{
+	if (!mode->htotal || !mode->vtotal)
+		return mode->vrefresh * 1000ULL;
+	return (uint64_t)mode->clock * 1000000 / ((uint64_t)mode->htotal * mode->vtotal);
+}
+
+
+///
+/// mHz between the refresh rate of the mode and the nearest multiple of
+/// the frame rate, UINT64_MAX if the rate is lower or fps unknown.
+///
+static uint64_t DrmModeRateError(const drmModeModeInfo *mode, AVRational fps)
+{
+	uint64_t rate = DrmModeRate(mode);
+	uint64_t frame;
+	uint64_t n;
+
+	if (fps.num <= 0 || fps.den <= 0)
+		return UINT64_MAX;
+	frame = (uint64_t)fps.num * 1000 / fps.den;
+	if (!frame || rate < frame)
+		return UINT64_MAX;
+	n = (rate + frame / 2) / frame;
+	return rate > n * frame ? rate - n * frame : n * frame - rate;
+}
+
+
+///
+/// Does the mode show every frame for the same number of vblanks?
+/// Under 0.05 % off: 59.94 Hz is not 60 Hz, they are 0.1 % apart.
+///
+static int DrmModeMatchesRate(const drmModeModeInfo *mode, AVRational fps)
+{
+	uint64_t error = DrmModeRateError(mode, fps);
+
+	return error != UINT64_MAX && error * 2000 < DrmModeRate(mode);
+}
+
+
+///
+/// Order of the candidate modes: large enough for the stream, a refresh
+/// rate that is a multiple of the frame rate, the smallest size, the
+/// rate closest to a multiple, then the highest rate.
+///
+static int DrmModeBetter(const drmModeModeInfo *a, const drmModeModeInfo *b,
+					int width, int height, AVRational fps)
+{
+	int fits_a = a->hdisplay >= width && a->vdisplay >= height;
+	int fits_b = b->hdisplay >= width && b->vdisplay >= height;
+	int match_a = DrmModeMatchesRate(a, fps);
+	int match_b = DrmModeMatchesRate(b, fps);
+	uint32_t area_a = a->hdisplay * a->vdisplay;
+	uint32_t area_b = b->hdisplay * b->vdisplay;
+	uint64_t error_a, error_b;
+
+	if (fits_a != fits_b)
+		return fits_a;
+	if (match_a != match_b)
+		return match_a;
+	if (area_a != area_b)
+		return fits_a ? area_a < area_b : area_a > area_b;
+	// relative error: error_a / rate_a < error_b / rate_b
+	if (match_a) {
+		error_a = DrmModeRateError(a, fps) * DrmModeRate(b);
+		error_b = DrmModeRateError(b, fps) * DrmModeRate(a);
+		if (error_a != error_b)
+			return error_a < error_b;
+	}
+	return DrmModeRate(a) > DrmModeRate(b);
+}
 
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, priv->crtc_id,
+
+///
+/// Fill the modeset for priv->mode: CRTC, connector and the black
+/// buffer on the video plane.
+///
+static void DrmModesetRequest(struct data_priv *priv, drmModeAtomicReqPtr ModeReq,
+				uint32_t modeID, uint32_t prime_plane, uint32_t overlay_plane)
+{
+	DrmSetPropertyRequest(ModeReq, priv, priv->crtc_id,
 						DRM_MODE_OBJECT_CRTC, "MODE_ID", modeID);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, priv->connector_id,
+	DrmSetPropertyRequest(ModeReq, priv, priv->connector_id,
 						DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", priv->crtc_id);
-	DrmSetPropertyRequest(ModeReq, priv->fd_drm, priv->crtc_id,
+	DrmSetPropertyRequest(ModeReq, priv, priv->crtc_id,
 						DRM_MODE_OBJECT_CRTC, "ACTIVE", 1);
+	if (priv->vrr_capable)
+		DrmSetPropertyRequest(ModeReq, priv, priv->crtc_id,
+						DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", priv->vrr);
 	DrmSetCrtc(priv, ModeReq, prime_plane);
 
 	if (priv->use_zpos) {
 		// Primary plane
 //		DrmSetSrc(priv, ModeReq, prime_plane, &priv->buf_osd);
-//		DrmSetPropertyRequest(ModeReq, priv->fd_drm, prime_plane,
+//		DrmSetPropertyRequest(ModeReq, priv, prime_plane,
 //						DRM_MODE_OBJECT_PLANE, "FB_ID", priv->buf_osd.fb_id);
 		// Black Buffer
 		DrmSetCrtc(priv, ModeReq, overlay_plane);
-		DrmSetPropertyRequest(ModeReq, priv->fd_drm, overlay_plane,
+		DrmSetPropertyRequest(ModeReq, priv, overlay_plane,
 						DRM_MODE_OBJECT_PLANE, "CRTC_ID", priv->crtc_id);
 		DrmSetSrc(priv, ModeReq, overlay_plane, &priv->buf_black);
-		DrmSetPropertyRequest(ModeReq, priv->fd_drm, overlay_plane,
+		DrmSetPropertyRequest(ModeReq, priv, overlay_plane,
 						DRM_MODE_OBJECT_PLANE, "FB_ID", priv->buf_black.fb_id);
 	} else {
 		// Black Buffer
 		DrmSetSrc(priv, ModeReq, prime_plane, &priv->buf_black);
-		DrmSetPropertyRequest(ModeReq, priv->fd_drm, prime_plane,
+		DrmSetPropertyRequest(ModeReq, priv, prime_plane,
 						DRM_MODE_OBJECT_PLANE, "FB_ID", priv->buf_black.fb_id);
 	}
-	if (drmModeAtomicCommit(priv->fd_drm, ModeReq, flags, NULL) != 0)
-		fprintf(stderr, "cannot set atomic mode (%d): %m\n", errno);
+}
 
+
+///
+/// Would the kernel take this modeset? Nothing changes on the screen.
+///
+static int DrmTestMode(struct data_priv *priv, uint32_t prime_plane, uint32_t overlay_plane)
+{
+	drmModeAtomicReqPtr ModeReq;
+	uint32_t modeID;
+	int ret = -1;
+
+	if (drmModeCreatePropertyBlob(priv->fd_drm, &priv->mode, sizeof(priv->mode), &modeID))
+		return -1;
+	if ((ModeReq = drmModeAtomicAlloc())) {
+		DrmModesetRequest(priv, ModeReq, modeID, prime_plane, overlay_plane);
+		ret = DrmCommit(priv, ModeReq, DRM_MODE_ATOMIC_TEST_ONLY
+			| DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		drmModeAtomicFree(ModeReq);
+	}
+	drmModeDestroyPropertyBlob(priv->fd_drm, modeID);
+
+	return ret;
+}
+
+
+///
+/// Would the kernel take the per-frame commit with these flags: a new
+/// FB on the video plane, with an out-fence if asked for?
+///
+static int DrmTestFlip(struct data_priv *priv, uint32_t flags, int out_fence)
+{
+	drmModeAtomicReqPtr ModeReq;
+	int32_t fence = -1;
+	int ret;
+
+	if (!(ModeReq = drmModeAtomicAlloc()))
+		return -1;
+	DrmSetSrc(priv, ModeReq, priv->video_plane, &priv->layers[0].bufs[0]);
+	DrmSetPropertyRequest(ModeReq, priv, priv->video_plane,
+					DRM_MODE_OBJECT_PLANE, "FB_ID", priv->layers[0].bufs[0].fb_id);
+	if (out_fence)
+		DrmSetPropertyRequest(ModeReq, priv, priv->crtc_id,
+					DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR", (uintptr_t)&fence);
+	ret = DrmCommit(priv, ModeReq, flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	if (fence >= 0)
+		close(fence);
 	drmModeAtomicFree(ModeReq);
 
-	if (DrmSetupFb(&priv->bufs[0], DRM_FORMAT_NV12)) {
-		fprintf(stderr, "DrmSetupFb FB0 failed!\n");
+	return ret;
+}
+
+
+///
+/// Validate the per-frame commit once, so playback never needs
+/// ALLOW_MODESET and never waits in the kernel for a vblank.
+///
+static void DrmValidateFlip(struct data_priv *priv)
+{
+	priv->flip_flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+	if (priv->out_fences && DrmTestFlip(priv, priv->flip_flags, 1)) {
+		fprintf(stderr, "DrmValidateFlip: out-fences rejected (%d): %m\n", errno);
+		priv->out_fences = 0;
+	}
+	if (!DrmTestFlip(priv, priv->flip_flags, priv->out_fences))
+		return;
+
+	fprintf(stderr, "DrmValidateFlip: non-blocking flip rejected (%d): %m\n", errno);
+	priv->flip_flags = DRM_MODE_PAGE_FLIP_EVENT;
+	if (DrmTestFlip(priv, priv->flip_flags, priv->out_fences))
+		fprintf(stderr, "DrmValidateFlip: the video plane takes no frames (%d): %m\n",
+			errno);
+}
+
+
+///
+/// Choose the mode for the stream size and frame rate, the best one the
+/// kernel accepts. Without a mode for the frame rate VRR lets the frames
+/// set the pace.
+///
+static int DrmSelectMode(struct data_priv *priv, uint32_t prime_plane, uint32_t overlay_plane)
+{
+	AVCodecParameters *par = StreamCodecParameters();
+	AVRational fps = StreamFrameRate();
+	int width = par ? par->width : 0;
+	int height = par ? par->height : 0;
+	drmModeModeInfo tmp;
+	int i, j;
+
+	// unknown size: what the display prefers
+	for (i = 0; (!width || !height) && i < priv->count_modes; i++) {
+		if (priv->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+			width = priv->modes[i].hdisplay;
+			height = priv->modes[i].vdisplay;
+		}
+	}
+
+	// best first
+	for (i = 1; i < priv->count_modes; i++) {
+		for (j = i; j > 0 && DrmModeBetter(&priv->modes[j], &priv->modes[j - 1],
+				width, height, fps); j--) {
+			tmp = priv->modes[j];
+			priv->modes[j] = priv->modes[j - 1];
+			priv->modes[j - 1] = tmp;
+		}
+	}
+
+	for (i = 0; i < priv->count_modes; i++) {
+		priv->mode = priv->modes[i];
+		priv->vrr = priv->vrr_capable && !DrmModeMatchesRate(&priv->mode, fps);
+		if (!DrmTestMode(priv, prime_plane, overlay_plane))
+			break;
+		if (priv->vrr) {
+			priv->vrr = 0;
+			if (!DrmTestMode(priv, prime_plane, overlay_plane))
+				break;
+		}
+		fprintf(stderr, "DrmSelectMode: %ix%i@%.3f rejected (%d): %m\n",
+			priv->mode.hdisplay, priv->mode.vdisplay,
+			DrmModeRate(&priv->mode) / 1000.0, errno);
+	}
+	if (i == priv->count_modes) {
+		fprintf(stderr, "DrmSelectMode: no mode for the connector\n");
+		return -1;
+	}
+
+	fprintf(stderr, "DrmSelectMode: %ix%i@%.3f for %ix%i@%.3f%s\n",
+		priv->mode.hdisplay, priv->mode.vdisplay, DrmModeRate(&priv->mode) / 1000.0,
+		width, height, fps.den ? (double)fps.num / fps.den : 0.0,
+		priv->vrr ? " VRR" : "");
+	return 0;
+}
+
+
+///
+/// Place the layers on the screen: full screen, the PiP windows in the
+/// bottom right corner or a grid of equal tiles.
+///
+static void DrmLayout(struct data_priv *priv)
+{
+	uint32_t width = priv->mode.hdisplay;
+	uint32_t height = priv->mode.vdisplay;
+	uint32_t margin = width / 32;
+	unsigned int cols, rows, i;
+	struct drm_layer *l;
+
+	for (cols = 1; cols * cols < priv->count_layers; cols++)
+		;
+	rows = (priv->count_layers + cols - 1) / cols;
+
+	for (i = 0; i < priv->count_layers; i++) {
+		l = &priv->layers[i];
+		if (priv->count_layers == 1 || (layer_pip && !i)) {
+			l->x = l->y = 0;
+			l->w = width;
+			l->h = height;
+		} else if (layer_pip) {
+			l->w = width / 4;
+			l->h = height / 4;
+			l->x = width - l->w - margin;
+			l->y = height - i * (l->h + margin);
+		} else {
+			l->w = width / cols;
+			l->h = height / rows;
+			l->x = i % cols * l->w;
+			l->y = i / cols * l->h;
+		}
 	}
-	if (DrmSetupFb(&priv->bufs[1], DRM_FORMAT_NV12)) {
-		fprintf(stderr, "DrmSetupFb FB1 failed!\n");
+}
+
+
+///
+/// Copy framebuffers of the stream size and the clock of a layer. The
+/// stream of the layer must be selected.
+///
+static void DrmSetupLayer(struct data_priv *priv, struct drm_layer *l)
+{
+	AVCodecParameters *par = StreamCodecParameters();
+	unsigned int i;
+
+	for (i = 0; i < fb_count; i++) {
+		l->bufs[i].width = par && par->width ? par->width : 1280;
+		l->bufs[i].height = par && par->height ? par->height : 720;
+		l->bufs[i].pix_fmt = DRM_FORMAT_NV12;
+		if (DrmSetupFb(&l->bufs[i], DRM_FORMAT_NV12, l->tiled_fbs)) {
+			fprintf(stderr, "DrmSetupFb FB%u of plane %u failed!\n", i, l->plane);
+			break;
+		}
 	}
+	// only the framebuffers that were set up are flipped and destroyed
+	l->count_bufs = i;
+	l->sar = par ? par->sample_aspect_ratio : (AVRational){ 0, 1 };
+	l->in_fences = !!DrmGetPropertyId(priv, l->plane,
+		DRM_MODE_OBJECT_PLANE, "IN_FENCE_FD");
+
+	// frames are aimed at the vblanks of the mode
+	l->held = -1;
+	l->dec = dec;
+	SchedInit(&l->sched, "kms", DrmModeRate(&priv->mode) ?
+		1000000000000ULL / DrmModeRate(&priv->mode) : 20000000);
+}
+
+
+static int KmsInit(const char *card)
+{
+	struct data_priv *priv;
+	struct drm_layer *l;
+	unsigned int i;
+
+	if (Drm_find_dev(card)){
+		fprintf(stderr, "KmsInit: drm_find_dev() failed\n");
+		return -1;
+	}
+
+	priv = d_priv;
+
+	// one NV12 plane for each stream
+	priv->count_layers = 1 + priv->count_extra < layer_count
+		? 1 + priv->count_extra : layer_count;
+	if (priv->count_layers < layer_count)
+		fprintf(stderr, "KmsInit: %u planes for %u streams\n",
+			priv->count_layers, layer_count);
+	for (i = 0; i < priv->count_layers; i++) {
+		l = &priv->layers[i];
+		l->plane = i ? priv->extra_planes[i - 1] : priv->video_plane;
+		l->held = -1;
+
+		// the plane shows the decoder's tiles, or the CPU converts them
+		l->tiled_fbs = DrmPlaneModifier(priv, l->plane, DRM_FORMAT_NV12,
+			DRM_FORMAT_MOD_SAMSUNG_64_32_TILE);
+		if (!l->tiled_fbs)
+			fprintf(stderr, "KmsInit: plane %u has no 64x32 tiles, detile on copy\n",
+				l->plane);
+	}
+	priv->layer = &priv->layers[0];
+	// threads for copied frames
+	DetileInit(sysconf(_SC_NPROCESSORS_ONLN));
+//	priv->buf_osd.pix_fmt = DRM_FORMAT_ARGB8888;
+//	priv->buf_osd.width = priv->mode.hdisplay;
+//	priv->buf_osd.height = priv->mode.vdisplay;
+
+	// save actual modesetting for connector + CRTC
+	priv->saved_crtc = drmModeGetCrtc(priv->fd_drm, priv->crtc_id);
+
+	drmModeAtomicReqPtr ModeReq;
+	const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	uint32_t modeID = 0;
+	uint32_t prime_plane;
+	uint32_t overlay_plane;
+
+	if (priv->use_zpos) {
+		prime_plane = priv->osd_plane;
+		overlay_plane = priv->video_plane;
+	} else {
+		prime_plane = priv->video_plane;
+		overlay_plane = priv->osd_plane;
+	}
+	// OSD FB
+//	if (DrmSetupFb(&priv->buf_osd, DRM_FORMAT_ARGB8888)){
+//		fprintf(stderr, "DrmSetupFb OSD FB failed\n");
+//	}
+	// black FB
+	priv->buf_black.pix_fmt = DRM_FORMAT_NV12;
+	priv->buf_black.width = 1280;
+	priv->buf_black.height = 720;
+	if (DrmSetupFb(&priv->buf_black, DRM_FORMAT_NV12, priv->layers[0].tiled_fbs)) {
+		fprintf(stderr, "KmsInit: DrmSetupFB black FB %i x %i failed\n",
+			priv->buf_black.width, priv->buf_black.height);
+		goto free_priv;
+	}
+	for (i = 0; i < priv->buf_black.width * priv->buf_black.height; ++i) {
+		priv->buf_black.plane[0][i] = 0x10;
+		if (i < priv->buf_black.width * priv->buf_black.height / 2)
+		priv->buf_black.plane[1][i] = 0x80;
+	}
+
+	if (DrmSelectMode(priv, prime_plane, overlay_plane))
+		goto destroy_black;
+
+	fprintf(stderr, "Setting mode  %ix%i@%i crtc_id %i prime_plane %i connector_id %i use_zpos %i\n",
+		priv->mode.hdisplay, priv->mode.vdisplay, priv->mode.vrefresh, priv->crtc_id,
+		prime_plane, priv->connector_id, priv->use_zpos);
+
+	if (drmModeCreatePropertyBlob(priv->fd_drm, &priv->mode, sizeof(priv->mode), &modeID) != 0)
+		fprintf(stderr, "Failed to create mode property.\n");
+	if (!(ModeReq = drmModeAtomicAlloc()))
+		fprintf(stderr, "cannot allocate atomic request (%d): %m\n", errno);
+
+	DrmModesetRequest(priv, ModeReq, modeID, prime_plane, overlay_plane);
+	if (DrmCommit(priv, ModeReq, flags, NULL) != 0)
+		fprintf(stderr, "cannot set atomic mode (%d): %m\n", errno);
+
+	drmModeAtomicFree(ModeReq);
+
+	// the copy buffers take frames of the stream size, the other layers
+	// get theirs when their stream is selected
+	DrmLayout(priv);
+	DrmSetupLayer(priv, &priv->layers[0]);
+
+	// explicit sync, if the driver has it
+	priv->out_fences = !!DrmGetPropertyId(priv, priv->crtc_id,
+		DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR");
+	DrmValidateFlip(priv);
+	fprintf(stderr, "KmsInit: %u framebuffers, %u layers, fences out %s in %s, %s flips\n",
+		priv->layers[0].count_bufs, priv->count_layers, priv->out_fences ? "yes" : "no",
+		priv->layers[0].in_fences ? "yes" : "no",
+		priv->flip_flags & DRM_MODE_ATOMIC_NONBLOCK ? "non-blocking" : "blocking");
 
 	// init variables page flip
 	memset(&priv->ev, 0, sizeof(priv->ev));
 //	priv->ev.version = DRM_EVENT_CONTEXT_VERSION;
 	priv->ev.version = 2;
 	priv->ev.page_flip_handler = Drm_page_flip_event;
+	priv->ev.vblank_handler = Drm_vblank_event;
+
+	// count the ioctls of the playback only
+	priv->ioctls = 0;
+
+	return 0;
+
+	// nothing is on screen yet
+destroy_black:
+	DrmDestroyFb(priv->fd_drm, &priv->buf_black);
+free_priv:
+	if (priv->saved_crtc)
+		drmModeFreeCrtc(priv->saved_crtc);
+	DetileDeInit();
+	drmClose(priv->fd_drm);
+	free(priv->modes);
+	free(priv);
+	d_priv = NULL;
+	return -1;
 }
 
 
@@ -774,25 +1958,280 @@ void DebugProps(int fd_drm, uint32_t objectID, uint32_t objectType)
 }
 
 
-void StartPlay(void)
+static int KmsFd(void)
+{
+	return d_priv->fd_drm;
+}
+
+
+///
+/// The display takes no frame of the current layer until the next DRM
+/// event: a vblank is awaited, or a flip is pending and the next frame
+/// already waits behind it.
+///
+static int KmsFlipPending(void)
+{
+	struct data_priv *priv = d_priv;
+	struct drm_layer *l = priv->layer;
+
+	if (priv->vblank_pending)
+		return 1;
+	if (!priv->flip_pending)
+		return 0;
+	return l->ready || l->held >= 0 || (!l->zero_copy && !DrmFreeBuf(l));
+}
+
+
+static void KmsHandleEvent(void)
 {
 	struct data_priv *priv = d_priv;
-	struct drm_buf *buf = 0;
-	priv->front_buf = 0;
 
-	buf = &priv->bufs[priv->front_buf];
+	if (drmHandleEvent(priv->fd_drm, &priv->ev))
+		fprintf(stderr, "drmHandleEvent failed (%d): %m\n", errno);
+}
+
+
+///
+/// Show black and destroy the framebuffers of the capture buffers of the
+/// current layer, before the decoder frees them on a source change.
+///
+static void KmsReleaseCapture(void)
+{
+	struct data_priv *priv = d_priv;
+	struct drm_layer *l = priv->layer;
+	unsigned int i;
+
+	DrmWaitFlips(priv);
 
-	DequeueBufferCapture(buf->plane[0], buf->plane[1]);
+	// the decoder frees the buffers, a new clock starts with the new size
+	l->held = -1;
+	l->ready = NULL;
+	l->eos = 0;
+	SchedReset(&l->sched);
 
-	DrmSetBuf(priv->video_plane, buf);
+	if (!l->zero_copy)
+		return;
 
-	priv->front_buf ^= 1;
+	// the plane must not scan out a buffer that is gone
+	DrmShowBlack(priv, l);
+
+	for (i = 0; i < l->cap_count; i++)
+		DrmDestroyPrimeFb(priv->fd_drm, &l->cap_bufs[i]);
+	l->cap_count = 0;
+	l->zero_copy = 0;
 }
 
 
-void VideoDeInit(void)
+///
+/// Take the next decoded frame of each layer that has none waiting.
+/// @returns the number of layers with a frame ready, -EBUSY if one is due
+/// at a later vblank and none is ready, -EPIPE if all streams ended or
+/// the error of a decoder.
+///
+static int DrmGetFrames(struct data_priv *priv)
+{
+	struct decoder *cur = dec;
+	struct drm_layer *l;
+	unsigned int i, active = 0, ended = 0;
+	int ready = 0, busy = 0, ret;
+
+	for (i = 0; i < priv->count_layers; i++) {
+		l = &priv->layers[i];
+		if (!l->dec)
+			continue;
+		active++;
+		// the capture side of the decoder is not set up yet
+		if (l->dec->cap_count && !l->ready && !l->eos) {
+			V4l2Select(l->dec);
+			ret = DrmGetFrame(priv, l, &l->ready);
+			if (ret == -EBUSY)
+				busy = 1;
+			else if (ret == -EPIPE)
+				l->eos = 1;
+			else if (ret < 0 && ret != -EAGAIN && ret != -ENOBUFS) {
+				V4l2Select(cur);
+				return ret;
+			}
+		}
+		ready += !!l->ready;
+		ended += l->eos && !l->ready;
+	}
+	V4l2Select(cur);
+
+	if (ready)
+		return ready;
+	if (active && ended == active)
+		return -EPIPE;
+	return busy ? -EBUSY : 0;
+}
+
+
+///
+/// Flip all layers with a new frame in one commit, if the last flip is
+/// complete.
+/// @returns 1 if a frame was committed, 0 if not, -EPIPE at the end of
+/// all streams.
+///
+static int KmsPresent(void)
 {
 	struct data_priv *priv = d_priv;
+	struct decoder *cur = dec;
+	struct drm_layer *l;
+	struct drm_buf *buf;
+	drmModeAtomicReqPtr ModeReq;
+	int32_t out_fence = -1;
+	unsigned int i;
+	int ret;
+
+	if (priv->vblank_pending)
+		return 0;
+
+	// the decoders run ahead of scanout by one frame
+	ret = DrmGetFrames(priv);
+	if (ret == -EBUSY && !priv->flip_pending) {
+		if (!DrmWaitVblank(priv)) {
+			priv->vblank_pending = 1;
+			return 0;
+		}
+		fprintf(stderr, "KmsPresent: no vblank events (%d): %m, frames not paced\n", errno);
+		priv->no_sched = 1;
+		ret = DrmGetFrames(priv);
+	}
+	if (ret <= 0)
+		return ret == -EBUSY ? 0 : ret;
+	if (priv->flip_pending)
+		return 0;
+
+	if (!(ModeReq = drmModeAtomicAlloc()))
+		fprintf(stderr, "cannot allocate atomic request (%d): %m\n", errno);
+
+	for (i = 0; i < priv->count_layers; i++) {
+		l = &priv->layers[i];
+		if (!(buf = l->ready))
+			continue;
+
+		// first frame, new size or crop
+		if (buf->src_w != l->src_w || buf->src_h != l->src_h
+				|| buf->src_x != l->src_x || buf->src_y != l->src_y)
+			DrmPlaceFrame(priv, ModeReq, l, buf);
+		DrmSetPropertyRequest(ModeReq, priv, l->plane,
+						DRM_MODE_OBJECT_PLANE, "FB_ID", buf->fb_id);
+		if (buf->in_fence >= 0)
+			DrmSetPropertyRequest(ModeReq, priv, l->plane,
+						DRM_MODE_OBJECT_PLANE, "IN_FENCE_FD", buf->in_fence);
+	}
+	if (priv->out_fences)
+		DrmSetPropertyRequest(ModeReq, priv, priv->crtc_id,
+					DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR", (uintptr_t)&out_fence);
+
+	// returns at once, the flip event tells when the frames are on screen
+	if (DrmCommit(priv, ModeReq, priv->flip_flags, priv) != 0) {
+		fprintf(stderr, "cannot page flip %u layers (%d): %m\n",
+			priv->count_layers, errno);
+		ret = 0;
+	} else {
+		priv->flip_pending = 1;
+		ret = 1;
+	}
+
+	for (i = 0; i < priv->count_layers; i++) {
+		l = &priv->layers[i];
+		if (!(buf = l->ready))
+			continue;
+		l->ready = NULL;
+		if (!ret) {
+			if (l->zero_copy) {
+				V4l2Select(l->dec);
+				QueueBufferCapture(buf->index);
+				V4l2Select(cur);
+			}
+		} else {
+			TraceEvent(TRACE_COMMIT, buf->tag);
+			l->pending_buf = buf;
+			// signals when buf is on screen, then the shown buffer is free
+			if (out_fence >= 0 && l->shown_buf && !l->zero_copy) {
+				if (l->shown_buf->fence >= 0)
+					close(l->shown_buf->fence);
+				l->shown_buf->fence = dup(out_fence);
+			}
+		}
+		if (buf->in_fence >= 0) {
+			close(buf->in_fence);
+			buf->in_fence = -1;
+		}
+	}
+	if (out_fence >= 0)
+		close(out_fence);
+
+	drmModeAtomicFree(ModeReq);
+
+	return ret;
+}
+
+
+///
+/// Seek: give back the frames not committed yet, the clock restarts at
+/// the new speed. The frame on screen stays until the next flip.
+///
+static void KmsFlush(unsigned int speed)
+{
+	struct data_priv *priv = d_priv;
+	struct drm_layer *l = priv->layer;
+
+	if (l->held >= 0)
+		QueueBufferCapture(l->held);
+	l->held = -1;
+	if (l->ready && l->zero_copy)
+		QueueBufferCapture(l->ready->index);
+	l->ready = NULL;
+	l->eos = 0;
+	SchedSetSpeed(&l->sched, speed);
+}
+
+
+///
+/// Make layer the current one, for the stream and the decoder selected
+/// now. Its framebuffers are set up on the first call.
+/// @returns -1 if there is no plane for it.
+///
+static int KmsSelect(unsigned int layer)
+{
+	struct data_priv *priv = d_priv;
+	struct drm_layer *l;
+
+	if (layer >= priv->count_layers)
+		return -1;
+	l = &priv->layers[layer];
+	if (!l->count_bufs)
+		DrmSetupLayer(priv, l);
+	l->dec = dec;
+	priv->layer = l;
+	return 0;
+}
+
+
+static void KmsDeInit(void)
+{
+	struct data_priv *priv = d_priv;
+	struct drm_layer *l;
+	unsigned int i;
+
+	// wait for the last flip, its buffer is destroyed below
+	DrmWaitFlips(priv);
+
+	fprintf(stderr, "KmsDeInit: %i frames %lu DRM ioctls (%.1f per frame) property cache %s\n",
+		priv->loops, priv->ioctls, priv->loops ? (double)priv->ioctls / priv->loops : 0.0,
+		priv->no_prop_cache ? "off" : "on");
+	for (i = 0; i < priv->count_layers; i++) {
+		if (priv->layers[i].count_bufs)
+			SchedPrintStats(&priv->layers[i].sched);
+	}
+
+	// the saved CRTC knows nothing of the other planes
+	for (i = 1; i < priv->count_layers; i++) {
+		if (priv->layers[i].src_w)
+			DrmDisablePlane(priv, priv->layers[i].plane);
+	}
 
 	// restore modesettings
 	fprintf(stderr, "main: restore modesettings\n");
@@ -807,12 +2246,159 @@ void VideoDeInit(void)
 	// destroy framebuffer
 //	DrmDestroyFb(priv->fd_drm, &priv->buf_osd);
 	DrmDestroyFb(priv->fd_drm, &priv->buf_black);
-	DrmDestroyFb(priv->fd_drm, &priv->bufs[0]);
-	DrmDestroyFb(priv->fd_drm, &priv->bufs[1]);
+	for (l = priv->layers; l < priv->layers + priv->count_layers; l++) {
+		for (i = 0; i < l->count_bufs; i++)
+			DrmDestroyFb(priv->fd_drm, &l->bufs[i]);
+		for (i = 0; i < l->cap_count; i++)
+			DrmDestroyPrimeFb(priv->fd_drm, &l->cap_bufs[i]);
+	}
+	DetileDeInit();
 
 	DebugMode();
 
 //close_fd:
 	drmClose(priv->fd_drm);
+	free(priv->modes);
 	free(priv);
+	d_priv = NULL;
+}
+
+
+static const struct video_sink kms_sink = {
+	.name = "kms",
+	.init = KmsInit,
+	.deinit = KmsDeInit,
+	.capture_format = KmsCaptureFormat,
+	.import_capture = KmsImportCapture,
+	.release_capture = KmsReleaseCapture,
+	.fd = KmsFd,
+	.flip_pending = KmsFlipPending,
+	.handle_event = KmsHandleEvent,
+	.present = KmsPresent,
+	.flush = KmsFlush,
+	.select = KmsSelect,
+};
+
+static const struct video_sink *sink = NULL;
+
+
+///
+/// Select and open the display sink.
+/// @param name	"kms", "null[:<hz>]" or "file:<path>"
+/// @param card	DRM device of the kms sink
+///
+int VideoInit(const char *name, const char *card)
+{
+	const char *arg = card;
+
+	if (!strcmp(name, "kms")) {
+		sink = &kms_sink;
+	} else if (!strncmp(name, "null", 4) && (!name[4] || name[4] == ':')) {
+		sink = &null_sink;
+		arg = name[4] ? name + 5 : NULL;
+	} else if (!strncmp(name, "file:", 5)) {
+		sink = &file_sink;
+		arg = name + 5;
+	} else {
+		fprintf(stderr, "VideoInit: unknown sink %s\n", name);
+		return -1;
+	}
+
+	if (layer_count > 1 && !sink->select) {
+		fprintf(stderr, "VideoInit: the %s sink shows one stream\n", sink->name);
+		sink = NULL;
+		return -1;
+	}
+	if (sink->init(arg)) {
+		sink = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+void VideoDeInit(void)
+{
+	if (sink)
+		sink->deinit();
+	sink = NULL;
+}
+
+
+///
+/// Can the sink show a capture format? Without a sink, e.g. --bench,
+/// the native format of the decoder is fine.
+///
+int VideoCaptureFormat(uint32_t pixelformat, int zero_copy)
+{
+	if (!sink)
+		return 1;
+	return sink->capture_format(pixelformat, zero_copy);
+}
+
+
+int VideoImportCapture(unsigned int count)
+{
+	return sink->import_capture(count);
+}
+
+
+void VideoReleaseCapture(void)
+{
+	sink->release_capture();
+}
+
+
+///
+/// fd to poll for POLLIN, or -1 if the sink never waits.
+///
+int VideoFd(void)
+{
+	return sink->fd();
+}
+
+
+int VideoFlipPending(void)
+{
+	return sink->flip_pending();
+}
+
+
+void VideoHandleEvent(void)
+{
+	sink->handle_event();
+}
+
+
+///
+/// Show the next decoded frame, if the sink is ready for it.
+/// @returns 1 if a frame was taken, 0 if not, -EPIPE at end of stream.
+///
+int VideoPresent(void)
+{
+	return sink->present();
+}
+
+
+///
+/// Drop the decoded frames not shown yet, after V4l2Flush().
+/// @param speed	1 normal, n shows the frames n times faster
+///
+void VideoFlush(unsigned int speed)
+{
+	sink->flush(speed);
+}
+
+
+///
+/// Make the layer of a stream the current one, for the stream and the
+/// decoder selected now. The calls above act on the current layer,
+/// VideoPresent() on all of them.
+/// @returns -1 if the sink has no plane for it.
+///
+int VideoSelect(unsigned int layer)
+{
+	if (!sink->select)
+		return layer ? -1 : 0;
+	return sink->select(layer);
 }
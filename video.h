@@ -1,9 +1,50 @@
 
-void VideoInit(void);
+///
+/// Display sink: atomic KMS, a paced null sink or a file.
+///
+struct video_sink {
+	const char *name;
+	int (*init)(const char *arg);
+	void (*deinit)(void);
+	int (*capture_format)(uint32_t pixelformat, int zero_copy);
+	int (*import_capture)(unsigned int count);
+	void (*release_capture)(void);
+	int (*fd)(void);
+	int (*flip_pending)(void);
+	void (*handle_event)(void);
+	int (*present)(void);
+	void (*flush)(unsigned int speed);
+	int (*select)(unsigned int layer);	///< NULL: one stream only
+};
+
+
+void VideoSetPropCache(int enable);
+
+void VideoSetBuffers(unsigned int count);
+
+void VideoSetLayers(unsigned int count, int pip);
+
+int VideoInit(const char *name, const char *card);
+
+int VideoCaptureFormat(uint32_t pixelformat, int zero_copy);
+
+int VideoImportCapture(unsigned int count);
+
+void VideoReleaseCapture(void);
 
 void VideoDeInit(void);
 
 void Drm_page_flip_event(int fd, unsigned int frame, unsigned int sec,
 					unsigned int usec, void *data);
 
-void StartPlay(void);
+int VideoFd(void);
+
+int VideoFlipPending(void);
+
+void VideoHandleEvent(void);
+
+int VideoPresent(void);
+
+void VideoFlush(unsigned int speed);
+
+int VideoSelect(unsigned int layer);